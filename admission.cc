@@ -0,0 +1,116 @@
+#include "admission.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+const char* const kKindNames[kAdmissionKinds] = {
+  "Login", "List", "ListUsers", "Follow", "UnFollow", "FollowMany", "UnFollowMany", "Post", "Search", "SuggestFollows"
+};
+
+struct ParsedLimit {
+  int64_t interval = 0;
+  int64_t burst = 0;
+};
+
+bool takeLimited(TokenBucket& bucket, int64_t now, const std::atomic<int64_t>& interval,
+                 const std::atomic<int64_t>& burst) {
+  int64_t ns = interval.load(std::memory_order_relaxed);
+  return ns == 0 || bucket.take(now, ns, burst.load(std::memory_order_relaxed));
+}
+
+}  // namespace
+
+const char* admissionKindName(AdmissionKind kind) {
+  return kKindNames[(size_t)kind];
+}
+
+bool TokenBucket::take(int64_t now, int64_t interval, int64_t burst) {
+  int64_t full_at = full_at_.load(std::memory_order_relaxed);
+  while (true)
+  {
+    // a bucket that has been full for a while is just full
+    int64_t next = (full_at > now ? full_at : now) + interval;
+    if (next - now > burst)
+      return false;
+    if (full_at_.compare_exchange_weak(full_at, next, std::memory_order_relaxed))
+      return true;
+  }
+}
+
+void TokenBucket::refund(int64_t interval) {
+  // a bucket that filled up since is full either way: take() never looks
+  // further back than now
+  full_at_.fetch_sub(interval, std::memory_order_relaxed);
+}
+
+bool AdmissionControl::limited(AdmissionKind kind) const {
+  size_t i = (size_t)kind;
+  return user_limits_[i].interval.load(std::memory_order_relaxed) != 0 ||
+         global_limits_[i].interval.load(std::memory_order_relaxed) != 0;
+}
+
+bool AdmissionControl::admit(AdmissionKind kind, UserBuckets* user, int64_t now) {
+  size_t i = (size_t)kind;
+  // the user's own bucket first, so someone over their limit doesn't also
+  // use up everyone else's tokens
+  int64_t user_interval = user != nullptr ? user_limits_[i].interval.load(std::memory_order_relaxed) : 0;
+  if (user_interval != 0 &&
+      !user->kinds[i].take(now, user_interval, user_limits_[i].burst.load(std::memory_order_relaxed)))
+    return false;
+  if (takeLimited(global_buckets_[i], now, global_limits_[i].interval, global_limits_[i].burst))
+    return true;
+  // refused for everyone's sake, so it doesn't count against the user
+  if (user_interval != 0)
+    user->kinds[i].refund(user_interval);
+  return false;
+}
+
+bool AdmissionControl::load(const std::string& path, std::string* error) {
+  std::ifstream in(path);
+  if (!in)
+  {
+    *error = "cannot open " + path;
+    return false;
+  }
+
+  ParsedLimit user[kAdmissionKinds];
+  ParsedLimit global[kAdmissionKinds];
+  std::string line;
+  for (int line_no = 1; std::getline(in, line); line_no++)
+  {
+    std::istringstream fields(line);
+    std::string kind, scope, extra;
+    double rate = 0;
+    if (!(fields >> kind) || kind[0] == '#')
+      continue;
+    fields >> scope >> rate;
+    double burst = rate;
+    if (!(fields >> burst))
+      fields.clear();
+    size_t i = 0;
+    while (i < kAdmissionKinds && kind != kKindNames[i])
+      i++;
+    if (i == kAdmissionKinds || (scope != "user" && scope != "all") || !(rate > 0) || !(burst >= 1) ||
+        (fields >> extra))
+    {
+      *error = path + ":" + std::to_string(line_no) + ": expected \"<kind> user|all <per_second> [<burst>]\"";
+      return false;
+    }
+    ParsedLimit& limit = scope == "user" ? user[i] : global[i];
+    limit.interval = std::max<int64_t>(1, std::llround(1e9 / rate));
+    limit.burst = limit.interval * (int64_t)std::floor(burst);
+  }
+
+  for (size_t i = 0; i < kAdmissionKinds; i++)
+  {
+    user_limits_[i].burst.store(user[i].burst, std::memory_order_relaxed);
+    user_limits_[i].interval.store(user[i].interval, std::memory_order_relaxed);
+    global_limits_[i].burst.store(global[i].burst, std::memory_order_relaxed);
+    global_limits_[i].interval.store(global[i].interval, std::memory_order_relaxed);
+  }
+  return true;
+}
@@ -0,0 +1,94 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// What admission is decided for: the client RPCs, and each post on a
+// Timeline stream
+enum class AdmissionKind {
+  LOGIN,
+  LIST,
+  LIST_USERS,
+  FOLLOW,
+  UNFOLLOW,
+  FOLLOW_MANY,
+  UNFOLLOW_MANY,
+  POST,
+  SEARCH,
+  SUGGEST_FOLLOWS
+};
+
+const size_t kAdmissionKinds = 10;
+
+// the method name the kind is known by in the limits file and in metrics
+const char* admissionKindName(AdmissionKind kind);
+
+/*
+ * A token bucket kept as a single atomic: the time at which it would be
+ * full again (GCRA). Taking a token moves that time one interval further;
+ * a take that would push it more than a burst past now is refused. So
+ * there is no refill to run, and a take is one load and one CAS.
+ */
+class TokenBucket {
+public:
+  // interval: ns per token; burst: ns worth of tokens the bucket holds
+  bool take(int64_t now, int64_t interval, int64_t burst);
+
+  // puts back a token taken for a call that was refused after all
+  void refund(int64_t interval);
+
+private:
+  std::atomic<int64_t> full_at_{0};
+};
+
+// Per-user buckets, one per kind; part of every Client
+struct UserBuckets {
+  TokenBucket kinds[kAdmissionKinds];
+};
+
+/*
+ * Rate limits per kind of call, both per user and over all users, that can
+ * be replaced while calls are being admitted. A kind with no limit costs
+ * one relaxed load.
+ *
+ * Limits are read from a file with one limit per line:
+ *
+ *   <kind> user|all <per_second> [<burst>]
+ *
+ * e.g. "Post user 5 20" or "Follow all 2000". Blank lines and lines
+ * starting with # are skipped, the burst defaults to one second's worth,
+ * and kinds not in the file are unlimited.
+ */
+class AdmissionControl {
+public:
+  AdmissionControl() = default;
+
+  AdmissionControl(const AdmissionControl&) = delete;
+  AdmissionControl& operator=(const AdmissionControl&) = delete;
+
+  // whether any limit applies to kind
+  bool limited(AdmissionKind kind) const;
+
+  // takes a token from user's bucket (if user isn't nullptr) and then from
+  // the shared one; false if either is empty, and then neither is charged
+  bool admit(AdmissionKind kind, UserBuckets* user, int64_t now);
+
+  // replaces every limit with the file's; on a bad file the limits stay
+  // as they were and error says why
+  bool load(const std::string& path, std::string* error);
+
+private:
+  struct Limit {
+    std::atomic<int64_t> interval{0};  // 0: unlimited
+    std::atomic<int64_t> burst{0};
+  };
+
+  Limit user_limits_[kAdmissionKinds];
+  Limit global_limits_[kAdmissionKinds];
+  TokenBucket global_buckets_[kAdmissionKinds];
+};
+
+#endif
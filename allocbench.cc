@@ -0,0 +1,142 @@
+/*
+ * Counts heap allocations per broadcast message on the server's and the
+ * client's message paths, with and without protobuf arenas, and the cost
+ * of encoding one post for every follower versus once for all of them.
+ *
+ *   ./allocbench [-n messages] [-l message_length] [-f followers]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <google/protobuf/arena.h>
+#include <grpcpp/impl/codegen/proto_utils.h>
+
+#include "fanout.h"
+#include "sns.pb.h"
+
+using csce662::Message;
+
+static std::atomic<uint64_t> allocations{0};
+
+// Every replaced allocation function goes through countedNew and every
+// replaced deallocation function through countedDelete. Neither is
+// inlined, so the compiler never pairs a malloc inside one with a delete
+// expression somewhere else (-Wmismatched-new-delete)
+__attribute__((noinline)) static void* countedNew(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) static void countedDelete(void* p) noexcept { std::free(p); }
+
+void* operator new(size_t size) { return countedNew(size); }
+void* operator new[](size_t size) { return countedNew(size); }
+void operator delete(void* p) noexcept { countedDelete(p); }
+void operator delete[](void* p) noexcept { countedDelete(p); }
+void operator delete(void* p, size_t) noexcept { countedDelete(p); }
+void operator delete[](void* p, size_t) noexcept { countedDelete(p); }
+
+// The post as tsd built it before arenas: a heap copy of the read message
+static std::shared_ptr<const Message> heapPost(const Message& message) {
+  return std::make_shared<const Message>(message);
+}
+
+// tsc's MakeMessage before arenas: Message and Timestamp allocated separately
+static Message heapClientMessage(const std::string& username, const std::string& msg) {
+  Message m;
+  m.set_username(username);
+  m.set_msg(msg);
+  google::protobuf::Timestamp* timestamp = new google::protobuf::Timestamp();
+  timestamp->set_seconds(time(NULL));
+  timestamp->set_nanos(0);
+  m.set_allocated_timestamp(timestamp);
+  return m;
+}
+
+static Message* arenaClientMessage(google::protobuf::Arena* arena, const std::string& username, const std::string& msg) {
+  Message* m = google::protobuf::Arena::CreateMessage<Message>(arena);
+  m->set_username(username);
+  m->set_msg(msg);
+  m->mutable_timestamp()->set_seconds(time(NULL));
+  return m;
+}
+
+template <typename F>
+static void measure(const std::string& name, int n, F&& f) {
+  uint64_t before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++)
+    f(i);
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  uint64_t count = allocations.load() - before;
+  std::cout << name << ": " << (double)count / n << " mallocs/msg, "
+            << secs * 1e9 / n << " ns/msg" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  int n = 1000000;
+  size_t length = 80;
+  int followers = 100;
+
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "n:l:f:")) != -1){
+    switch(opt) {
+      case 'n':
+        n = std::atoi(optarg);break;
+      case 'l':
+        length = std::strtoul(optarg, nullptr, 10);break;
+      case 'f':
+        followers = std::atoi(optarg);break;
+      default:
+        std::cerr << "Invalid Command Line Argument\n";
+    }
+  }
+
+  const std::string username = "benchmark_user";
+  const std::string text(length, 'x');
+
+  Message read;
+  read.set_username(username);
+  read.set_msg(text);
+  read.mutable_timestamp()->set_seconds(time(NULL));
+
+  std::cout << n << " messages of " << length << " bytes" << std::endl;
+
+  measure("server post, heap ", n, [&](int) { std::shared_ptr<const Message> p = heapPost(read); });
+  measure("server post, arena", n, [&](int) { Post p = makePost(read); });
+
+  // what each follower's stream costs once the post is built
+  int posts = std::max(1, n / followers);
+  std::cout << posts << " posts to " << followers << " followers" << std::endl;
+  measure("broadcast, encode per follower", posts, [&](int) {
+    Post p = makePost(read);
+    for (int i = 0; i < followers; i++) {
+      grpc::ByteBuffer buffer;
+      bool own_buffer;
+      grpc::SerializationTraits<Message>::Serialize(p->message(), &buffer, &own_buffer);
+    }
+  });
+  measure("broadcast, shared wire bytes ", posts, [&](int) {
+    Post p = makePost(read);
+    for (int i = 0; i < followers; i++)
+      grpc::ByteBuffer buffer(p->wire());
+  });
+
+  measure("client msg, heap  ", n, [&](int) { Message m = heapClientMessage(username, text); });
+  google::protobuf::Arena arena;
+  measure("client msg, arena ", n, [&](int i) {
+    arenaClientMessage(&arena, username, text);
+    if ((i + 1) % 256 == 0)
+      arena.Reset();
+  });
+
+  return 0;
+}
@@ -0,0 +1,150 @@
+#include "async_log.h"
+
+#include <chrono>
+
+namespace {
+
+// how long an idle writer sleeps before looking at the ring again
+const std::chrono::milliseconds kIdleWait(20);
+
+size_t roundUpToPowerOfTwo(size_t n) {
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+}  // namespace
+
+AsyncLog::AsyncLog(size_t capacity)
+  : capacity_(roundUpToPowerOfTwo(capacity < 2 ? 2 : capacity)),
+    slots_(new Slot[capacity_]) {
+  for (size_t i = 0; i < capacity_; i++)
+    slots_[i].seq.store(i, std::memory_order_relaxed);
+}
+
+AsyncLog::~AsyncLog() {
+  stop();
+}
+
+void AsyncLog::start() {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (!writer_.joinable())
+    writer_ = std::thread(&AsyncLog::writerLoop, this);
+}
+
+void AsyncLog::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  wake_cv_.notify_all();
+  if (writer_.joinable())
+    writer_.join();
+}
+
+bool AsyncLog::write(google::LogSeverity severity, const char* file, int line, std::string text) {
+  const uint64_t mask = capacity_ - 1;
+  uint64_t pos = tail_.load(std::memory_order_relaxed);
+  Slot* slot;
+  while (true)
+  {
+    slot = &slots_[pos & mask];
+    int64_t diff = (int64_t)slot->seq.load(std::memory_order_acquire) - (int64_t)pos;
+    if (diff == 0)
+    {
+      // the slot is free; claim it unless another producer got there first
+      if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+    {
+      // the writer hasn't caught up with a full lap: drop, don't wait
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    else
+    {
+      pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->record.severity = severity;
+  slot->record.file = file;
+  slot->record.line = line;
+  slot->record.text = std::move(text);
+  slot->seq.store(pos + 1, std::memory_order_release);
+
+  // errors go out right away; a busy ring gets drained every half lap
+  if (severity >= google::ERROR || (pos & (capacity_ / 2 - 1)) == 0)
+    wake_cv_.notify_one();
+  return true;
+}
+
+bool AsyncLog::pop(Record* record) {
+  Slot& slot = slots_[head_ & (capacity_ - 1)];
+  if (slot.seq.load(std::memory_order_acquire) != head_ + 1)
+    return false;
+  *record = std::move(slot.record);
+  // hand the slot back to producers for the next lap
+  slot.seq.store(head_ + capacity_, std::memory_order_release);
+  head_++;
+  return true;
+}
+
+bool AsyncLog::traceAllowed() {
+  uint32_t rate = trace_rate_.load(std::memory_order_relaxed);
+  if (rate == 0)
+    return false;
+
+  int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  int64_t second = trace_second_.load(std::memory_order_relaxed);
+  // the first trace of a new second starts a fresh budget
+  if (second != now && trace_second_.compare_exchange_strong(second, now, std::memory_order_relaxed))
+    trace_used_.store(0, std::memory_order_relaxed);
+
+  if (trace_used_.fetch_add(1, std::memory_order_relaxed) < rate)
+    return true;
+  suppressed_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+size_t AsyncLog::drain() {
+  Record record;
+  size_t n = 0;
+  while (pop(&record))
+  {
+    google::LogMessage(record.file, record.line, record.severity).stream() << record.text;
+    n++;
+  }
+
+  uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+  if (dropped != reported_dropped_)
+  {
+    google::LogMessage(__FILE__, __LINE__, google::WARNING).stream()
+        << dropped - reported_dropped_ << " log records dropped, the log ring was full";
+    reported_dropped_ = dropped;
+    n++;
+  }
+
+  // one flush for the whole batch
+  if (n > 0)
+    google::FlushLogFiles(google::INFO);
+  return n;
+}
+
+void AsyncLog::writerLoop() {
+  while (true)
+  {
+    if (drain() > 0)
+      continue;
+
+    std::unique_lock<std::mutex> lock(mu_);
+    if (stopping_)
+      break;
+    wake_cv_.wait_for(lock, kIdleWait);
+  }
+  // anything written while stopping
+  drain();
+}
@@ -0,0 +1,88 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <glog/logging.h>
+
+/*
+ * Logging that never makes the caller wait for the disk.
+ *
+ * write() puts the record in a fixed-size lock-free ring and returns; if
+ * the ring is full the record is dropped and counted rather than waited
+ * for. A background thread takes everything that has accumulated, hands it
+ * to glog and flushes once per batch, so a burst of log lines costs one
+ * flush instead of one each. File rotation is glog's (--max_log_size).
+ *
+ * Per-message tracing goes through traceAllowed(), which lets at most a set
+ * number of trace lines through per second and costs a single relaxed load
+ * while tracing is off.
+ */
+class AsyncLog {
+public:
+  explicit AsyncLog(size_t capacity = 8192);
+  ~AsyncLog();
+
+  AsyncLog(const AsyncLog&) = delete;
+  AsyncLog& operator=(const AsyncLog&) = delete;
+
+  // starts the writer; records written before this wait in the ring
+  void start();
+
+  // emits everything queued so far and stops the writer
+  void stop();
+
+  // never blocks; false if the record had to be dropped
+  bool write(google::LogSeverity severity, const char* file, int line, std::string text);
+
+  // trace lines allowed per second; 0 turns tracing off
+  void setTraceRate(uint32_t per_second) { trace_rate_.store(per_second, std::memory_order_relaxed); }
+  bool traceAllowed();
+
+  uint64_t droppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+  uint64_t suppressedTraces() const { return suppressed_.load(std::memory_order_relaxed); }
+
+private:
+  struct Record {
+    google::LogSeverity severity;
+    const char* file;
+    int line;
+    std::string text;
+  };
+
+  // a ring slot; seq says whose turn it is (Vyukov's bounded queue)
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    Record record;
+  };
+
+  bool pop(Record* record);
+  void writerLoop();
+  size_t drain();
+
+  const size_t capacity_;   // a power of two
+  std::unique_ptr<Slot[]> slots_;
+  alignas(64) std::atomic<uint64_t> tail_{0};   // next slot producers claim
+  alignas(64) uint64_t head_ = 0;               // next slot the writer reads
+
+  std::atomic<uint64_t> dropped_{0};
+  uint64_t reported_dropped_ = 0;
+
+  std::atomic<uint32_t> trace_rate_{0};
+  std::atomic<int64_t> trace_second_{0};
+  std::atomic<uint32_t> trace_used_{0};
+  std::atomic<uint64_t> suppressed_{0};
+
+  std::mutex mu_;
+  std::condition_variable wake_cv_;
+  bool stopping_ = false;
+  std::thread writer_;
+};
+
+#endif
@@ -28,6 +28,8 @@ void IClient::displayTitle() const
   std::cout << " FOLLOW <username>\n";
   std::cout << " UNFOLLOW <username>\n";
   std::cout << " LIST\n";
+  std::cout << " SEARCH <words>\n";
+  std::cout << " SUGGEST\n";
   std::cout << " TIMELINE\n";
   std::cout << "=====================================\n";
 }
@@ -50,7 +52,7 @@ std::string IClient::getCommand() const
       input = cmd + " " + argument;
     } else {
       toUpperCase(input);
-      if (input != "LIST" && input != "TIMELINE") {
+      if (input != "LIST" && input != "TIMELINE" && input != "SUGGEST") {
 	std::cout << "Invalid Command\n";
 	continue;
       }
@@ -66,7 +68,7 @@ void IClient::displayCommandReply(const std::string& comm, const IReply& reply)
     switch (reply.comm_status) {
     case SUCCESS:
       std::cout << "Command completed successfully\n";
-      if (comm == "LIST") {
+      if (comm == "LIST" && !reply.list_streamed) {
 	std::cout << "All users: ";
 	for (std::string room : reply.all_users) {
 	  std::cout << room << ", ";
@@ -134,6 +136,23 @@ void displayPostMessage(const std::string& sender, const std::string& message, s
   std::cout << sender << " (" << t_str << ") >> " << message << std::endl;
 }
 
+/*
+ * displayListPage/displayListEnd render a LIST as its pages arrive
+ */
+void displayListPage(const std::string& title, const std::vector<std::string>& users, bool first_page)
+{
+  if (first_page)
+    std::cout << title << ": ";
+  for (const std::string& user : users)
+    std::cout << user << ", ";
+  std::cout << std::flush;
+}
+
+void displayListEnd()
+{
+  std::cout << std::endl;
+}
+
 void displayReConnectionMessage(const std::string& host, const std::string & port) {
   std::cout << "Reconnecting to " << host << ":" << port << "..." << std::endl;
 }
@@ -30,6 +30,8 @@ enum IStatus
  * ireply.comm_status = one of values in IStatus enum
  * reply.users = list of all users who connected to the server at least onece
  * reply.followers = list of users who following current user;
+ * reply.list_streamed = true if the lists were already displayed page by
+ *                       page (with displayListPage) instead of being stored
  *
  * This structure is not for communicating between server and client.
  * You need to design your own rules for the communication.
@@ -40,11 +42,14 @@ struct IReply
     enum IStatus comm_status;
     std::vector<std::string> all_users;
     std::vector<std::string> followers;
+    bool list_streamed = false;
 };
 
 
 std::string getPostMessage();
 void displayPostMessage(const std::string& sender, const std::string& message, std::time_t& time);
+void displayListPage(const std::string& title, const std::vector<std::string>& users, bool first_page);
+void displayListEnd();
   
 class IClient
 {
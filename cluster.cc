@@ -0,0 +1,164 @@
+#include "cluster.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+
+#include <grpcpp/grpcpp.h>
+
+using csce662::DeliverRequest;
+using csce662::Reply;
+
+namespace {
+
+// a Deliver that takes longer than this is given up, and its posts dropped
+const std::chrono::seconds kDeliverDeadline(5);
+
+// posts waiting for one peer before new ones are dropped
+const size_t kPeerQueueCapacity = 100000;
+
+// the metadata entry a node's calls carry the cluster key in
+const char kKeyHeader[] = "tsd-cluster-key";
+
+// compares every byte whatever the first difference, so the time a refused
+// call takes says nothing about how much of the key it got right
+bool sameKey(const std::string& a, grpc::string_ref b) {
+  if (a.size() != b.size())
+    return false;
+  unsigned char diff = 0;
+  for (size_t i = 0; i < a.size(); i++)
+    diff |= a[i] ^ b.data()[i];
+  return diff == 0;
+}
+
+}  // namespace
+
+uint64_t HashRing::hash(const std::string& key) {
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char ch : key) {
+    h ^= ch;
+    h *= 1099511628211ULL;
+  }
+  // FNV alone leaves similar names close together on the ring
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+HashRing::HashRing(const std::vector<std::string>& nodes) {
+  for (uint32_t node = 0; node < nodes.size(); node++)
+    for (int v = 0; v < kVirtualNodes; v++)
+      points_.emplace_back(hash(nodes[node] + "#" + std::to_string(v)), node);
+  std::sort(points_.begin(), points_.end());
+}
+
+uint32_t HashRing::ownerOf(const std::string& key) const {
+  auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(hash(key), uint32_t(0)));
+  if (it == points_.end())
+    it = points_.begin();   // wrap around
+  return it->second;
+}
+
+PeerLink::PeerLink(const std::string& address, size_t capacity, const std::string& key)
+  : address_(address), capacity_(capacity), key_(key),
+    stub_(csce662::PeerService::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()))),
+    sender_(&PeerLink::senderLoop, this) {}
+
+PeerLink::~PeerLink() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  sender_.join();
+}
+
+void PeerLink::send(const Post& post) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (queue_.size() >= capacity_) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    queue_.push_back(post);
+  }
+  cv_.notify_one();
+}
+
+void PeerLink::senderLoop() {
+  DeliverRequest request;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_)
+        return;
+      request.Clear();
+      while (!queue_.empty() && (size_t)request.posts_size() < kMaxBatch) {
+        *request.add_posts() = queue_.front()->message();
+        queue_.pop_front();
+      }
+    }
+
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + kDeliverDeadline);
+    Cluster::authorize(key_, &context);
+    Reply reply;
+    if (stub_->Deliver(&context, request, &reply).ok())
+      sent_.fetch_add(request.posts_size(), std::memory_order_relaxed);
+    else
+      dropped_.fetch_add(request.posts_size(), std::memory_order_relaxed);
+  }
+}
+
+void Cluster::authorize(const std::string& key, grpc::ClientContext* context) {
+  context->AddMetadata(kKeyHeader, key);
+}
+
+bool Cluster::fromMember(const grpc::ServerContext& context) const {
+  if (key_.empty())
+    return false;
+  auto entry = context.client_metadata().find(kKeyHeader);
+  return entry != context.client_metadata().end() && sameKey(key_, entry->second);
+}
+
+bool Cluster::init(const std::string& nodes, const std::string& self, const std::string& key_path,
+                   std::string* error) {
+  addresses_.clear();
+  size_t start = 0;
+  while (start <= nodes.size()) {
+    size_t comma = nodes.find(',', start);
+    if (comma == std::string::npos)
+      comma = nodes.size();
+    if (comma > start)
+      addresses_.push_back(nodes.substr(start, comma - start));
+    start = comma + 1;
+  }
+
+  if (addresses_.empty()) {
+    addresses_.push_back(self);
+    return true;
+  }
+  auto it = std::find(addresses_.begin(), addresses_.end(), self);
+  if (it == addresses_.end()) {
+    *error = self + " is not one of the cluster's nodes " + nodes;
+    return false;
+  }
+  self_ = it - addresses_.begin();
+
+  if (enabled()) {
+    std::ifstream in(key_path);
+    if (key_path.empty() || !in || !std::getline(in, key_) || key_.empty()) {
+      *error = "a cluster needs its key, the first line of the file given with -k";
+      return false;
+    }
+  }
+
+  ring_.reset(new HashRing(addresses_));
+  peers_.resize(addresses_.size());
+  for (uint32_t node = 0; node < addresses_.size(); node++)
+    if (node != self_)
+      peers_[node].reset(new PeerLink(addresses_[node], kPeerQueueCapacity, key_));
+  return true;
+}
@@ -0,0 +1,125 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "fanout.h"
+#include "sns.grpc.pb.h"
+
+/*
+ * Consistent hashing of usernames onto nodes. Every node is placed at
+ * kVirtualNodes pseudo-random points of a 64-bit ring, and a name belongs
+ * to the first point at or after its own hash, so adding or removing a node
+ * only moves the users next to its points (about 1/N of them). The hash is
+ * FNV-1a (plus a final mix), so every process, whatever it was built with,
+ * agrees on it.
+ */
+class HashRing {
+public:
+  static const int kVirtualNodes = 128;
+
+  // a node's points depend only on its address, not its place in the list
+  explicit HashRing(const std::vector<std::string>& nodes);
+
+  uint32_t ownerOf(const std::string& key) const;
+
+  static uint64_t hash(const std::string& key);
+
+private:
+  std::vector<std::pair<uint64_t, uint32_t>> points_;   // sorted by hash
+};
+
+/*
+ * Sends posts to one other node. send() only queues the post; a thread per
+ * peer ships everything queued so far in a single Deliver call, so under
+ * load posts travel in batches and an idle link costs nothing. A full queue
+ * (the peer down or too slow) drops posts rather than holding up the sender.
+ */
+class PeerLink {
+public:
+  PeerLink(const std::string& address, size_t capacity, const std::string& key);
+  ~PeerLink();
+
+  PeerLink(const PeerLink&) = delete;
+  PeerLink& operator=(const PeerLink&) = delete;
+
+  void send(const Post& post);
+
+  csce662::PeerService::Stub* stub() { return stub_.get(); }
+  const std::string& address() const { return address_; }
+
+  uint64_t sentCount() const { return sent_.load(std::memory_order_relaxed); }
+  uint64_t droppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  static const size_t kMaxBatch = 512;
+
+  void senderLoop();
+
+  const std::string address_;
+  const size_t capacity_;
+  const std::string key_;
+  std::unique_ptr<csce662::PeerService::Stub> stub_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<Post> queue_;
+  bool stopping_ = false;
+  std::atomic<uint64_t> sent_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::thread sender_;
+};
+
+/*
+ * The nodes of a tsd cluster and the links to them. Membership is static,
+ * given as the same address list to every node. A node keeps the full
+ * state of the users it owns, plus a stand-in Client for each remote user
+ * one of its own follows or is followed by, so both ends of a cross-node
+ * edge are in its graph. Without a list (or with just one node) there is
+ * only this node, which owns everyone.
+ *
+ * Nodes call each other on the client port, so every call between them
+ * carries a key all the nodes share, read from a file, and calls without
+ * it are refused: otherwise any client could make users or post as them.
+ */
+class Cluster {
+public:
+  // nodes is a comma-separated list of host:port, self one of them; with
+  // more than one node, key_path names the file holding the cluster's key
+  bool init(const std::string& nodes, const std::string& self, const std::string& key_path, std::string* error);
+
+  bool enabled() const { return addresses_.size() > 1; }
+  size_t size() const { return addresses_.size(); }
+  uint32_t self() const { return self_; }
+
+  uint32_t ownerOf(const std::string& username) const { return ring_ ? ring_->ownerOf(username) : 0; }
+  bool owns(const std::string& username) const { return ownerOf(username) == self_; }
+
+  const std::string& address(uint32_t node) const { return addresses_[node]; }
+  PeerLink& peer(uint32_t node) { return *peers_[node]; }
+
+  // marks a call to another node as coming from a member
+  void authorize(grpc::ClientContext* context) const { authorize(key_, context); }
+  // whether a call was made by another node of the cluster
+  bool fromMember(const grpc::ServerContext& context) const;
+
+  static void authorize(const std::string& key, grpc::ClientContext* context);
+
+private:
+  std::vector<std::string> addresses_;
+  std::string key_;
+  uint32_t self_ = 0;
+  std::unique_ptr<HashRing> ring_;
+  std::vector<std::unique_ptr<PeerLink>> peers_;   // nullptr for self
+};
+
+#endif
@@ -0,0 +1,374 @@
+#include "fanout.h"
+
+#include <cstdio>
+#include <google/protobuf/io/coded_stream.h>
+#include <grpcpp/impl/codegen/proto_utils.h>
+#include <unistd.h>
+
+using csce662::Message;
+
+PostData::PostData()
+  : arena_([this] {
+      // the arena starts in the inline buffer and only mallocs more if the
+      // message outgrows it
+      google::protobuf::ArenaOptions options;
+      options.initial_block = buffer_;
+      options.initial_block_size = kInlineBytes;
+      return options;
+    }()),
+    message_(google::protobuf::Arena::CreateMessage<Message>(&arena_)) {}
+
+const grpc::ByteBuffer& PostData::wire() const {
+  std::call_once(wire_once_, [this] {
+    if (wire_.Valid())
+      return;
+    bool own_buffer;
+    grpc::SerializationTraits<Message>::Serialize(*message_, &wire_, &own_buffer);
+  });
+  return wire_;
+}
+
+Post makePost(const Message& message) {
+  std::shared_ptr<PostData> post = std::make_shared<PostData>();
+  *post->message_ = message;
+  return post;
+}
+
+Post parsePost(const void* data, size_t size) {
+  std::shared_ptr<PostData> post = std::make_shared<PostData>();
+  if (!post->message_->ParseFromArray(data, size))
+    return nullptr;
+  return post;
+}
+
+Post parsePost(const grpc::ByteBuffer& wire) {
+  std::shared_ptr<PostData> post = std::make_shared<PostData>();
+  // Deserialize consumes its buffer, so give it a copy (a slice reference)
+  grpc::ByteBuffer copy(wire);
+  if (!grpc::SerializationTraits<Message>::Deserialize(&copy, post->message_).ok())
+    return nullptr;
+  post->wire_ = wire;
+  return post;
+}
+
+Post withSeq(const Post& post, uint64_t seq) {
+  std::shared_ptr<PostData> numbered = std::make_shared<PostData>();
+  *numbered->message_ = post->message();
+  numbered->message_->set_seq(seq);
+  if (post->wire_.Valid()) {
+    // a scalar field that appears twice takes the last value, so appending
+    // the field to the bytes as they are sets it
+    uint8_t field[1 + 10];   // the tag, then at most 10 bytes of varint
+    field[0] = Message::kSeqFieldNumber << 3;   // wire type 0, varint
+    uint8_t* end = google::protobuf::io::CodedOutputStream::WriteVarint64ToArray(seq, field + 1);
+    std::vector<grpc::Slice> slices;
+    post->wire_.Dump(&slices);
+    slices.emplace_back(field, end - field);
+    numbered->wire_ = grpc::ByteBuffer(slices.data(), slices.size());
+  }
+  return numbered;
+}
+
+/*
+ * Per-subscriber state. Everything below mu is guarded by it; sink is only
+ * dereferenced by the writer that set `writing`, and never once `closed`.
+ */
+class Subscriber {
+public:
+  Subscriber(MessageSink* s, const std::string& n, bool b) : sink(s), name(n), batching(b) {}
+
+  MessageSink* const sink;
+  const std::string name;
+  const bool batching;
+
+  std::mutex mu;
+  std::condition_variable idle_cv;
+  std::deque<Post> queue;
+  bool scheduled = false;  // on the ready list or being drained
+  bool writing = false;    // a write is started on sink and not done yet
+  bool closed = false;
+  bool busy = false;       // the last write was a batch of more than one
+  bool lingered = false;   // already waited for this batch to fill
+
+  // overflow file for SPILL_TO_DISK; holds posts newer than anything queued
+  std::string spill_path;
+  FILE* spill = nullptr;
+  long spill_read = 0;
+  long spill_write = 0;
+
+  bool spilled() const { return spill_read < spill_write; }
+
+  // writes the post's shared wire bytes, so spilling doesn't re-encode it
+  bool spillPost(const Post& post) {
+    std::vector<grpc::Slice> slices;
+    if (!post->wire().Dump(&slices).ok())
+      return false;
+    uint32_t len = post->wire().Length();
+    if (fseek(spill, spill_write, SEEK_SET) != 0 ||
+        fwrite(&len, sizeof(len), 1, spill) != 1)
+      return false;
+    for (const grpc::Slice& slice : slices)
+      if (fwrite(slice.begin(), 1, slice.size(), spill) != slice.size())
+        return false;
+    spill_write += sizeof(len) + len;
+    return true;
+  }
+
+  // moves spilled posts back into the queue, oldest first
+  void refill(size_t capacity) {
+    if (fflush(spill) != 0 || fseek(spill, spill_read, SEEK_SET) != 0)
+      return;
+    std::string bytes;
+    while (spilled() && queue.size() < capacity) {
+      uint32_t len = 0;
+      if (fread(&len, sizeof(len), 1, spill) != 1)
+        break;
+      bytes.resize(len);
+      if (fread(&bytes[0], 1, len, spill) != len)
+        break;
+      Post post = parsePost(bytes.data(), bytes.size());
+      if (post != nullptr)
+        queue.push_back(post);
+      spill_read += sizeof(len) + len;
+    }
+    // everything was read back; start the file over
+    if (!spilled()) {
+      spill_read = spill_write = 0;
+      if (ftruncate(fileno(spill), 0) != 0)
+        return;
+    }
+  }
+
+  void removeSpill() {
+    if (spill == nullptr)
+      return;
+    fclose(spill);
+    spill = nullptr;
+    unlink(spill_path.c_str());
+  }
+};
+
+bool parseBackpressurePolicy(const std::string& name, BackpressurePolicy* policy) {
+  if (name == "drop")
+    *policy = BackpressurePolicy::DROP_OLDEST;
+  else if (name == "disconnect")
+    *policy = BackpressurePolicy::DISCONNECT;
+  else if (name == "spill")
+    *policy = BackpressurePolicy::SPILL_TO_DISK;
+  else
+    return false;
+  return true;
+}
+
+FanoutEngine::FanoutEngine(const FanoutOptions& options) : options_(options) {
+  if (options_.writer_threads == 0)
+    options_.writer_threads = 1;
+  if (options_.queue_capacity == 0)
+    options_.queue_capacity = 1;
+  if (options_.max_batch == 0)
+    options_.max_batch = 1;
+  for (size_t i = 0; i < options_.writer_threads; i++)
+    writers_.emplace_back(&FanoutEngine::writerLoop, this);
+}
+
+FanoutEngine::~FanoutEngine() {
+  {
+    std::lock_guard<std::mutex> lock(ready_mu_);
+    stopping_ = true;
+  }
+  ready_cv_.notify_all();
+  for (std::thread& t : writers_)
+    t.join();
+}
+
+std::shared_ptr<Subscriber> FanoutEngine::subscribe(MessageSink* sink, const std::string& name, bool batching) {
+  return std::make_shared<Subscriber>(sink, name, batching);
+}
+
+void FanoutEngine::unsubscribe(const std::shared_ptr<Subscriber>& sub) {
+  std::unique_lock<std::mutex> lock(sub->mu);
+  sub->closed = true;
+  queued_.fetch_sub(sub->queue.size(), std::memory_order_relaxed);
+  sub->queue.clear();
+  sub->idle_cv.wait(lock, [&sub] { return !sub->writing; });
+  sub->removeSpill();
+}
+
+bool FanoutEngine::enqueue(const std::shared_ptr<Subscriber>& sub, const Post& post) {
+  {
+    std::lock_guard<std::mutex> lock(sub->mu);
+    if (sub->closed)
+      return false;
+
+    // once anything is spilled, newer posts have to queue up behind it on disk
+    queue_depth_.record(sub->queue.size());
+    if (sub->queue.size() >= options_.queue_capacity || sub->spilled())
+    {
+      overflow(*sub, post);
+    }
+    else
+    {
+      sub->queue.push_back(post);
+      queued_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (sub->scheduled || sub->closed)
+      return !sub->closed;
+    sub->scheduled = true;
+  }
+  schedule(sub);
+  return true;
+}
+
+void FanoutEngine::overflow(Subscriber& sub, const Post& post) {
+  switch (options_.policy) {
+    case BackpressurePolicy::DROP_OLDEST:
+      sub.queue.pop_front();
+      sub.queue.push_back(post);
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+
+    case BackpressurePolicy::SPILL_TO_DISK:
+      if (sub.spill == nullptr) {
+        sub.spill_path = options_.spill_dir + "/spill-" + std::to_string(getpid()) + "-" +
+                         std::to_string(next_spill_id_.fetch_add(1)) + ".bin";
+        sub.spill = fopen(sub.spill_path.c_str(), "w+b");
+      }
+      if (sub.spill != nullptr && sub.spillPost(post)) {
+        spilled_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      // the disk is no help, so treat this subscriber as too slow to keep
+      break;
+
+    case BackpressurePolicy::DISCONNECT:
+      break;
+  }
+
+  sub.closed = true;
+  queued_.fetch_sub(sub.queue.size(), std::memory_order_relaxed);
+  sub.queue.clear();
+  sub.sink->close();
+  disconnected_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void FanoutEngine::schedule(const std::shared_ptr<Subscriber>& sub) {
+  {
+    std::lock_guard<std::mutex> lock(ready_mu_);
+    ready_.push_back(sub);
+  }
+  ready_cv_.notify_one();
+}
+
+void FanoutEngine::writerLoop() {
+  while (true) {
+    std::shared_ptr<Subscriber> sub;
+    {
+      std::unique_lock<std::mutex> lock(ready_mu_);
+      while (!stopping_ && ready_.empty() &&
+             (lingering_.empty() || lingering_.front().first > std::chrono::steady_clock::now()))
+      {
+        if (lingering_.empty())
+          ready_cv_.wait(lock);
+        else
+          ready_cv_.wait_until(lock, lingering_.front().first);
+      }
+      if (!ready_.empty())
+      {
+        sub = std::move(ready_.front());
+        ready_.pop_front();
+      }
+      else if (!lingering_.empty())
+      {
+        // due, or shutting down: either way, write what it has
+        sub = std::move(lingering_.front().second);
+        lingering_.pop_front();
+      }
+      else
+        return;
+    }
+    drain(sub);
+  }
+}
+
+void FanoutEngine::drain(const std::shared_ptr<Subscriber>& sub) {
+  std::vector<Post> batch;
+  {
+    std::lock_guard<std::mutex> lock(sub->mu);
+    if (sub->closed) {
+      sub->scheduled = false;
+      return;
+    }
+    if (sub->queue.empty() && sub->spilled()) {
+      sub->refill(options_.queue_capacity);
+      queued_.fetch_add(sub->queue.size(), std::memory_order_relaxed);
+    }
+    // a busy subscriber short of a full batch waits a little for more
+    if (sub->batching && sub->busy && !sub->lingered && options_.linger.count() > 0 &&
+        sub->queue.size() < options_.max_batch) {
+      sub->lingered = true;
+      {
+        std::lock_guard<std::mutex> ready_lock(ready_mu_);
+        lingering_.emplace_back(std::chrono::steady_clock::now() + options_.linger, sub);
+      }
+      // this may be a sink's thread, with every writer asleep
+      ready_cv_.notify_one();
+      return;
+    }
+    sub->lingered = false;
+    size_t most = sub->batching ? options_.max_batch : 1;
+    while (!sub->queue.empty() && batch.size() < most) {
+      batch.push_back(std::move(sub->queue.front()));
+      sub->queue.pop_front();
+    }
+    queued_.fetch_sub(batch.size(), std::memory_order_relaxed);
+    if (batch.empty()) {
+      // nothing could be read back from the spill file, so stop here rather
+      // than spin on it
+      sub->scheduled = false;
+      if (sub->spilled()) {
+        sub->closed = true;
+        sub->sink->close();
+        disconnected_.fetch_add(1, std::memory_order_relaxed);
+      }
+      return;
+    }
+    sub->writing = true;
+  }
+
+  if (sub->batching)
+    batch_size_.record(batch.size());
+  size_t posts = batch.size();
+  auto start = std::chrono::steady_clock::now();
+  sub->sink->startWrite(std::move(batch), [this, sub, posts, start](bool ok) {
+    write_latency_.record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    writeDone(sub, posts, ok);
+  });
+}
+
+void FanoutEngine::writeDone(const std::shared_ptr<Subscriber>& sub, size_t posts, bool ok) {
+  bool more;
+  {
+    std::lock_guard<std::mutex> lock(sub->mu);
+    sub->writing = false;
+    sub->busy = posts > 1;
+    if (!ok && !sub->closed) {
+      // the peer is gone: tear its stream down now, so it is unsubscribed
+      // and nothing more is queued for it
+      sub->closed = true;
+      queued_.fetch_sub(sub->queue.size(), std::memory_order_relaxed);
+      sub->queue.clear();
+      sub->sink->close();
+    }
+    more = !sub->closed && (!sub->queue.empty() || sub->spilled());
+    if (!more)
+      sub->scheduled = false;
+    sub->idle_cv.notify_all();
+  }
+
+  // the next write starts right here, on whatever thread completed this
+  // one; that takes no writer, so a busy subscriber starves no one
+  if (more)
+    drain(sub);
+}
@@ -0,0 +1,204 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <grpcpp/support/byte_buffer.h>
+
+#include "metrics.h"
+#include "sns.pb.h"
+
+/*
+ * A post is built once and shared by every queue it is fanned out to.
+ *
+ * The Message lives on the post's own protobuf arena, whose first block is
+ * part of the same allocation as the shared_ptr control block, so a typical
+ * post costs a single malloc. The serialized form is produced at most once
+ * and handed to every stream as a ref-counted grpc::ByteBuffer; copying a
+ * ByteBuffer only takes a reference on its slices.
+ */
+class PostData {
+public:
+  PostData();
+
+  PostData(const PostData&) = delete;
+  PostData& operator=(const PostData&) = delete;
+
+  const csce662::Message& message() const { return *message_; }
+
+  // the message serialized; computed on first use, then shared
+  const grpc::ByteBuffer& wire() const;
+
+private:
+  friend std::shared_ptr<const PostData> makePost(const csce662::Message& message);
+  friend std::shared_ptr<const PostData> parsePost(const void* data, size_t size);
+  friend std::shared_ptr<const PostData> parsePost(const grpc::ByteBuffer& wire);
+  friend std::shared_ptr<const PostData> withSeq(const std::shared_ptr<const PostData>& post, uint64_t seq);
+
+  static const size_t kInlineBytes = 1024;
+
+  alignas(8) char buffer_[kInlineBytes];
+  google::protobuf::Arena arena_;
+  csce662::Message* message_;
+
+  mutable std::once_flag wire_once_;
+  mutable grpc::ByteBuffer wire_;
+};
+
+using Post = std::shared_ptr<const PostData>;
+
+Post makePost(const csce662::Message& message);
+
+// parses serialized Message bytes; nullptr if they don't parse
+Post parsePost(const void* data, size_t size);
+
+// parses a received message and keeps its bytes as the post's wire form,
+// so relaying it needs no serialization at all
+Post parsePost(const grpc::ByteBuffer& wire);
+
+// a copy of a post nobody else has yet, numbered seq. Wire bytes it already
+// has are reused with just the field added, so it still isn't re-encoded
+Post withSeq(const Post& post, uint64_t seq);
+
+// Where a subscriber's messages end up (e.g. a Timeline stream).
+class MessageSink {
+public:
+  // ok is false if the peer is gone
+  using WriteDone = std::function<void(bool ok)>;
+
+  virtual ~MessageSink() {}
+
+  // starts writing and returns without waiting for the peer. posts is a
+  // single post, or (only for subscribers that accept batches) several to
+  // send in one envelope. done runs exactly once, when the transport has
+  // taken them, on any thread, possibly this one before startWrite returns.
+  // A sink never has more than one write started at a time
+  virtual void startWrite(std::vector<Post> posts, WriteDone done) = 0;
+
+  // asks the transport to tear the stream down; must not block
+  virtual void close() = 0;
+};
+
+// What to do when a subscriber's queue is full.
+enum class BackpressurePolicy {
+  DROP_OLDEST,    // discard the oldest queued post to make room
+  DISCONNECT,     // drop everything queued and close the subscriber's stream
+  SPILL_TO_DISK   // keep the overflow in a per-subscriber file, in order
+};
+
+bool parseBackpressurePolicy(const std::string& name, BackpressurePolicy* policy);
+
+struct FanoutOptions {
+  size_t writer_threads = 4;
+  size_t queue_capacity = 256;
+  BackpressurePolicy policy = BackpressurePolicy::DROP_OLDEST;
+  std::string spill_dir = ".";
+  // most posts handed to a sink in one go (one write, for subscribers that
+  // accept batches)
+  size_t max_batch = 16;
+  // how long a busy subscriber's partial batch waits for more posts; 0 never
+  // waits
+  std::chrono::microseconds linger{0};
+};
+
+class Subscriber;
+
+/*
+ * Delivers posts to subscribers off the poster's thread.
+ *
+ * Every subscriber has a bounded outbound queue. enqueue() only appends to
+ * that queue (applying the backpressure policy when it is full) and, if the
+ * subscriber is idle, puts it on a shared ready list. A fixed pool of writer
+ * threads takes subscribers off the ready list and starts a write of the
+ * next post (or batch) on each one's sink. Writers never wait for a write to
+ * complete: the sink reports completion, and only then is the subscriber put
+ * back on the ready list if more is queued. So a subscriber has at most one
+ * write in flight, and one that stops reading only fills up its own queue,
+ * where the backpressure policy deals with it; delivery to everyone else
+ * goes on.
+ *
+ * A subscriber that accepts batches gets everything drained at once in a
+ * single write. Whatever queued up while its last write was in flight goes
+ * out together, so batches grow with load by themselves, and a lone post is
+ * written as soon as a writer is free. With linger set, a subscriber whose
+ * last write was a batch (a busy one) and that has fewer than max_batch
+ * posts waiting is put aside for that long first, so its batches fill up
+ * more; a quiet one is never held back.
+ */
+class FanoutEngine {
+public:
+  explicit FanoutEngine(const FanoutOptions& options);
+  ~FanoutEngine();
+
+  FanoutEngine(const FanoutEngine&) = delete;
+  FanoutEngine& operator=(const FanoutEngine&) = delete;
+
+  // the sink must stay valid until unsubscribe() returns; with batching set
+  // it is given several posts per write
+  std::shared_ptr<Subscriber> subscribe(MessageSink* sink, const std::string& name, bool batching = false);
+
+  // waits for any write in progress; the sink is never touched afterwards
+  void unsubscribe(const std::shared_ptr<Subscriber>& sub);
+
+  // never blocks on the subscriber's sink; false if the subscriber is closed
+  // (its stream failed or is going away), so the post went nowhere
+  bool enqueue(const std::shared_ptr<Subscriber>& sub, const Post& post);
+
+  const FanoutOptions& options() const { return options_; }
+
+  // posts lost to DROP_OLDEST, subscribers closed by DISCONNECT, posts spilled
+  uint64_t droppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+  uint64_t disconnectedCount() const { return disconnected_.load(std::memory_order_relaxed); }
+  uint64_t spilledCount() const { return spilled_.load(std::memory_order_relaxed); }
+
+  // posts waiting in memory across all subscribers
+  int64_t queuedCount() const { return queued_.load(std::memory_order_relaxed); }
+
+  // time from starting a write on a sink until it completed (ns), and a
+  // subscriber's queue length seen by every enqueue
+  const Histogram& writeLatency() const { return write_latency_; }
+  const Histogram& queueDepth() const { return queue_depth_; }
+
+  // posts per write to subscribers that accept batches
+  const Histogram& batchSize() const { return batch_size_; }
+
+private:
+  void writerLoop();
+  void schedule(const std::shared_ptr<Subscriber>& sub);
+  void drain(const std::shared_ptr<Subscriber>& sub);
+  void writeDone(const std::shared_ptr<Subscriber>& sub, size_t posts, bool ok);
+  void overflow(Subscriber& sub, const Post& post);
+
+  FanoutOptions options_;
+
+  std::mutex ready_mu_;
+  std::condition_variable ready_cv_;
+  std::deque<std::shared_ptr<Subscriber>> ready_;
+  // subscribers lingering, in order of when they are due (linger is the
+  // same for all, so that's the order they were put aside in)
+  std::deque<std::pair<std::chrono::steady_clock::time_point, std::shared_ptr<Subscriber>>> lingering_;
+  bool stopping_ = false;
+
+  std::vector<std::thread> writers_;
+  std::atomic<uint64_t> next_spill_id_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> disconnected_{0};
+  std::atomic<uint64_t> spilled_{0};
+  std::atomic<int64_t> queued_{0};
+  Histogram write_latency_;
+  Histogram queue_depth_;
+  Histogram batch_size_;
+};
+
+#endif
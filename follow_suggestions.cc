@@ -0,0 +1,280 @@
+#include "follow_suggestions.h"
+
+#include <algorithm>
+
+namespace {
+
+// best accounts kept per user; a request for more gets at most this many
+const size_t kCachedSuggestions = 50;
+// users with cached suggestions, at most
+const size_t kMaxCachedUsers = 1 << 16;
+// below this many users the id space isn't worth splitting
+const uint32_t kMinUsersPerPart = 1 << 16;
+// in a worker's counts: the user, or an account they follow already
+const uint32_t kExcluded = ~uint32_t(0);
+
+struct Candidate {
+  uint32_t mutual;
+  uint32_t id;
+};
+
+// most mutual first; the older account first among equals
+bool better(const Candidate& a, const Candidate& b) {
+  return a.mutual != b.mutual ? a.mutual > b.mutual : a.id < b.id;
+}
+
+int64_t nanosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+}  // namespace
+
+FollowSuggester::FollowSuggester(const UserRegistry& registry, const SocialGraph& graph, size_t threads)
+  : registry_(registry), graph_(graph), threads_(std::max<size_t>(1, threads)),
+    snapshot_(std::make_shared<const Graph>()) {
+  // the caller of suggest() counts too
+  for (size_t i = 1; i < threads_; i++)
+    workers_.emplace_back(&FollowSuggester::workerLoop, this);
+}
+
+FollowSuggester::~FollowSuggester() {
+  {
+    std::lock_guard<std::mutex> lock(jobs_mu_);
+    stopping_ = true;
+  }
+  jobs_cv_.notify_all();
+  for (std::thread& worker : workers_)
+    worker.join();
+  if (refresher_.joinable())
+    refresher_.join();
+}
+
+void FollowSuggester::start(std::chrono::seconds refresh) {
+  auto start = std::chrono::steady_clock::now();
+  std::atomic_store(&snapshot_, build(1));
+  build_nanos_.store(nanosSince(start), std::memory_order_relaxed);
+  refresher_ = std::thread(&FollowSuggester::refreshLoop, this, refresh);
+}
+
+uint64_t FollowSuggester::graphEdges() const {
+  return std::atomic_load(&snapshot_)->targets.size();
+}
+
+std::shared_ptr<const FollowSuggester::Graph> FollowSuggester::build(uint64_t generation) const {
+  auto graph = std::make_shared<Graph>();
+  graph->generation = generation;
+  UserId last = registry_.size();
+  graph->offsets.reserve(last + 2);
+  graph->targets.reserve(graph_.edgeCount());
+
+  // id 0 is no one and follows no one
+  graph->offsets.assign(2, 0);
+  for (UserId id = 1; id <= last; id++)
+  {
+    Client* c = registry_.get(id);
+    if (c != nullptr)
+    {
+      size_t start = graph->targets.size();
+      AdjacencySet::Snapshot following = graph_.following(c);
+      for (Client* followee : *following)
+        graph->targets.push_back(followee->id);
+      std::sort(graph->targets.begin() + start, graph->targets.end());
+    }
+    graph->offsets.push_back(graph->targets.size());
+  }
+  return graph;
+}
+
+void FollowSuggester::refreshLoop(std::chrono::seconds refresh) {
+  uint64_t built = graph_.changeCount();
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(jobs_mu_);
+      if (jobs_cv_.wait_for(lock, refresh, [this] { return stopping_; }))
+        return;
+    }
+    uint64_t changes = graph_.changeCount();
+    if (changes == built)
+      continue;
+    built = changes;
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<const Graph> graph = build(std::atomic_load(&snapshot_)->generation + 1);
+    std::atomic_store(&snapshot_, graph);
+    build_nanos_.store(nanosSince(start), std::memory_order_relaxed);
+  }
+}
+
+std::vector<FollowSuggester::Suggestion> FollowSuggester::suggest(Client* c, size_t limit) {
+  AdjacencySet::Snapshot following = graph_.following(c);
+  std::shared_ptr<const Graph> graph = std::atomic_load(&snapshot_);
+
+  std::vector<Suggestion> best;
+  bool cached = false;
+  {
+    std::lock_guard<std::mutex> lock(cache_mu_);
+    auto entry = cache_.find(c->id);
+    if (entry != cache_.end() && entry->second.following == following &&
+        entry->second.generation == graph->generation)
+    {
+      best = entry->second.best;
+      cached = true;
+    }
+  }
+
+  if (cached)
+    hits_.fetch_add(1, std::memory_order_relaxed);
+  else
+  {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    best = compute(c, following, *graph);
+    std::lock_guard<std::mutex> lock(cache_mu_);
+    if (cache_.size() >= kMaxCachedUsers && !cache_.count(c->id))
+      cache_.erase(cache_.begin());
+    cache_[c->id] = Cached{following, graph->generation, best};
+  }
+
+  if (best.size() > limit)
+    best.resize(limit);
+  return best;
+}
+
+std::vector<FollowSuggester::Suggestion> FollowSuggester::compute(Client* c, const AdjacencySet::Snapshot& following,
+                                                                  const Graph& graph) {
+  std::vector<uint32_t> followees;
+  followees.reserve(following->size());
+  for (Client* followee : *following)
+    followees.push_back(followee->id);
+  std::vector<uint32_t> excluded = followees;
+  excluded.push_back(c->id);
+  std::sort(excluded.begin(), excluded.end());
+
+  const uint32_t users = graph.offsets.size() - 1;
+  const size_t parts = std::min<size_t>(threads_, users / kMinUsersPerPart + 1);
+  std::vector<std::vector<Candidate>> found(parts);
+
+  runParts(parts, [&](size_t part) {
+    const uint32_t lo = (uint64_t)users * part / parts;
+    const uint32_t hi = (uint64_t)users * (part + 1) / parts;
+    // kept zeroed between queries, so only what was touched is reset
+    thread_local std::vector<uint32_t> counts;
+    thread_local std::vector<uint32_t> touched;
+    if (counts.size() < hi - lo)
+      counts.resize(hi - lo, 0);
+
+    auto first_excluded = std::lower_bound(excluded.begin(), excluded.end(), lo);
+    auto last_excluded = std::lower_bound(first_excluded, excluded.end(), hi);
+    for (auto id = first_excluded; id != last_excluded; ++id)
+      counts[*id - lo] = kExcluded;
+
+    for (uint32_t followee : followees)
+    {
+      // joined since the copy was made: nobody it follows is known yet
+      if (followee >= users)
+        continue;
+      const uint32_t* begin = graph.targets.data() + graph.offsets[followee];
+      const uint32_t* end = graph.targets.data() + graph.offsets[followee + 1];
+      for (const uint32_t* target = std::lower_bound(begin, end, lo); target != end && *target < hi; ++target)
+      {
+        uint32_t& count = counts[*target - lo];
+        if (count == kExcluded)
+          continue;
+        if (count++ == 0)
+          touched.push_back(*target);
+      }
+    }
+
+    std::vector<Candidate>& candidates = found[part];
+    candidates.reserve(touched.size());
+    for (uint32_t id : touched)
+    {
+      candidates.push_back({counts[id - lo], id});
+      counts[id - lo] = 0;
+    }
+    touched.clear();
+    for (auto id = first_excluded; id != last_excluded; ++id)
+      counts[*id - lo] = 0;
+
+    size_t keep = std::min(kCachedSuggestions, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(), better);
+    candidates.resize(keep);
+  });
+
+  std::vector<Candidate> merged;
+  for (const std::vector<Candidate>& candidates : found)
+    merged.insert(merged.end(), candidates.begin(), candidates.end());
+  std::sort(merged.begin(), merged.end(), better);
+
+  std::vector<Suggestion> best;
+  for (const Candidate& candidate : merged)
+  {
+    if (best.size() == kCachedSuggestions)
+      break;
+    Client* user = registry_.get(candidate.id);
+    if (user != nullptr)
+      best.push_back({user, candidate.mutual});
+  }
+  return best;
+}
+
+// Runs part(0) .. part(parts - 1) on the workers and the calling thread,
+// and returns once all are done
+void FollowSuggester::runParts(size_t parts, const std::function<void(size_t)>& part) {
+  if (parts == 1 || workers_.empty())
+  {
+    for (size_t i = 0; i < parts; i++)
+      part(i);
+    return;
+  }
+
+  auto job = std::make_shared<Job>();
+  job->part = part;
+  job->parts = parts;
+  {
+    std::lock_guard<std::mutex> lock(jobs_mu_);
+    jobs_.push_back(job);
+  }
+  jobs_cv_.notify_all();
+
+  work(*job);
+  std::unique_lock<std::mutex> lock(jobs_mu_);
+  done_cv_.wait(lock, [&job] { return job->done.load() == job->parts; });
+  auto queued = std::find(jobs_.begin(), jobs_.end(), job);
+  if (queued != jobs_.end())
+    jobs_.erase(queued);
+}
+
+// Takes parts of job until none are left
+void FollowSuggester::work(Job& job) {
+  size_t i;
+  while ((i = job.next.fetch_add(1)) < job.parts)
+  {
+    job.part(i);
+    if (job.done.fetch_add(1) + 1 == job.parts)
+    {
+      std::lock_guard<std::mutex> lock(jobs_mu_);
+      done_cv_.notify_all();
+    }
+  }
+}
+
+void FollowSuggester::workerLoop() {
+  while (true)
+  {
+    std::shared_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(jobs_mu_);
+      jobs_cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+      if (stopping_)
+        return;
+      job = jobs_.front();
+    }
+
+    work(*job);
+
+    // every part is taken: nothing more for the other workers here
+    std::lock_guard<std::mutex> lock(jobs_mu_);
+    if (!jobs_.empty() && jobs_.front() == job)
+      jobs_.pop_front();
+  }
+}
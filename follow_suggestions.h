@@ -0,0 +1,118 @@
+#ifndef FOLLOW_SUGGESTIONS_H
+#define FOLLOW_SUGGESTIONS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "social_graph.h"
+#include "user_registry.h"
+
+/*
+ * "People followed by people you follow", ranked by how many of the
+ * accounts you follow follow them.
+ *
+ * Counting runs over a compact copy of the whole graph in CSR form: one
+ * array of offsets indexed by user id and one array of followee ids, each
+ * user's sorted. A background thread rebuilds it when edges have changed.
+ * The user's own followees are read from the live graph, so their last
+ * follow counts at once.
+ *
+ * A query splits the id space into one range per worker. Each worker goes
+ * through every followee's list but only reads the slice in its range,
+ * found by binary search since the lists are sorted. It counts into a
+ * dense array of its own and hands back its best candidates, which are
+ * then merged. No counter is shared, so workers never contend, and a
+ * two-hop neighborhood of millions costs its edges divided by the number
+ * of workers.
+ *
+ * Results are cached per user. An entry holds until the user follows or
+ * unfollows someone, or a newer copy of the graph replaces the one it was
+ * computed from.
+ */
+class FollowSuggester {
+public:
+  struct Suggestion {
+    Client* user;
+    uint32_t mutual;   // accounts the user follows that follow this one
+  };
+
+  // threads: workers counting in parallel, the caller included
+  FollowSuggester(const UserRegistry& registry, const SocialGraph& graph, size_t threads);
+  ~FollowSuggester();
+
+  FollowSuggester(const FollowSuggester&) = delete;
+  FollowSuggester& operator=(const FollowSuggester&) = delete;
+
+  // copies the graph, then keeps the copy within refresh of the live graph
+  void start(std::chrono::seconds refresh);
+
+  // up to limit accounts c doesn't follow yet, best first
+  std::vector<Suggestion> suggest(Client* c, size_t limit);
+
+  // edges in the current copy of the graph, and how long it took to make
+  uint64_t graphEdges() const;
+  int64_t graphBuildNanos() const { return build_nanos_.load(std::memory_order_relaxed); }
+
+  uint64_t cacheHits() const { return hits_.load(std::memory_order_relaxed); }
+  uint64_t cacheMisses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+  struct Graph {
+    uint64_t generation = 0;
+    std::vector<uint64_t> offsets{0};   // id -> start of its followees; one more at the end
+    std::vector<uint32_t> targets;   // followee ids, sorted per user
+  };
+
+  struct Cached {
+    AdjacencySet::Snapshot following;   // what the user followed then
+    uint64_t generation;
+    std::vector<Suggestion> best;
+  };
+
+  // a query's counting, one part per id range
+  struct Job {
+    std::function<void(size_t)> part;
+    size_t parts;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+  };
+
+  std::shared_ptr<const Graph> build(uint64_t generation) const;
+  std::vector<Suggestion> compute(Client* c, const AdjacencySet::Snapshot& following, const Graph& graph);
+  void runParts(size_t parts, const std::function<void(size_t)>& part);
+  void work(Job& job);
+  void workerLoop();
+  void refreshLoop(std::chrono::seconds refresh);
+
+  const UserRegistry& registry_;
+  const SocialGraph& graph_;
+  const size_t threads_;
+
+  std::shared_ptr<const Graph> snapshot_;   // through std::atomic_load/atomic_store
+  std::atomic<int64_t> build_nanos_{0};
+
+  std::mutex cache_mu_;
+  std::unordered_map<UserId, Cached> cache_;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+
+  std::mutex jobs_mu_;
+  std::condition_variable jobs_cv_;
+  std::condition_variable done_cv_;
+  std::deque<std::shared_ptr<Job>> jobs_;
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+  std::thread refresher_;
+};
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Hammers SocialGraph from many threads at once: each thread follows,
+ * unfollows and "posts" (reads a follower list the way a fan-out does) at
+ * random over a small set of users, so the same edges are fought over all
+ * the time. Afterwards it checks that both sides of every edge agree and
+ * that edgeCount matches the edges actually there. Exits 1 on a mismatch.
+ *
+ *   ./graphstress [-u users] [-t threads] [-n operations_per_thread]
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <unistd.h>
+
+#include "social_graph.h"
+#include "user_registry.h"
+
+static std::atomic<uint64_t> failures{0};
+
+static void fail(const std::string& what) {
+  if (failures.fetch_add(1) < 10)
+    std::cerr << "FAIL: " << what << std::endl;
+}
+
+// a snapshot must be a set of known users without c itself
+static void checkSnapshot(const UserRegistry& registry, Client* c, const AdjacencySet::Snapshot& snapshot) {
+  std::unordered_set<Client*> seen;
+  for (Client* other : *snapshot)
+  {
+    if (other == c || other == nullptr || registry.get(other->id) != other)
+      fail("bad entry in the lists of " + c->username);
+    else if (!seen.insert(other).second)
+      fail(other->username + " twice in the lists of " + c->username);
+  }
+}
+
+int main(int argc, char** argv) {
+  int users = 200;
+  int threads = 16;
+  int operations = 200000;
+
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "u:t:n:")) != -1){
+    switch(opt) {
+      case 'u':
+        users = std::atoi(optarg);break;
+      case 't':
+        threads = std::atoi(optarg);break;
+      case 'n':
+        operations = std::atoi(optarg);break;
+      default:
+        std::cerr << "Invalid Command Line Argument\n";
+    }
+  }
+  if (users < 2 || threads < 1 || operations < 0)
+  {
+    std::cerr << "usage: graphstress [-u users >= 2] [-t threads] [-n operations_per_thread]" << std::endl;
+    return 2;
+  }
+
+  UserRegistry registry;
+  SocialGraph graph;
+  std::vector<Client*> clients;
+  for (int i = 0; i < users; i++)
+    clients.push_back(registry.findOrCreate("user" + std::to_string(i)));
+
+  // edges added minus edges removed, as the callers saw it
+  std::atomic<int64_t> net{0};
+  std::atomic<uint64_t> changed{0};
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++)
+  {
+    workers.emplace_back([&, t] {
+      std::mt19937 rng(t + 1);
+      std::uniform_int_distribution<int> pick(0, users - 1);
+      int64_t added = 0;
+      uint64_t changes = 0;
+      for (int i = 0; i < operations; i++)
+      {
+        Client* a = clients[pick(rng)];
+        Client* b = clients[pick(rng)];
+        switch (rng() % 5)
+        {
+          case 0:
+          case 1:
+            switch (graph.follow(a, b, [&changes] { changes++; }))
+            {
+              case SocialGraph::OK: added++; break;
+              case SocialGraph::SELF: if (a != b) fail("SELF for two users"); break;
+              default: break;
+            }
+            break;
+          case 2:
+          case 3:
+            if (graph.unfollow(a, b, [&changes] { changes++; }) == SocialGraph::OK)
+              added--;
+            break;
+          default:
+            // a post: who gets it, and who its author reads
+            checkSnapshot(registry, a, graph.followers(a));
+            checkSnapshot(registry, a, graph.following(a));
+            break;
+        }
+      }
+      net += added;
+      changed += changes;
+    });
+  }
+  for (std::thread& worker : workers)
+    worker.join();
+
+  size_t following_total = 0;
+  size_t followers_total = 0;
+  for (Client* c : clients)
+  {
+    AdjacencySet::Snapshot following = graph.following(c);
+    AdjacencySet::Snapshot followers = graph.followers(c);
+    checkSnapshot(registry, c, following);
+    checkSnapshot(registry, c, followers);
+    following_total += following->size();
+    followers_total += followers->size();
+    if (following->size() != c->client_following.size() || followers->size() != c->client_followers.size())
+      fail("snapshot size differs from the set of " + c->username);
+    for (Client* followee : *following)
+    {
+      if (!graph.isFollowing(c, followee) || !followee->client_followers.contains(c))
+        fail(c->username + " follows " + followee->username + " on one side only");
+    }
+    for (Client* follower : *followers)
+    {
+      if (!graph.isFollowing(follower, c))
+        fail(follower->username + " is a follower of " + c->username + " on one side only");
+    }
+  }
+
+  if (following_total != followers_total)
+    fail("following and followers lists hold different numbers of edges");
+  if (graph.edgeCount() != following_total)
+    fail("edgeCount " + std::to_string(graph.edgeCount()) + " but " + std::to_string(following_total) + " edges");
+  if ((int64_t)graph.edgeCount() != net.load())
+    fail("edgeCount " + std::to_string(graph.edgeCount()) + " but callers saw " + std::to_string(net.load()));
+  if (graph.changeCount() != changed.load())
+    fail("changeCount " + std::to_string(graph.changeCount()) + " but " + std::to_string(changed.load()) + " changes ran");
+
+  std::cout << (uint64_t)threads * operations << " operations by " << threads << " threads on " << users
+            << " users, " << graph.edgeCount() << " edges left, " << graph.changeCount() << " changes: "
+            << (failures.load() == 0 ? "ok" : std::to_string(failures.load()) + " failures") << std::endl;
+  return failures.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,292 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+size_t metricShard() {
+  static std::atomic<size_t> next_shard{0};
+  thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+  return shard;
+}
+
+uint64_t Counter::value() const {
+  uint64_t total = 0;
+  for (const Shard& shard : shards_)
+    total += shard.value.load(std::memory_order_relaxed);
+  return total;
+}
+
+size_t Histogram::bucketOf(uint64_t value) {
+  const uint64_t sub_buckets = 1 << kSubBucketBits;
+  if (value < sub_buckets)
+    return value;
+  // the top kSubBucketBits bits below the leading one pick the linear bucket
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - kSubBucketBits;
+  return ((shift + 1) << kSubBucketBits) + ((value >> shift) & (sub_buckets - 1));
+}
+
+uint64_t Histogram::bucketValue(size_t bucket) {
+  const uint64_t sub_buckets = 1 << kSubBucketBits;
+  if (bucket < sub_buckets)
+    return bucket;
+  int shift = (bucket >> kSubBucketBits) - 1;
+  uint64_t lowest = (sub_buckets + (bucket & (sub_buckets - 1))) << shift;
+  return lowest + ((uint64_t(1) << shift) >> 1);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+  Snapshot snapshot;
+  snapshot.counts.assign(kBuckets, 0);
+  for (const Shard& shard : shards_)
+  {
+    for (size_t i = 0; i < kBuckets; i++)
+      snapshot.counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+    snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  for (uint64_t n : snapshot.counts)
+    snapshot.count += n;
+  return snapshot;
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const {
+  if (count == 0)
+    return 0;
+  uint64_t rank = std::max<uint64_t>(1, std::ceil(q * count));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts.size(); i++)
+  {
+    seen += counts[i];
+    if (seen >= rank)
+      return bucketValue(i);
+  }
+  return bucketValue(counts.size() - 1);
+}
+
+Counter* MetricsRegistry::counter(const std::string& name, const std::string& help, const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mu_);
+  counters_.emplace_back();
+  Entry entry;
+  entry.name = name;
+  entry.help = help;
+  entry.type = "counter";
+  entry.labels = labels;
+  entry.counter = &counters_.back();
+  entries_.push_back(entry);
+  return &counters_.back();
+}
+
+Histogram* MetricsRegistry::histogram(const std::string& name, const std::string& help, double scale,
+                                      const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mu_);
+  histograms_.emplace_back();
+  Entry entry;
+  entry.name = name;
+  entry.help = help;
+  entry.type = "summary";
+  entry.labels = labels;
+  entry.histogram = &histograms_.back();
+  entry.scale = scale;
+  entries_.push_back(entry);
+  return &histograms_.back();
+}
+
+void MetricsRegistry::addHistogram(const std::string& name, const std::string& help, const Histogram* histogram,
+                                   double scale, const std::string& labels) {
+  Entry entry;
+  entry.name = name;
+  entry.help = help;
+  entry.type = "summary";
+  entry.labels = labels;
+  entry.histogram = histogram;
+  entry.scale = scale;
+  add(entry);
+}
+
+void MetricsRegistry::gauge(const std::string& name, const std::string& help, std::function<double()> read,
+                            const std::string& labels) {
+  Entry entry;
+  entry.name = name;
+  entry.help = help;
+  entry.type = "gauge";
+  entry.labels = labels;
+  entry.read = std::move(read);
+  add(entry);
+}
+
+void MetricsRegistry::counterFunc(const std::string& name, const std::string& help, std::function<double()> read,
+                                  const std::string& labels) {
+  Entry entry;
+  entry.name = name;
+  entry.help = help;
+  entry.type = "counter";
+  entry.labels = labels;
+  entry.read = std::move(read);
+  add(entry);
+}
+
+void MetricsRegistry::add(Entry entry) {
+  std::lock_guard<std::mutex> lock(mu_);
+  entries_.push_back(std::move(entry));
+}
+
+namespace {
+
+// name{labels,extra} value
+void sample(std::string* out, const std::string& name, const std::string& labels,
+            const std::string& extra, double value) {
+  *out += name;
+  if (!labels.empty() || !extra.empty())
+  {
+    *out += '{';
+    *out += labels;
+    if (!labels.empty() && !extra.empty())
+      *out += ',';
+    *out += extra;
+    *out += '}';
+  }
+  char number[32];
+  snprintf(number, sizeof(number), " %.9g\n", value);
+  *out += number;
+}
+
+}  // namespace
+
+std::string MetricsRegistry::render() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::string out;
+  std::vector<bool> done(entries_.size(), false);
+
+  for (size_t i = 0; i < entries_.size(); i++)
+  {
+    if (done[i])
+      continue;
+    const Entry& first = entries_[i];
+    out += "# HELP " + first.name + " " + first.help + "\n";
+    out += "# TYPE " + first.name + " " + first.type + "\n";
+
+    // every entry of this name goes under the one header
+    for (size_t j = i; j < entries_.size(); j++)
+    {
+      const Entry& e = entries_[j];
+      if (done[j] || e.name != first.name)
+        continue;
+      done[j] = true;
+
+      if (e.histogram != nullptr)
+      {
+        Histogram::Snapshot snapshot = e.histogram->snapshot();
+        for (const char* q : {"0.5", "0.9", "0.99", "0.999"})
+          sample(&out, e.name, e.labels, std::string("quantile=\"") + q + "\"",
+                 snapshot.quantile(std::atof(q)) * e.scale);
+        sample(&out, e.name + "_sum", e.labels, "", snapshot.sum * e.scale);
+        sample(&out, e.name + "_count", e.labels, "", snapshot.count);
+      }
+      else if (e.counter != nullptr)
+      {
+        sample(&out, e.name, e.labels, "", e.counter->value());
+      }
+      else
+      {
+        sample(&out, e.name, e.labels, "", e.read());
+      }
+    }
+  }
+  return out;
+}
+
+MetricsServer::~MetricsServer() {
+  stopping_ = true;
+  if (thread_.joinable())
+    thread_.join();
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool MetricsServer::start(const std::string& address, int port, std::string* error) {
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+  {
+    *error = "bad address " + address;
+    return false;
+  }
+
+  fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  if (fd_ < 0 ||
+      setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      bind(fd_, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(fd_, 16) != 0)
+  {
+    *error = strerror(errno);
+    return false;
+  }
+  thread_ = std::thread(&MetricsServer::serve, this);
+  return true;
+}
+
+void MetricsServer::serve() {
+  while (!stopping_)
+  {
+    // wake up now and then to notice stopping_
+    pollfd p = {fd_, POLLIN, 0};
+    if (poll(&p, 1, 200) <= 0)
+      continue;
+    int client = accept(fd_, nullptr, nullptr);
+    if (client < 0)
+      continue;
+    respond(client);
+    close(client);
+  }
+}
+
+void MetricsServer::respond(int fd) {
+  // read the request head; a slow or silent client gets a second at most
+  std::string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+  {
+    pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, 1000) <= 0)
+      return;
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n <= 0)
+      return;
+    request.append(buffer, n);
+  }
+
+  std::string body, status;
+  if (request.compare(0, 4, "GET ") == 0)
+  {
+    status = "200 OK";
+    body = registry_.render();
+  }
+  else
+  {
+    status = "405 Method Not Allowed";
+  }
+  std::string response = "HTTP/1.0 " + status + "\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                         "Connection: close\r\n\r\n" + body;
+
+  size_t sent = 0;
+  while (sent < response.size())
+  {
+    ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      return;
+    sent += n;
+  }
+}
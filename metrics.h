@@ -0,0 +1,169 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Counters and latency histograms cheap enough to leave on in production.
+ *
+ * Recording never takes a lock and never allocates: each thread is given
+ * one of a fixed set of shards the first time it records anything, and
+ * bumps relaxed atomics in its own cache line. Reading sums the shards,
+ * which only happens when the metrics are scraped.
+ */
+
+const size_t kMetricShards = 16;
+
+// the shard of the calling thread
+size_t metricShard();
+
+class Counter {
+public:
+  void add(uint64_t n = 1) { shards_[metricShard()].value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const;
+
+private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value{0};
+  };
+  Shard shards_[kMetricShards];
+};
+
+/*
+ * Log-linear histogram in the style of HdrHistogram: every power of two is
+ * split into 16 linear buckets, so any value up to 2^64 is kept with a
+ * relative error under 1/16, in a fixed 976 buckets.
+ */
+class Histogram {
+public:
+  static const int kSubBucketBits = 4;
+  static const size_t kBuckets = (64 - kSubBucketBits + 1) << kSubBucketBits;
+
+  void record(uint64_t value) {
+    Shard& shard = shards_[metricShard() % kShards];
+    shard.counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  struct Snapshot {
+    std::vector<uint64_t> counts;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    // the value below which a fraction q of the recorded values fall
+    uint64_t quantile(double q) const;
+  };
+  Snapshot snapshot() const;
+
+  static size_t bucketOf(uint64_t value);
+  // middle of the range of values that land in the bucket
+  static uint64_t bucketValue(size_t bucket);
+
+private:
+  // fewer shards than counters: a histogram shard is ~8KB
+  static const size_t kShards = 4;
+
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> counts[kBuckets] = {};
+    std::atomic<uint64_t> sum{0};
+  };
+  Shard shards_[kShards];
+};
+
+// Records the time from construction to destruction, in nanoseconds
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Histogram* histogram)
+    : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    histogram_->record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_).count());
+  }
+
+private:
+  Histogram* histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+/*
+ * Named metrics, rendered in the Prometheus text format. Metrics sharing a
+ * name (told apart by their labels, e.g. method="Login") are grouped under
+ * one HELP/TYPE header. Registration is for startup; the returned pointers
+ * stay valid for the registry's lifetime.
+ */
+class MetricsRegistry {
+public:
+  Counter* counter(const std::string& name, const std::string& help, const std::string& labels = "");
+
+  // scale converts recorded values to the exported unit, e.g. 1e-9 to
+  // export nanoseconds as seconds
+  Histogram* histogram(const std::string& name, const std::string& help, double scale = 1,
+                       const std::string& labels = "");
+
+  // a histogram owned by someone else, e.g. a FanoutEngine
+  void addHistogram(const std::string& name, const std::string& help, const Histogram* histogram,
+                    double scale = 1, const std::string& labels = "");
+
+  // values read when scraped, for things that are counted elsewhere already
+  void gauge(const std::string& name, const std::string& help, std::function<double()> read,
+             const std::string& labels = "");
+  void counterFunc(const std::string& name, const std::string& help, std::function<double()> read,
+                   const std::string& labels = "");
+
+  std::string render() const;
+
+private:
+  struct Entry {
+    std::string name;
+    std::string help;
+    std::string type;
+    std::string labels;
+    const Counter* counter = nullptr;
+    const Histogram* histogram = nullptr;
+    double scale = 1;
+    std::function<double()> read;
+  };
+
+  void add(Entry entry);
+
+  mutable std::mutex mu_;
+  std::deque<Counter> counters_;
+  std::deque<Histogram> histograms_;
+  std::vector<Entry> entries_;
+};
+
+/*
+ * Serves the registry over plain HTTP (any GET returns the metrics), for a
+ * Prometheus scraper or curl. One connection is handled at a time, on a
+ * thread of its own, so scraping never touches the gRPC threads.
+ */
+class MetricsServer {
+public:
+  explicit MetricsServer(const MetricsRegistry& registry) : registry_(registry) {}
+  ~MetricsServer();
+
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  bool start(const std::string& address, int port, std::string* error);
+
+private:
+  void serve();
+  void respond(int fd);
+
+  const MetricsRegistry& registry_;
+  int fd_ = -1;
+  std::atomic<bool> stopping_{false};
+  std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include "post_archive.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// address space reserved up front; a map only grows by doubling past this
+const size_t kInitialIndexMap = size_t(64) << 20;
+const size_t kInitialBlobMap = size_t(1) << 30;
+
+// how far ahead of this server's clock a post may be filed
+const int64_t kMaxClockSkew = int64_t(60) * 1000000000;
+
+bool pwriteAll(int fd, const char* data, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, data, len, offset);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+}  // namespace
+
+PostArchive::~PostArchive() {
+  for (const Mapping& m : index_maps_)
+    munmap(m.data, m.capacity);
+  for (const Mapping& m : blob_maps_)
+    munmap(m.data, m.capacity);
+  if (index_fd_ >= 0)
+    close(index_fd_);
+  if (blob_fd_ >= 0)
+    close(blob_fd_);
+}
+
+int64_t PostArchive::timeOf(const csce662::Message& message) {
+  return message.timestamp().seconds() * 1000000000 + message.timestamp().nanos();
+}
+
+bool PostArchive::ensureMapped(int fd, std::vector<Mapping>* maps, std::atomic<char*>* current, size_t needed) {
+  if (!maps->empty() && maps->back().capacity >= needed)
+    return true;
+
+  // pages past the end of the file can't be touched, but they become
+  // readable as the file grows into them, so one map serves many appends
+  size_t capacity = maps->empty() ? (maps == &index_maps_ ? kInitialIndexMap : kInitialBlobMap)
+                                  : maps->back().capacity;
+  while (capacity < needed)
+    capacity *= 2;
+  void* data = mmap(nullptr, capacity, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    return false;
+  maps->push_back(Mapping{static_cast<char*>(data), capacity});
+  current->store(static_cast<char*>(data), std::memory_order_release);
+  return true;
+}
+
+bool PostArchive::open(const std::string& dir, std::string* error) {
+  mkdir(dir.c_str(), 0755);
+  std::string index_path = dir + "/posts.idx";
+  std::string blob_path = dir + "/posts.dat";
+  index_fd_ = ::open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+  blob_fd_ = ::open(blob_path.c_str(), O_RDWR | O_CREAT, 0644);
+  struct stat index_st, blob_st;
+  if (index_fd_ < 0 || blob_fd_ < 0 || fstat(index_fd_, &index_st) != 0 || fstat(blob_fd_, &blob_st) != 0) {
+    *error = dir + ": " + strerror(errno);
+    return false;
+  }
+  if (!ensureMapped(index_fd_, &index_maps_, &index_map_, index_st.st_size) ||
+      !ensureMapped(blob_fd_, &blob_maps_, &blob_map_, blob_st.st_size)) {
+    *error = dir + ": cannot map the archive";
+    return false;
+  }
+
+  // rebuild the per-user chains, stopping at the first record a crash
+  // left half-written
+  uint64_t records = index_st.st_size / sizeof(IndexRecord);
+  uint64_t blob_size = blob_st.st_size;
+  uint64_t n = 0;
+  for (; n < records; n++) {
+    const IndexRecord* r = record(n);
+    if (r->offset != blob_size_ || r->offset + r->length > blob_size || r->time < last_time_ ||
+        (r->prev != kNone && r->prev >= n))
+      break;
+    if (r->user >= heads_.size())
+      heads_.resize(r->user + 1, kNone);
+    heads_[r->user] = n;
+    blob_size_ = r->offset + r->length;
+    last_time_ = r->time;
+  }
+  if ((n * sizeof(IndexRecord) != (uint64_t)index_st.st_size && ftruncate(index_fd_, n * sizeof(IndexRecord)) != 0) ||
+      (blob_size_ != blob_size && ftruncate(blob_fd_, blob_size_) != 0)) {
+    *error = dir + ": " + strerror(errno);
+    return false;
+  }
+  count_.store(n, std::memory_order_release);
+  return true;
+}
+
+bool PostArchive::append(uint32_t user, const csce662::Message& message) {
+  std::string bytes;
+  message.SerializeToString(&bytes);
+  return append(user, timeOf(message), bytes.data(), bytes.size());
+}
+
+bool PostArchive::append(uint32_t user, int64_t time, const char* bytes, size_t length) {
+  std::lock_guard<std::mutex> lock(mu_);
+  uint64_t n = count_.load(std::memory_order_relaxed);
+  if (user >= heads_.size())
+    heads_.resize(std::max<size_t>(user + 1, heads_.size() * 2), kNone);
+
+  // the time comes from the client: one far in the future would otherwise
+  // become the newest time seen, and every later post would be filed there
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  IndexRecord r;
+  r.time = std::max(std::min(time, now + kMaxClockSkew), last_time_);
+  r.user = user;
+  r.length = length;
+  r.offset = blob_size_;
+  r.prev = heads_[user];
+
+  // the bytes first: an index record never points past what is written
+  if (!pwriteAll(blob_fd_, bytes, length, blob_size_) ||
+      !pwriteAll(index_fd_, reinterpret_cast<const char*>(&r), sizeof(r), n * sizeof(r)) ||
+      !ensureMapped(blob_fd_, &blob_maps_, &blob_map_, blob_size_ + length) ||
+      !ensureMapped(index_fd_, &index_maps_, &index_map_, (n + 1) * sizeof(r)))
+    return false;
+
+  blob_size_ += length;
+  last_time_ = r.time;
+  heads_[user] = n;
+  count_.store(n + 1, std::memory_order_release);
+  return true;
+}
+
+int64_t PostArchive::lastTime() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return last_time_;
+}
+
+bool PostArchive::sync() {
+  std::lock_guard<std::mutex> lock(mu_);
+  return fdatasync(blob_fd_) == 0 && fdatasync(index_fd_) == 0;
+}
+
+PostArchive::Entry PostArchive::entry(uint64_t n) const {
+  const IndexRecord* r = record(n);
+  return Entry{r->time, r->user, blob() + r->offset, r->length};
+}
+
+uint64_t PostArchive::head(uint32_t user) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return user < heads_.size() ? heads_[user] : kNone;
+}
@@ -0,0 +1,162 @@
+#ifndef POST_ARCHIVE_H
+#define POST_ARCHIVE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sns.pb.h"
+
+/*
+ * Every post ever made, on disk, in two files of an archive directory:
+ *
+ *   posts.idx  one fixed-size IndexRecord per post, in time order
+ *   posts.dat  the posts' serialized Message bytes, back to back
+ *
+ * Both files are mmapped (with room to grow, so appends rarely remap) and
+ * read in place: a scan hands out pointers straight into posts.dat, which
+ * are the same bytes a Timeline stream sends, so a post can go from the
+ * archive to the wire without being parsed or copied.
+ *
+ * The index is sorted by time, so a time range is a binary search. Each
+ * record also points back at its author's previous post, so "user X's
+ * posts since T" walks only X's posts, newest first. Posts must be appended
+ * in time order; one that arrives with an older timestamp (a skewed client
+ * clock) is filed at the newest time seen so far, and one dated more than a
+ * minute past this server's clock is filed at that limit. Either way the
+ * Message keeps its own timestamp.
+ *
+ * Appends are serialized by a mutex; scans take no lock beyond reading the
+ * current size. After a crash, a torn record at the end of either file is
+ * dropped on open.
+ */
+class PostArchive {
+public:
+  struct IndexRecord {
+    int64_t time;         // nanoseconds since the epoch
+    uint32_t user;        // UserId of the author
+    uint32_t length;      // of the Message bytes
+    uint64_t offset;      // of the Message bytes in posts.dat
+    uint64_t prev;        // record number of the author's previous post
+  };
+
+  // a post as it sits in the archive; data stays valid while the
+  // PostArchive exists
+  struct Entry {
+    int64_t time;
+    uint32_t user;
+    const char* data;     // serialized csce662::Message
+    uint32_t length;
+  };
+
+  static constexpr uint64_t kNone = ~uint64_t(0);
+
+  PostArchive() {}
+  ~PostArchive();
+
+  PostArchive(const PostArchive&) = delete;
+  PostArchive& operator=(const PostArchive&) = delete;
+
+  // opens or creates the archive in dir
+  bool open(const std::string& dir, std::string* error);
+
+  // appends a post by user; bytes are the serialized message
+  bool append(uint32_t user, const csce662::Message& message);
+  bool append(uint32_t user, int64_t time, const char* bytes, size_t length);
+
+  // flushes both files to disk
+  bool sync();
+
+  // calls f(const Entry&) for user's posts made at or after since, newest
+  // first, until f returns false
+  template <typename F>
+  void scanUser(uint32_t user, int64_t since, F&& f) const;
+
+  // calls f(const Entry&) for every post made in [from, to), oldest first,
+  // until f returns false
+  template <typename F>
+  void scanRange(int64_t from, int64_t to, F&& f) const;
+
+  uint64_t size() const { return count_.load(std::memory_order_acquire); }
+
+  // time of the newest record, 0 if there is none; a post older than this
+  // would be filed at this time. Never more than a minute in the future
+  int64_t lastTime() const;
+
+  // record n (below size()), e.g. a post found through a search index that
+  // keeps record numbers
+  Entry at(uint64_t n) const { return entry(n); }
+
+  // number of the first record made at or after time; size() if none
+  uint64_t firstAt(int64_t time) const;
+
+  static int64_t timeOf(const csce662::Message& message);
+
+private:
+  // one mmap of a whole file plus room to grow; superseded maps are kept
+  // until the archive closes, since scans may still point into them
+  struct Mapping {
+    char* data = nullptr;
+    size_t capacity = 0;
+  };
+
+  const IndexRecord* record(uint64_t n) const {
+    return reinterpret_cast<const IndexRecord*>(index_map_.load(std::memory_order_acquire)) + n;
+  }
+  const char* blob() const { return blob_map_.load(std::memory_order_acquire); }
+  Entry entry(uint64_t n) const;
+  uint64_t head(uint32_t user) const;
+
+  bool ensureMapped(int fd, std::vector<Mapping>* maps, std::atomic<char*>* current, size_t needed);
+
+  int index_fd_ = -1;
+  int blob_fd_ = -1;
+
+  mutable std::mutex mu_;                 // appends; heads_ and the maps
+  std::vector<uint64_t> heads_;           // user -> newest record number
+  std::vector<Mapping> index_maps_;
+  std::vector<Mapping> blob_maps_;
+  std::atomic<char*> index_map_{nullptr};
+  std::atomic<char*> blob_map_{nullptr};
+  uint64_t blob_size_ = 0;
+  int64_t last_time_ = 0;
+  std::atomic<uint64_t> count_{0};
+};
+
+static_assert(sizeof(PostArchive::IndexRecord) == 32, "index records are fixed-size");
+
+template <typename F>
+void PostArchive::scanUser(uint32_t user, int64_t since, F&& f) const {
+  for (uint64_t n = head(user); n != kNone;) {
+    const IndexRecord* r = record(n);
+    if (r->time < since || !f(entry(n)))
+      return;
+    n = r->prev;
+  }
+}
+
+inline uint64_t PostArchive::firstAt(int64_t time) const {
+  uint64_t lo = 0, hi = size();
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (record(mid)->time < time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+template <typename F>
+void PostArchive::scanRange(int64_t from, int64_t to, F&& f) const {
+  uint64_t count = size();
+  for (uint64_t n = firstAt(from); n < count && record(n)->time < to; n++) {
+    if (!f(entry(n)))
+      return;
+  }
+}
+
+#endif
@@ -0,0 +1,254 @@
+#include "post_history.h"
+
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "user_registry.h"
+
+bool postIsNewer(const Post& a, const Post& b) {
+  const google::protobuf::Timestamp& ta = a->message().timestamp();
+  const google::protobuf::Timestamp& tb = b->message().timestamp();
+  if (ta.seconds() != tb.seconds())
+    return ta.seconds() > tb.seconds();
+  return ta.nanos() > tb.nanos();
+}
+
+void PostRing::push(const Post& post) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (slots_.empty())
+    slots_.resize(capacity_);
+  slots_[head_] = post;
+  head_ = (head_ + 1) % capacity_;
+  if (count_ < capacity_)
+    count_++;
+}
+
+void PostRing::newest(size_t n, std::vector<Post>* out) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  n = std::min(n, count_);
+  for (size_t i = 1; i <= n; i++)
+    out->push_back(slots_[(head_ + capacity_ - i) % capacity_]);
+}
+
+void PostRing::assign(const std::vector<Post>& posts) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (slots_.empty())
+    slots_.resize(capacity_);
+  size_t n = std::min(posts.size(), capacity_);
+  // posts come newest first, so lay them down from the oldest one we keep
+  for (size_t i = 0; i < n; i++)
+    slots_[i] = posts[n - 1 - i];
+  for (size_t i = n; i < capacity_; i++)
+    slots_[i].reset();
+  head_ = n % capacity_;
+  count_ = n;
+}
+
+void PostRing::clear() {
+  std::lock_guard<std::mutex> lock(mu_);
+  // give the slots back; an unused ring should cost nothing
+  std::vector<Post>().swap(slots_);
+  head_ = count_ = 0;
+}
+
+bool TimelineHistory::wantsHome(Client* c) const {
+  return c->client_following.size() >= home_threshold_;
+}
+
+bool TimelineHistory::pulled(Client* author) const {
+  return pull_threshold_ != 0 && author->client_followers.size() >= pull_threshold_;
+}
+
+bool TimelineHistory::belowHalf(Client* author) const {
+  return author->client_followers.size() < pull_threshold_ / 2;
+}
+
+size_t TimelineHistory::pulledAuthorCount() const {
+  std::lock_guard<std::mutex> lock(pulled_mu_);
+  return pulled_authors_.size();
+}
+
+void TimelineHistory::record(Client* author, const Post& post) {
+  author->recent_posts.push(post);
+  if (pulled(author))
+  {
+    std::lock_guard<std::mutex> lock(pulled_mu_);
+    pulled_authors_[author] = 0;
+    author->pull_merged.store(true, std::memory_order_relaxed);
+  }
+  else if (author->pull_merged.load(std::memory_order_relaxed))
+  {
+    // pushed, but earlier posts may not have been
+    std::lock_guard<std::mutex> lock(pulled_mu_);
+    auto entry = pulled_authors_.find(author);
+    if (entry != pulled_authors_.end() && (++entry->second >= kRecentPosts || belowHalf(author)))
+    {
+      pulled_authors_.erase(entry);
+      author->pull_merged.store(false, std::memory_order_relaxed);
+    }
+  }
+}
+
+void TimelineHistory::trimPulled() {
+  std::lock_guard<std::mutex> lock(pulled_mu_);
+  for (auto entry = pulled_authors_.begin(); entry != pulled_authors_.end();)
+  {
+    if (belowHalf(entry->first))
+    {
+      entry->first->pull_merged.store(false, std::memory_order_relaxed);
+      entry = pulled_authors_.erase(entry);
+    }
+    else
+      ++entry;
+  }
+}
+
+void TimelineHistory::replay(Client* author, const Post& post) {
+  std::vector<Post> newest;
+  author->recent_posts.newest(kReplayPosts, &newest);
+  for (const Post& p : newest)
+  {
+    if (!postIsNewer(p, post) && !postIsNewer(post, p) && p->message().msg() == post->message().msg() &&
+        p->message().seq() == post->message().seq())
+      return;
+  }
+  // already pushed out of a full ring by newer posts
+  if (newest.size() == kReplayPosts && postIsNewer(newest.back(), post))
+    return;
+  author->recent_posts.push(post);
+}
+
+void TimelineHistory::deliver(Client* follower, const Post& post) {
+  if (follower->home_materialized.load(std::memory_order_acquire))
+    follower->home_timeline.push(post);
+}
+
+std::vector<Post> TimelineHistory::mergeFollowees(Client* c, const SocialGraph& graph, size_t n) {
+  // copy each followee's newest n posts (already newest first), then merge
+  AdjacencySet::Snapshot following = graph.following(c);
+  std::vector<std::vector<Post>> lists;
+  lists.reserve(following->size());
+  for (Client* followee : *following)
+  {
+    lists.emplace_back();
+    followee->recent_posts.newest(n, &lists.back());
+    if (lists.back().empty())
+      lists.pop_back();
+  }
+
+  // k-way merge: the heap holds the head of every list, newest on top
+  typedef std::pair<size_t, size_t> Cursor;  // (list, position)
+  auto older = [&lists](const Cursor& a, const Cursor& b) {
+    return postIsNewer(lists[b.first][b.second], lists[a.first][a.second]);
+  };
+  std::priority_queue<Cursor, std::vector<Cursor>, decltype(older)> heap(older);
+  for (size_t i = 0; i < lists.size(); i++)
+    heap.push(Cursor(i, 0));
+
+  std::vector<Post> merged;
+  while (!heap.empty() && merged.size() < n)
+  {
+    Cursor top = heap.top();
+    heap.pop();
+    merged.push_back(lists[top.first][top.second]);
+    if (top.second + 1 < lists[top.first].size())
+      heap.push(Cursor(top.first, top.second + 1));
+  }
+  return merged;
+}
+
+std::vector<Post> TimelineHistory::recent(Client* c, const SocialGraph& graph) {
+  std::vector<Post> posts;
+
+  if (!wantsHome(c))
+  {
+    // below the threshold again: stop paying for the home timeline
+    if (c->home_materialized.exchange(false, std::memory_order_acq_rel))
+      c->home_timeline.clear();
+    posts = mergeFollowees(c, graph, kRecentPosts);
+  }
+  else if (c->home_materialized.load(std::memory_order_acquire))
+  {
+    c->home_timeline.newest(kRecentPosts, &posts);
+    mergePulled(c, graph, &posts);
+  }
+  else
+  {
+    // first read since crossing the threshold: turn fan-out on write on, then
+    // backfill with a merge, keeping anything delivered in between
+    c->home_materialized.store(true, std::memory_order_release);
+    posts = mergeFollowees(c, graph, kRecentPosts);
+    c->home_timeline.newest(kRecentPosts, &posts);
+
+    std::unordered_set<const PostData*> seen;
+    posts.erase(std::remove_if(posts.begin(), posts.end(),
+                               [&seen](const Post& p) { return !seen.insert(p.get()).second; }),
+                posts.end());
+    std::stable_sort(posts.begin(), posts.end(), postIsNewer);
+    if (posts.size() > kRecentPosts)
+      posts.resize(kRecentPosts);
+    c->home_timeline.assign(posts);
+  }
+
+  std::reverse(posts.begin(), posts.end());
+  return posts;
+}
+
+// adds the newest posts of the pulled authors c follows to posts (newest
+// first, at most kRecentPosts), since they were never written into its home
+// timeline. An author pulled only for a while has some posts in both
+void TimelineHistory::mergePulled(Client* c, const SocialGraph& graph, std::vector<Post>* posts) {
+  std::vector<Client*> authors;
+  {
+    std::lock_guard<std::mutex> lock(pulled_mu_);
+    for (const auto& entry : pulled_authors_)
+      authors.push_back(entry.first);
+  }
+  size_t before = posts->size();
+  for (Client* author : authors)
+    if (graph.isFollowing(c, author))
+      author->recent_posts.newest(kRecentPosts, posts);
+  if (posts->size() == before)
+    return;
+
+  std::unordered_set<const PostData*> seen;
+  posts->erase(std::remove_if(posts->begin(), posts->end(),
+                              [&seen](const Post& p) { return !seen.insert(p.get()).second; }),
+               posts->end());
+  std::stable_sort(posts->begin(), posts->end(), postIsNewer);
+  if (posts->size() > kRecentPosts)
+    posts->resize(kRecentPosts);
+}
+
+std::vector<Post> TimelineHistory::missed(Client* c, const SocialGraph& graph, const csce662::Resume& resume) {
+  std::unordered_map<std::string, uint64_t> seen;
+  for (const csce662::Position& position : resume.seen())
+    seen[position.username()] = position.seq();
+
+  // every followee's ring is the replay buffer for that followee
+  AdjacencySet::Snapshot following = graph.following(c);
+  std::vector<Post> posts;
+  std::vector<Post> newest;
+  for (Client* followee : *following)
+  {
+    newest.clear();
+    followee->recent_posts.newest(kReplayPosts, &newest);
+    auto it = seen.find(followee->username);
+    for (const Post& p : newest)
+    {
+      const csce662::Message& m = p->message();
+      bool have = it != seen.end() ? m.seq() <= it->second
+                                   : m.timestamp().seconds() < resume.since().seconds();
+      if (!have)
+        posts.push_back(p);
+    }
+  }
+
+  std::stable_sort(posts.begin(), posts.end(), postIsNewer);
+  if (posts.size() > kReplayPosts)
+    posts.resize(kReplayPosts);
+  std::reverse(posts.begin(), posts.end());
+  return posts;
+}
@@ -0,0 +1,125 @@
+#ifndef POST_HISTORY_H
+#define POST_HISTORY_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "fanout.h"
+
+struct Client;
+class SocialGraph;
+
+// How many posts TIMELINE shows when a user enters it
+const size_t kRecentPosts = 20;
+
+// How many of their newest posts are kept per author: also how far back a
+// resumed Timeline stream can catch up on an author
+const size_t kReplayPosts = 100;
+
+/*
+ * Fixed-capacity ring of the newest posts, oldest overwritten first. The
+ * slots are allocated on the first push and then only ever reassigned, so
+ * pushing a post is a shared_ptr copy under a short lock, no allocation.
+ */
+class PostRing {
+public:
+  explicit PostRing(size_t capacity = kRecentPosts) : capacity_(capacity) {}
+
+  PostRing(const PostRing&) = delete;
+  PostRing& operator=(const PostRing&) = delete;
+
+  void push(const Post& post);
+
+  // appends up to n posts to out, newest first
+  void newest(size_t n, std::vector<Post>* out) const;
+
+  // replaces the contents with posts, given newest first
+  void assign(const std::vector<Post>& posts);
+
+  void clear();
+
+private:
+  const size_t capacity_;
+  mutable std::mutex mu_;
+  std::vector<Post> slots_;
+  size_t head_ = 0;   // where the next push goes
+  size_t count_ = 0;
+};
+
+/*
+ * Builds the "last N posts from people you follow" view.
+ *
+ * By default it is merged on read: every followee's ring is already sorted,
+ * so a k-way merge by timestamp picks the newest N. Users who follow at
+ * least home_threshold accounts instead get a materialized home timeline,
+ * filled as their followees post (fan-out on write), so reading it costs
+ * the same however many accounts they follow.
+ *
+ * Posts of authors with at least pull_threshold followers are not written
+ * into anyone's home timeline: they are stored once, in the author's ring,
+ * and merged into a home timeline when it is read. The few such authors
+ * are remembered for that merge. An author is forgotten again once its last
+ * kRecentPosts posts were all pushed, so none of them is missing from a
+ * home timeline, or once it is down to half the threshold in followers,
+ * which leaves a margin against flapping around the threshold.
+ */
+class TimelineHistory {
+public:
+  explicit TimelineHistory(size_t home_threshold = 200, size_t pull_threshold = 0)
+    : home_threshold_(home_threshold), pull_threshold_(pull_threshold) {}
+
+  // whether author has so many followers that posts are left for them to
+  // pull instead of being pushed to each; never with a threshold of 0
+  bool pulled(Client* author) const;
+
+  // the author just posted
+  void record(Client* author, const Post& post);
+
+  // a post read back from the log; skipped if the author's newest posts
+  // (e.g. loaded from a snapshot) already include it, or are all newer
+  void replay(Client* author, const Post& post);
+
+  // a post of someone the follower follows; only kept if the follower has a
+  // materialized home timeline
+  void deliver(Client* follower, const Post& post);
+
+  // up to kRecentPosts posts from c's followees, oldest first
+  std::vector<Post> recent(Client* c, const SocialGraph& graph);
+
+  // the posts from c's followees that a client resuming a broken stream
+  // doesn't have yet, oldest first; at most the newest kReplayPosts
+  std::vector<Post> missed(Client* c, const SocialGraph& graph, const csce662::Resume& resume);
+
+  size_t homeThreshold() const { return home_threshold_; }
+  size_t pullThreshold() const { return pull_threshold_; }
+
+  // authors that have posted while pulled(), some of whose posts may be in
+  // no home timeline
+  size_t pulledAuthorCount() const;
+
+  // forgets the pulled authors that fell to half the threshold in followers
+  // without posting since; called now and then
+  void trimPulled();
+
+private:
+  bool wantsHome(Client* c) const;
+  bool belowHalf(Client* author) const;
+  std::vector<Post> mergeFollowees(Client* c, const SocialGraph& graph, size_t n);
+  void mergePulled(Client* c, const SocialGraph& graph, std::vector<Post>* posts);
+
+  const size_t home_threshold_;
+  const size_t pull_threshold_;
+
+  mutable std::mutex pulled_mu_;
+  // author -> posts pushed since it was last pulled
+  std::unordered_map<Client*, size_t> pulled_authors_;
+};
+
+// orders posts by their Message timestamp
+bool postIsNewer(const Post& a, const Post& b);
+
+#endif
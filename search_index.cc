@@ -0,0 +1,453 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "sns.pb.h"
+
+namespace {
+
+// posts per sealed segment, before merges
+const size_t kSegmentPosts = 8192;
+// segments aren't merged past this many posts
+const size_t kMaxSegmentPosts = 1 << 20;
+// postings per compressed block
+const uint32_t kBlockPostings = 128;
+// longer words only count by their start
+const size_t kMaxTermBytes = 32;
+// records taken from the archive per pass, indexed under one lock
+const uint64_t kIndexBatch = 256;
+// how long an idle indexer sleeps before looking at the archive again
+const std::chrono::milliseconds kIdleWait(20);
+
+}  // namespace
+
+struct SearchIndex::Segment {
+  struct Skip {
+    uint32_t first;    // first post of a block
+    uint32_t offset;   // where the rest of the block starts in bytes
+  };
+  struct Term {
+    uint32_t skip;     // the term's first block in skips
+    uint32_t count;    // posts that contain it
+  };
+
+  uint64_t base = 0;
+  std::vector<uint32_t> authors;   // by post, counted from base
+  std::unordered_map<std::string, Term> terms;
+  std::vector<Skip> skips;
+  std::string bytes;
+
+  size_t size() const { return authors.size(); }
+};
+
+namespace {
+
+void putVarint(std::string* out, uint32_t value) {
+  while (value >= 0x80)
+  {
+    out->push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back((char)value);
+}
+
+uint32_t getVarint(const char** p) {
+  uint32_t value = 0;
+  for (int shift = 0;; shift += 7)
+  {
+    uint8_t byte = (uint8_t) * (*p)++;
+    value |= (uint32_t)(byte & 0x7f) << shift;
+    if (byte < 0x80)
+      return value;
+  }
+}
+
+// appends a term's posts (ascending) to a segment being built
+void addTerm(SearchIndex::Segment* segment, const std::string& term, const std::vector<uint32_t>& posts) {
+  segment->terms[term] = SearchIndex::Segment::Term{(uint32_t)segment->skips.size(), (uint32_t)posts.size()};
+  for (size_t i = 0; i < posts.size(); i++)
+  {
+    if (i % kBlockPostings == 0)
+      segment->skips.push_back({posts[i], (uint32_t)segment->bytes.size()});
+    else
+      putVarint(&segment->bytes, posts[i] - posts[i - 1]);
+  }
+}
+
+// Walks one term's posting list in a sealed segment
+class SegmentCursor {
+public:
+  SegmentCursor(const SearchIndex::Segment& segment, const SearchIndex::Segment::Term& term)
+    : segment_(segment), first_(term.skip), blocks_((term.count + kBlockPostings - 1) / kBlockPostings),
+      count_(term.count) {
+    load(0);
+  }
+
+  uint32_t count() const { return count_; }
+  bool valid() const { return block_ < blocks_; }
+  uint32_t post() const { return post_; }
+
+  void next() {
+    if (left_ > 0)
+    {
+      post_ += getVarint(&p_);
+      left_--;
+    }
+    else
+      load(block_ + 1);
+  }
+
+  // to the first post at or after target
+  void seek(uint32_t target) {
+    if (!valid() || post_ >= target)
+      return;
+    // the last block that starts at or before target, if past this one
+    const SearchIndex::Segment::Skip* begin = &segment_.skips[first_];
+    const SearchIndex::Segment::Skip* found = std::upper_bound(
+        begin + block_ + 1, begin + blocks_, target,
+        [](uint32_t t, const SearchIndex::Segment::Skip& skip) { return t < skip.first; });
+    if (found - begin - 1 > (ptrdiff_t)block_)
+      load(found - begin - 1);
+    while (valid() && post_ < target)
+      next();
+  }
+
+private:
+  void load(uint32_t block) {
+    block_ = block;
+    if (block_ >= blocks_)
+      return;
+    const SearchIndex::Segment::Skip& skip = segment_.skips[first_ + block_];
+    post_ = skip.first;
+    p_ = segment_.bytes.data() + skip.offset;
+    left_ = std::min(kBlockPostings, count_ - block_ * kBlockPostings) - 1;
+  }
+
+  const SearchIndex::Segment& segment_;
+  const uint32_t first_;
+  const uint32_t blocks_;
+  const uint32_t count_;
+  uint32_t block_ = 0;
+  uint32_t post_ = 0;
+  uint32_t left_ = 0;     // posts after post_ in this block
+  const char* p_ = nullptr;
+};
+
+// The same over a live segment's plain vector
+class VectorCursor {
+public:
+  explicit VectorCursor(const std::vector<uint32_t>& posts) : posts_(posts) {}
+
+  uint32_t count() const { return posts_.size(); }
+  bool valid() const { return i_ < posts_.size(); }
+  uint32_t post() const { return posts_[i_]; }
+  void next() { i_++; }
+  void seek(uint32_t target) {
+    if (valid() && posts_[i_] < target)
+      i_ = std::lower_bound(posts_.begin() + i_, posts_.end(), target) - posts_.begin();
+  }
+
+private:
+  const std::vector<uint32_t>& posts_;
+  size_t i_ = 0;
+};
+
+// Calls f(post) for every post at or after start on all the cursors'
+// lists, ascending. The rarest term leads and the others seek to it
+template <typename C, typename F>
+void intersect(std::vector<C>& cursors, uint32_t start, F&& f) {
+  std::vector<C*> order;
+  for (C& cursor : cursors)
+    order.push_back(&cursor);
+  std::sort(order.begin(), order.end(), [](const C* a, const C* b) { return a->count() < b->count(); });
+  C& lead = *order[0];
+  lead.seek(start);
+  while (lead.valid())
+  {
+    uint32_t post = lead.post();
+    bool all = true;
+    for (size_t i = 1; i < order.size(); i++)
+    {
+      order[i]->seek(post);
+      if (!order[i]->valid())
+        return;
+      if (order[i]->post() != post)
+      {
+        lead.seek(order[i]->post());
+        all = false;
+        break;
+      }
+    }
+    if (all)
+    {
+      f(post);
+      lead.next();
+    }
+  }
+}
+
+void decode(const SearchIndex::Segment& segment, const SearchIndex::Segment::Term& term, uint32_t shift,
+            std::vector<uint32_t>* out) {
+  for (SegmentCursor cursor(segment, term); cursor.valid(); cursor.next())
+    out->push_back(cursor.post() + shift);
+}
+
+// one segment with the posts of two adjacent ones, older first
+std::shared_ptr<const SearchIndex::Segment> merge(const SearchIndex::Segment& older,
+                                                  const SearchIndex::Segment& newer) {
+  auto merged = std::make_shared<SearchIndex::Segment>();
+  merged->base = older.base;
+  merged->authors = older.authors;
+  merged->authors.insert(merged->authors.end(), newer.authors.begin(), newer.authors.end());
+  merged->terms.reserve(std::max(older.terms.size(), newer.terms.size()));
+
+  std::vector<uint32_t> posts;
+  for (const auto& term : older.terms)
+  {
+    posts.clear();
+    decode(older, term.second, 0, &posts);
+    auto also = newer.terms.find(term.first);
+    if (also != newer.terms.end())
+      decode(newer, also->second, older.size(), &posts);
+    addTerm(merged.get(), term.first, posts);
+  }
+  for (const auto& term : newer.terms)
+  {
+    if (older.terms.count(term.first))
+      continue;
+    posts.clear();
+    decode(newer, term.second, older.size(), &posts);
+    addTerm(merged.get(), term.first, posts);
+  }
+  merged->bytes.shrink_to_fit();
+  merged->skips.shrink_to_fit();
+  return merged;
+}
+
+}  // namespace
+
+SearchIndex::~SearchIndex() {
+  stop();
+}
+
+void SearchIndex::start() {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (indexer_.joinable())
+    return;
+  indexer_ = std::thread(&SearchIndex::indexLoop, this);
+  merger_ = std::thread(&SearchIndex::mergeLoop, this);
+}
+
+void SearchIndex::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  wake_cv_.notify_all();
+  if (indexer_.joinable())
+    indexer_.join();
+  if (merger_.joinable())
+    merger_.join();
+}
+
+std::vector<std::string> SearchIndex::terms(const std::string& text) {
+  std::vector<std::string> terms;
+  std::string term;
+  for (size_t i = 0; i <= text.size(); i++)
+  {
+    unsigned char c = i < text.size() ? text[i] : ' ';
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c >= 0x80)
+      term.push_back(c);
+    else if (c >= 'A' && c <= 'Z')
+      term.push_back(c - 'A' + 'a');
+    else
+    {
+      if (!term.empty())
+        terms.push_back(term.substr(0, kMaxTermBytes));
+      term.clear();
+    }
+  }
+  std::sort(terms.begin(), terms.end());
+  terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+  return terms;
+}
+
+std::vector<uint64_t> SearchIndex::search(const std::vector<std::string>& terms,
+                                          const std::unordered_set<uint32_t>* authors, uint64_t from,
+                                          size_t limit) const {
+  std::vector<uint64_t> found;
+  if (terms.empty() || limit == 0)
+    return found;
+
+  std::vector<uint32_t> matches;
+  auto keep = [&](const std::vector<uint32_t>& segment_authors, uint64_t base) {
+    for (auto it = matches.rbegin(); it != matches.rend() && found.size() < limit; ++it)
+      if (authors == nullptr || authors->count(segment_authors[*it]))
+        found.push_back(base + *it);
+  };
+
+  std::vector<std::shared_ptr<const Segment>> segments;
+  {
+    // the live segment has the newest posts
+    std::lock_guard<std::mutex> lock(mu_);
+    segments = segments_;
+    std::vector<VectorCursor> cursors;
+    for (const std::string& term : terms)
+    {
+      auto posts = live_.postings.find(term);
+      if (posts == live_.postings.end())
+        break;
+      cursors.emplace_back(posts->second);
+    }
+    if (cursors.size() == terms.size() && from < live_.base + live_.authors.size())
+    {
+      intersect(cursors, from > live_.base ? from - live_.base : 0,
+                [&matches](uint32_t post) { matches.push_back(post); });
+      keep(live_.authors, live_.base);
+    }
+  }
+
+  for (auto segment = segments.rbegin(); segment != segments.rend() && found.size() < limit; ++segment)
+  {
+    const Segment& s = **segment;
+    if (from >= s.base + s.size())
+      break;
+    std::vector<SegmentCursor> cursors;
+    for (const std::string& term : terms)
+    {
+      auto entry = s.terms.find(term);
+      if (entry == s.terms.end())
+        break;
+      cursors.emplace_back(s, entry->second);
+    }
+    if (cursors.size() != terms.size())
+      continue;
+    matches.clear();
+    intersect(cursors, from > s.base ? from - s.base : 0, [&matches](uint32_t post) { matches.push_back(post); });
+    keep(s.authors, s.base);
+  }
+  return found;
+}
+
+size_t SearchIndex::segmentCount() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return segments_.size() + (live_.authors.empty() ? 0 : 1);
+}
+
+void SearchIndex::indexLoop() {
+  struct Indexed {
+    uint32_t author;
+    std::vector<std::string> terms;
+  };
+  std::vector<Indexed> batch;
+  csce662::Message message;
+  uint64_t next = 0;
+
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      if (stopping_)
+        return;
+      if (next == archive_.size())
+      {
+        wake_cv_.wait_for(lock, kIdleWait);
+        continue;
+      }
+    }
+
+    // tokenize outside the lock, then add the whole batch under it
+    uint64_t end = std::min(archive_.size(), next + kIndexBatch);
+    batch.clear();
+    for (uint64_t n = next; n < end; n++)
+    {
+      PostArchive::Entry entry = archive_.at(n);
+      message.Clear();
+      message.ParseFromArray(entry.data, entry.length);
+      batch.push_back({entry.user, terms(message.msg())});
+    }
+
+    for (size_t i = 0; i < batch.size();)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (; i < batch.size() && live_.authors.size() < kSegmentPosts; i++)
+        {
+          uint32_t post = live_.authors.size();
+          live_.authors.push_back(batch[i].author);
+          for (const std::string& term : batch[i].terms)
+            live_.postings[term].push_back(post);
+        }
+      }
+      if (live_.authors.size() == kSegmentPosts)
+        seal();
+    }
+    next = end;
+    indexed_.store(end, std::memory_order_relaxed);
+  }
+}
+
+// Compresses the live segment into a sealed one. Only the indexer changes
+// the live segment, so it is read here without the lock while queries go
+// on reading it too; the lock is only taken to swap the two
+void SearchIndex::seal() {
+  auto sealed = std::make_shared<Segment>();
+  sealed->base = live_.base;
+  sealed->authors = live_.authors;
+  sealed->terms.reserve(live_.postings.size());
+  for (const auto& term : live_.postings)
+    addTerm(sealed.get(), term.first, term.second);
+  sealed->bytes.shrink_to_fit();
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    segments_.push_back(sealed);
+    live_.base += live_.authors.size();
+    live_.authors.clear();
+    live_.postings.clear();
+    merge_due_ = true;
+  }
+  wake_cv_.notify_all();
+}
+
+// Merges the newest two adjacent segments where the older one is less than
+// twice the size of the newer, until there are none (like carries in a
+// binary counter), so n posts end up in about log2(n / kSegmentPosts)
+// segments
+void SearchIndex::mergeLoop() {
+  while (true)
+  {
+    std::shared_ptr<const Segment> older, newer;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      wake_cv_.wait(lock, [this] { return merge_due_ || stopping_; });
+      if (stopping_)
+        return;
+      for (size_t i = segments_.size(); i >= 2; i--)
+      {
+        const Segment& a = *segments_[i - 2];
+        const Segment& b = *segments_[i - 1];
+        if (a.size() < 2 * b.size() && a.size() + b.size() <= kMaxSegmentPosts)
+        {
+          older = segments_[i - 2];
+          newer = segments_[i - 1];
+          break;
+        }
+      }
+      if (older == nullptr)
+      {
+        merge_due_ = false;
+        continue;
+      }
+    }
+
+    std::shared_ptr<const Segment> merged = merge(*older, *newer);
+
+    // only this thread replaces segments, so the pair is still there
+    std::lock_guard<std::mutex> lock(mu_);
+    auto at = std::find(segments_.begin(), segments_.end(), older);
+    *at = merged;
+    segments_.erase(at + 1);
+  }
+}
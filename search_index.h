@@ -0,0 +1,91 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "post_archive.h"
+
+/*
+ * Inverted index over the text of every post in a PostArchive, for "the
+ * newest posts containing all of these words (by these authors, since
+ * then)".
+ *
+ * A post is known by its archive record number. Records are in time order,
+ * so a posting list is also a list of posts from oldest to newest, and a
+ * time bound is just a record number (PostArchive::firstAt).
+ *
+ * A background thread follows the archive as it grows. New posts go into a
+ * small in-memory segment, which is sealed every kSegmentPosts posts into
+ * an immutable one with compressed posting lists: blocks of delta-encoded
+ * varints, each block's first post kept in a skip list so intersecting
+ * lists can jump over blocks. A second thread merges adjacent sealed
+ * segments of about the same size, so there are only logarithmically many.
+ * A query takes the current list of segments and walks them newest first,
+ * stopping as soon as it has enough posts.
+ *
+ * Terms are runs of letters and digits, lowercased; bytes outside ASCII are
+ * kept as they are, so words in UTF-8 are terms too.
+ */
+class SearchIndex {
+public:
+  explicit SearchIndex(const PostArchive& archive) : archive_(archive) {}
+  ~SearchIndex();
+
+  SearchIndex(const SearchIndex&) = delete;
+  SearchIndex& operator=(const SearchIndex&) = delete;
+
+  // starts indexing the archive, from its first post
+  void start();
+  void stop();
+
+  // the distinct terms of text
+  static std::vector<std::string> terms(const std::string& text);
+
+  // record numbers of up to limit posts that contain every term, are at
+  // or after record from and, unless authors is nullptr, are by one of
+  // authors; newest first
+  std::vector<uint64_t> search(const std::vector<std::string>& terms, const std::unordered_set<uint32_t>* authors,
+                               uint64_t from, size_t limit) const;
+
+  // posts indexed so far, and the segments they are in
+  uint64_t indexedCount() const { return indexed_.load(std::memory_order_relaxed); }
+  size_t segmentCount() const;
+
+  struct Segment;
+
+private:
+  struct LiveSegment {
+    uint64_t base = 0;
+    std::vector<uint32_t> authors;   // by post, counted from base
+    std::unordered_map<std::string, std::vector<uint32_t>> postings;
+  };
+
+  void indexLoop();
+  void mergeLoop();
+  void seal();
+
+  const PostArchive& archive_;
+
+  mutable std::mutex mu_;              // segments_ and live_
+  std::condition_variable wake_cv_;    // indexer and merger
+  std::vector<std::shared_ptr<const Segment>> segments_;  // oldest first
+  LiveSegment live_;
+  bool merge_due_ = false;
+  bool stopping_ = false;
+
+  std::atomic<uint64_t> indexed_{0};
+  std::thread indexer_;
+  std::thread merger_;
+};
+
+#endif
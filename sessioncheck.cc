@@ -0,0 +1,168 @@
+/*
+ * Checks, against a running tsd, that a Timeline stream opened with a
+ * stale session is refused rather than ignored. Two fresh users log in and
+ * the second follows the first, who then opens a stream with a session that
+ * isn't theirs and posts on it. The stream must end with UNAUTHENTICATED and
+ * the follower must get nothing: in particular not the post, relayed as if
+ * it had opened the stream. After logging in again the same post must reach
+ * the follower numbered, i.e. as a real post. Exits 1 on a failed check.
+ *
+ *   ./sessioncheck [-h host] [-p port]
+ */
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+
+using grpc::ClientContext;
+using grpc::Status;
+using csce662::Message;
+using csce662::Reply;
+using csce662::Request;
+using csce662::SNSService;
+
+typedef grpc::ClientReaderWriter<Message, Message> TimelineStream;
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+  std::cout << (ok ? "ok:   " : "FAIL: ") << what << std::endl;
+  if (!ok)
+    failures++;
+}
+
+static Reply login(SNSService::Stub* stub, const std::string& username) {
+  ClientContext context;
+  Request request;
+  Reply reply;
+  request.set_username(username);
+  stub->Login(&context, request, &reply);
+  return reply;
+}
+
+static Message message(const std::string& username, const std::string& text, const Reply& session) {
+  Message m;
+  m.set_username(username);
+  m.set_msg(text);
+  m.set_user_id(session.user_id());
+  m.set_session(session.session());
+  return m;
+}
+
+int main(int argc, char** argv) {
+  std::string hostname = "localhost";
+  std::string port = "3010";
+
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "h:p:")) != -1){
+    switch(opt) {
+      case 'h':
+        hostname = optarg;break;
+      case 'p':
+        port = optarg;break;
+      default:
+        std::cerr << "Invalid Command Line Argument\n";
+    }
+  }
+
+  std::unique_ptr<SNSService::Stub> stub = SNSService::NewStub(
+      grpc::CreateChannel(hostname + ":" + port, grpc::InsecureChannelCredentials()));
+
+  // fresh names, so the check can run against a server more than once
+  std::string suffix = std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+  std::string author = "sessioncheck-a" + suffix;
+  std::string follower = "sessioncheck-f" + suffix;
+  Reply author_login = login(stub.get(), author);
+  Reply follower_login = login(stub.get(), follower);
+  if (author_login.session() == 0 || follower_login.session() == 0)
+  {
+    std::cerr << "Cannot log in to " << hostname << ":" << port << std::endl;
+    return 1;
+  }
+  {
+    ClientContext context;
+    Request request;
+    Reply reply;
+    request.set_username(follower);
+    request.set_user_id(follower_login.user_id());
+    request.set_session(follower_login.session());
+    request.add_arguments(author);
+    check(stub->Follow(&context, request, &reply).ok(), "follow");
+  }
+
+  // the follower's stream, read until the end of the check
+  ClientContext follower_context;
+  std::unique_ptr<TimelineStream> follower_stream = stub->Timeline(&follower_context);
+  follower_stream->Write(message(follower, "Connected", follower_login));
+  std::mutex mu;
+  std::vector<Message> received;
+  std::thread reader([&] {
+    Message m;
+    while (follower_stream->Read(&m))
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      received.push_back(m);
+    }
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  // a stale session, then a post naming the author only by username, as
+  // tsc sends them
+  {
+    Reply stale = author_login;
+    stale.set_session(author_login.session() + 1);
+    ClientContext context;
+    std::unique_ptr<TimelineStream> stream = stub->Timeline(&context);
+    stream->Write(message(author, "Connected", stale));
+    Message post;
+    post.set_username(author);
+    post.set_msg("lost?");
+    stream->Write(post);
+    stream->WritesDone();
+    Message m;
+    while (stream->Read(&m))
+      ;
+    Status status = stream->Finish();
+    check(status.error_code() == grpc::StatusCode::UNAUTHENTICATED,
+          "stale session refused (status " + std::to_string(status.error_code()) + ")");
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    check(received.empty(), "follower got nothing from the refused stream");
+  }
+
+  // logged in again, the stream opens and the post is a real one. The
+  // author still counts as connected, so the new login hands out no session
+  // and the stream is opened by username
+  {
+    ClientContext context;
+    std::unique_ptr<TimelineStream> stream = stub->Timeline(&context);
+    stream->Write(message(author, "Connected", login(stub.get(), author)));
+    Message post;
+    post.set_username(author);
+    post.set_msg("posted");
+    stream->Write(post);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    stream->WritesDone();
+    stream->Finish();
+  }
+  follower_context.TryCancel();
+  reader.join();
+
+  bool posted = false;
+  for (const Message& m : received)
+    posted = posted || (m.msg() == "posted" && m.seq() != 0);
+  check(posted, "post after logging in again delivered with a seq");
+
+  std::cout << (failures == 0 ? "ok" : std::to_string(failures) + " failures") << std::endl;
+  return failures == 0 ? 0 : 1;
+}
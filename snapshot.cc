@@ -0,0 +1,473 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "user_registry.h"
+#include "wal.h"
+
+namespace {
+
+const char kMagic[8] = {'T', 'S', 'D', 'S', 'N', 'A', 'P', '\n'};
+const uint32_t kVersion = 1;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_crc;      // of the header with this field zeroed
+  uint64_t seq;
+  uint64_t user_count;
+  uint64_t edge_count;
+  uint64_t names_offset;
+  uint64_t edges_offset;
+  uint64_t index_offset;
+  uint64_t posts_offset;
+  uint64_t file_size;
+  uint32_t body_crc;        // of everything after the header
+  uint32_t unused;
+};
+
+struct UserEntry {
+  uint64_t name_offset;
+  uint32_t name_length;
+  uint32_t unused;
+};
+
+static_assert(sizeof(SnapshotHeader) % 8 == 0, "sections after the header are 8-byte aligned");
+static_assert(sizeof(UserEntry) == 16, "user entries are fixed-size");
+
+// below this many items per thread, threads cost more than they save
+const size_t kMinItemsPerThread = 4096;
+
+// splits [0, n) across the machine's cores and runs f(begin, end) on each part
+template <typename F>
+void parallelFor(size_t n, const F& f) {
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::max<size_t>(1, std::min(threads, n / kMinItemsPerThread));
+  std::vector<std::thread> pool;
+  for (size_t t = 1; t < threads; t++)
+    pool.emplace_back(f, n * t / threads, n * (t + 1) / threads);
+  f(0, n / threads);
+  for (std::thread& thread : pool)
+    thread.join();
+}
+
+uint32_t getU32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+bool syncDir(const std::string& dir) {
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return false;
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+// Buffers the sequential part of a snapshot and keeps a running crc32 of it
+class SnapshotWriter {
+public:
+  SnapshotWriter(int fd, uint64_t offset) : fd_(fd), offset_(offset) {}
+
+  void put(const void* data, size_t len) {
+    buffer_.append(static_cast<const char*>(data), len);
+    crc_ = crc32(static_cast<const char*>(data), len, crc_);
+    offset_ += len;
+    if (buffer_.size() >= kFlushBytes)
+      flush();
+  }
+
+  void putU32(uint32_t v) { put(&v, sizeof(v)); }
+
+  // zero-fills up to the next multiple of 8
+  void align() {
+    static const char zeros[8] = {};
+    put(zeros, (8 - offset_ % 8) % 8);
+  }
+
+  bool flush() {
+    const char* data = buffer_.data();
+    size_t len = buffer_.size();
+    while (ok_ && len > 0) {
+      ssize_t n = ::write(fd_, data, len);
+      if (n < 0 && errno != EINTR)
+        ok_ = false;
+      if (n > 0) {
+        data += n;
+        len -= n;
+      }
+    }
+    buffer_.clear();
+    return ok_;
+  }
+
+  uint64_t offset() const { return offset_; }
+  uint32_t crc() const { return crc_; }
+
+private:
+  static const size_t kFlushBytes = 1 << 20;
+
+  int fd_;
+  uint64_t offset_;
+  uint32_t crc_ = 0;
+  bool ok_ = true;
+  std::string buffer_;
+};
+
+// Read-only view of a whole file, unmapped when it goes out of scope
+class MappedFile {
+public:
+  ~MappedFile() {
+    if (data_ != nullptr)
+      munmap(const_cast<char*>(data_), size_);
+  }
+
+  bool open(const std::string& path, std::string* error) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      *error = path + ": " + strerror(errno);
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+    size_ = st.st_size;
+    void* map = size_ == 0 ? MAP_FAILED : mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      *error = path + ": cannot map " + std::to_string(size_) + " bytes";
+      return false;
+    }
+    // it is all read, most of it sequentially, right away
+    madvise(map, size_, MADV_WILLNEED);
+    data_ = static_cast<const char*>(map);
+    return true;
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// seq of a snapshot-<seq>.snap name, 0 if it isn't one
+uint64_t snapshotSeq(const char* name) {
+  uint64_t seq;
+  char suffix[8];
+  if (sscanf(name, "snapshot-%" SCNu64 ".%7s", &seq, suffix) != 2 || strcmp(suffix, "snap") != 0)
+    return 0;
+  return seq;
+}
+
+}  // namespace
+
+std::string SnapshotStore::snapshotPath(uint64_t seq) const {
+  char name[40];
+  snprintf(name, sizeof(name), "snapshot-%020" PRIu64 ".snap", seq);
+  return dir_ + "/" + name;
+}
+
+bool SnapshotStore::load(std::string* error) {
+  DIR* d = opendir(dir_.c_str());
+  if (d == nullptr) {
+    *error = dir_ + ": " + strerror(errno);
+    return false;
+  }
+  std::vector<uint64_t> seqs;
+  while (dirent* entry = readdir(d)) {
+    std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0 && name.compare(0, 9, "snapshot-") == 0)
+      unlink((dir_ + "/" + name).c_str());   // a snapshot cut short by a crash
+    else if (uint64_t seq = snapshotSeq(entry->d_name))
+      seqs.push_back(seq);
+  }
+  closedir(d);
+
+  // newest first; an older one is only left over if deleting it failed, and
+  // it only helps if the log it needs is still there
+  std::sort(seqs.rbegin(), seqs.rend());
+  for (uint64_t seq : seqs) {
+    if (loadFile(snapshotPath(seq), error))
+      return true;
+  }
+  return seqs.empty();
+}
+
+bool SnapshotStore::loadFile(const std::string& path, std::string* error) {
+  MappedFile file;
+  if (!file.open(path, error))
+    return false;
+  const char* data = file.data();
+  const size_t size = file.size();
+
+  // check everything before touching the registry, so a bad file leaves it
+  // empty for the next candidate
+  SnapshotHeader header;
+  if (size < sizeof(header)) {
+    *error = path + ": truncated";
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  uint32_t header_crc = header.header_crc;
+  header.header_crc = 0;
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+      crc32(reinterpret_cast<const char*>(&header), sizeof(header)) != header_crc) {
+    *error = path + ": not a snapshot, or from another version";
+    return false;
+  }
+  if (header.file_size != size ||
+      crc32(data + sizeof(header), size - sizeof(header)) != header.body_crc) {
+    *error = path + ": corrupt";
+    return false;
+  }
+
+  const uint64_t n = header.user_count;
+  const uint64_t users_offset = sizeof(header);
+  if (n >= (uint64_t(1) << 32) ||
+      users_offset + n * sizeof(UserEntry) > header.names_offset ||
+      header.names_offset > header.edges_offset ||
+      header.edges_offset + header.edge_count * 4 > header.index_offset ||
+      header.index_offset + (n + 1) * 8 > header.posts_offset ||
+      header.posts_offset > size ||
+      header.edges_offset % 8 != 0 || header.index_offset % 8 != 0) {
+    *error = path + ": bad section layout";
+    return false;
+  }
+
+  const UserEntry* entries = reinterpret_cast<const UserEntry*>(data + users_offset);
+  const char* names = data + header.names_offset;
+  const uint32_t* edges = reinterpret_cast<const uint32_t*>(data + header.edges_offset);
+  const uint64_t* index = reinterpret_cast<const uint64_t*>(data + header.index_offset);
+
+  const uint64_t names_size = header.edges_offset - header.names_offset;
+  for (uint64_t i = 0; i < n; i++) {
+    if (entries[i].name_offset + entries[i].name_length > names_size || index[i] > index[i + 1]) {
+      *error = path + ": bad entry for user " + std::to_string(i + 1);
+      return false;
+    }
+  }
+  if (index[0] != 0 || index[n] != header.edge_count) {
+    *error = path + ": bad edge index";
+    return false;
+  }
+  for (uint64_t e = 0; e < header.edge_count; e++) {
+    if (edges[e] == kInvalidUserId || edges[e] > n) {
+      *error = path + ": bad edge " + std::to_string(e);
+      return false;
+    }
+  }
+
+  // find where each user's posts start; parsing them is left to the threads
+  std::vector<std::pair<UserId, uint64_t>> post_lists;
+  uint64_t off = header.posts_offset;
+  while (true) {
+    if (off + 4 > size)
+      break;
+    UserId id = getU32(data + off);
+    if (id == kInvalidUserId)
+      break;
+    if (id > n || off + 8 > size) {
+      *error = path + ": bad posts at offset " + std::to_string(off);
+      return false;
+    }
+    post_lists.emplace_back(id, off);
+    uint32_t count = getU32(data + off + 4);
+    off += 8;
+    for (uint32_t i = 0; i < count && off <= size; i++)
+      off = off + 4 <= size ? off + 4 + getU32(data + off) : size + 1;
+    if (off > size) {
+      *error = path + ": bad posts of user " + std::to_string(id);
+      return false;
+    }
+  }
+  if (off + 4 > size) {
+    *error = path + ": posts not terminated";
+    return false;
+  }
+
+  // users first, in parallel: the registry shards have their own locks
+  std::vector<Client*> clients(n);
+  parallelFor(n, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      std::string name(names + entries[i].name_offset, entries[i].name_length);
+      Client* c = users_.insert(name, i + 1);
+      if (c != nullptr)
+        c->connected = false;
+      clients[i] = c;
+    }
+  });
+  for (uint64_t i = 0; i < n; i++) {
+    if (clients[i] == nullptr || clients[i]->id != i + 1) {
+      *error = path + ": user " + std::to_string(i + 1) + " clashes with one already loaded";
+      return false;
+    }
+  }
+
+  // then edges, split by follower; SocialGraph already copes with
+  // concurrent follows. Both sides are sized up front
+  std::vector<uint32_t> follower_counts(n);
+  for (uint64_t e = 0; e < header.edge_count; e++)
+    follower_counts[edges[e] - 1]++;
+  parallelFor(n, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+      graph_.reserve(clients[i], index[i + 1] - index[i], follower_counts[i]);
+  });
+  parallelFor(n, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+      for (uint64_t e = index[i]; e < index[i + 1]; e++)
+        graph_.follow(clients[i], clients[edges[e] - 1]);
+  });
+
+  parallelFor(post_lists.size(), [&](size_t begin, size_t end) {
+    std::vector<Post> posts;
+    for (size_t i = begin; i < end; i++) {
+      const char* p = data + post_lists[i].second;
+      uint32_t count = getU32(p + 4);
+      p += 8;
+      posts.clear();
+      for (uint32_t j = 0; j < count; j++) {
+        uint32_t len = getU32(p);
+        Post post = parsePost(p + 4, len);
+        if (post != nullptr)
+          posts.push_back(post);
+        p += 4 + len;
+      }
+      Client* c = clients[post_lists[i].first - 1];
+      c->recent_posts.assign(posts);
+      if (!posts.empty())
+        c->post_seq.store(posts.front()->message().seq(), std::memory_order_relaxed);
+    }
+  });
+
+  seq_.store(header.seq, std::memory_order_release);
+  return true;
+}
+
+bool SnapshotStore::write(WriteAheadLog& wal, std::string* error) {
+  // everything logged up to seq is already in memory; what is logged after
+  // may or may not make it in, and gets replayed on top either way
+  const uint64_t seq = wal.lastSeq();
+  if (seq == this->seq())
+    return true;
+
+  const UserId n = users_.size();
+  std::vector<Client*> clients(n);
+  for (UserId id = 1; id <= n; id++) {
+    // an id is handed out just before its client is published
+    while ((clients[id - 1] = users_.get(id)) == nullptr)
+      std::this_thread::yield();
+  }
+
+  const std::string path = snapshotPath(seq);
+  const std::string tmp = path + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || lseek(fd, sizeof(SnapshotHeader), SEEK_SET) < 0) {
+    *error = tmp + ": " + strerror(errno);
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.seq = seq;
+  header.user_count = n;
+
+  SnapshotWriter out(fd, sizeof(header));
+  uint64_t name_offset = 0;
+  for (Client* c : clients) {
+    UserEntry entry = {name_offset, static_cast<uint32_t>(c->username.size()), 0};
+    out.put(&entry, sizeof(entry));
+    name_offset += c->username.size();
+  }
+  header.names_offset = out.offset();
+  for (Client* c : clients)
+    out.put(c->username.data(), c->username.size());
+  out.align();
+
+  // a followee created after n is left to the log, like its LOGIN
+  header.edges_offset = out.offset();
+  std::vector<uint64_t> index;
+  index.reserve(n + 1);
+  index.push_back(0);
+  for (Client* c : clients) {
+    AdjacencySet::Snapshot following = graph_.following(c);
+    for (Client* followee : *following) {
+      if (followee->id <= n) {
+        out.putU32(followee->id);
+        header.edge_count++;
+      }
+    }
+    index.push_back(header.edge_count);
+  }
+  out.align();
+  header.index_offset = out.offset();
+  out.put(index.data(), index.size() * sizeof(uint64_t));
+
+  header.posts_offset = out.offset();
+  std::vector<Post> posts;
+  std::string bytes;
+  for (Client* c : clients) {
+    posts.clear();
+    c->recent_posts.newest(kReplayPosts, &posts);
+    if (posts.empty())
+      continue;
+    out.putU32(c->id);
+    out.putU32(posts.size());
+    for (const Post& post : posts) {
+      post->message().SerializeToString(&bytes);
+      out.putU32(bytes.size());
+      out.put(bytes.data(), bytes.size());
+    }
+  }
+  out.putU32(kInvalidUserId);
+
+  header.file_size = out.offset();
+  header.body_crc = out.crc();
+  header.header_crc = crc32(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  // the snapshot may hold changes logged after seq: don't let it outlive
+  // their log records
+  bool ok = out.flush() &&
+            pwrite(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+            wal.sync(wal.lastSeq()) &&
+            fsync(fd) == 0;
+  if (close(fd) != 0)
+    ok = false;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0 || !syncDir(dir_)) {
+    *error = path + ": cannot write it: " + strerror(errno);
+    unlink(tmp.c_str());
+    return false;
+  }
+  seq_.store(seq, std::memory_order_release);
+
+  // only now is everything up to seq safe to forget
+  DIR* d = opendir(dir_.c_str());
+  if (d != nullptr) {
+    while (dirent* entry = readdir(d)) {
+      uint64_t old = snapshotSeq(entry->d_name);
+      if (old != 0 && old < seq)
+        unlink((dir_ + "/" + entry->d_name).c_str());
+    }
+    closedir(d);
+  }
+  wal.compact(seq);
+  return true;
+}
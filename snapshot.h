@@ -0,0 +1,68 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+class SocialGraph;
+class UserRegistry;
+class WriteAheadLog;
+
+/*
+ * Point-in-time images of the user registry, the follow graph and every
+ * user's newest posts, so that a restart only has to replay the log written
+ * since the last one (and the log before it can be deleted).
+ *
+ * A snapshot is one file, snapshot-<seq>.snap, where seq is the last log
+ * record it covers. It is laid out to be mmapped and read in place, all
+ * integers little-endian:
+ *
+ *   header      magic, version, seq, counts and section offsets, crc32s
+ *   users       user_count x {u64 name offset, u32 name length, u32 unused},
+ *               entry i is user id i + 1
+ *   names       the usernames back to back
+ *   edges       edge_count x u32 followee id, grouped by follower
+ *   edge index  (user_count + 1) x u64; user i's followees are
+ *               edges[index[i], index[i + 1])
+ *   posts       per user with posts: u32 id, u32 count, then count x
+ *               {u32 length, Message bytes}, newest first; id 0 ends it
+ *
+ * Snapshots are taken while RPCs keep running: the state is read through
+ * the same lock-free snapshots the RPCs use, so it may already include some
+ * changes logged after seq. Replaying those again on top of it is harmless,
+ * since every log record leaves the same state however often it is applied.
+ */
+class SnapshotStore {
+public:
+  SnapshotStore(const std::string& dir, UserRegistry& users, SocialGraph& graph)
+    : dir_(dir), users_(users), graph_(graph) {}
+
+  SnapshotStore(const SnapshotStore&) = delete;
+  SnapshotStore& operator=(const SnapshotStore&) = delete;
+
+  // fills the (empty) registry and graph from the newest intact snapshot in
+  // dir; true with seq() == 0 if there is none
+  bool load(std::string* error);
+
+  // writes a snapshot covering everything logged so far, then deletes the
+  // older snapshots and the log segments it makes unnecessary. one writer
+  // at a time
+  bool write(WriteAheadLog& wal, std::string* error);
+
+  // last log record covered by the newest snapshot
+  uint64_t seq() const { return seq_.load(std::memory_order_acquire); }
+
+  // where the snapshot covering records up to seq is (or would be) kept
+  std::string snapshotPath(uint64_t seq) const;
+
+private:
+  bool loadFile(const std::string& path, std::string* error);
+
+  const std::string dir_;
+  UserRegistry& users_;
+  SocialGraph& graph_;
+  std::atomic<uint64_t> seq_{0};
+};
+
+#endif
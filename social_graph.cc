@@ -0,0 +1,105 @@
+#include "social_graph.h"
+
+#include "user_registry.h"
+
+AdjacencySet::AdjacencySet()
+  : snapshot_(std::make_shared<const std::vector<Client*>>()) {}
+
+AdjacencySet::Snapshot AdjacencySet::snapshot() const {
+  if (!dirty_.load(std::memory_order_acquire))
+    return std::atomic_load(&snapshot_);
+
+  std::lock_guard<std::mutex> lock(mu_);
+  // another reader may have rebuilt it while we waited
+  if (dirty_.load(std::memory_order_relaxed)) {
+    std::atomic_store(&snapshot_, Snapshot(std::make_shared<const std::vector<Client*>>(items_)));
+    dirty_.store(false, std::memory_order_release);
+  }
+  return std::atomic_load(&snapshot_);
+}
+
+bool AdjacencySet::contains(Client* c) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return index_.count(c) != 0;
+}
+
+void AdjacencySet::reserve(size_t n) {
+  std::lock_guard<std::mutex> lock(mu_);
+  items_.reserve(n);
+  index_.reserve(n);
+}
+
+bool AdjacencySet::insertLocked(Client* c) {
+  if (!index_.emplace(c, items_.size()).second)
+    return false;
+  items_.push_back(c);
+  size_.store(items_.size(), std::memory_order_relaxed);
+  dirty_.store(true, std::memory_order_release);
+  return true;
+}
+
+bool AdjacencySet::eraseLocked(Client* c) {
+  auto it = index_.find(c);
+  if (it == index_.end())
+    return false;
+
+  // move the last element into the hole so the erase stays O(1)
+  size_t pos = it->second;
+  Client* last = items_.back();
+  items_[pos] = last;
+  index_[last] = pos;
+  items_.pop_back();
+  index_.erase(c);
+
+  size_.store(items_.size(), std::memory_order_relaxed);
+  dirty_.store(true, std::memory_order_release);
+  return true;
+}
+
+SocialGraph::Result SocialGraph::follow(Client* follower, Client* followee, const ChangeFn& on_change) {
+  if (follower == followee)
+    return SELF;
+
+  std::lock_guard<std::mutex> out_lock(follower->client_following.mu_);
+  if (!follower->client_following.insertLocked(followee))
+    return ALREADY_FOLLOWING;
+
+  std::lock_guard<std::mutex> in_lock(followee->client_followers.mu_);
+  followee->client_followers.insertLocked(follower);
+  edges_.fetch_add(1, std::memory_order_relaxed);
+  changes_.fetch_add(1, std::memory_order_relaxed);
+  if (on_change)
+    on_change();
+  return OK;
+}
+
+SocialGraph::Result SocialGraph::unfollow(Client* follower, Client* followee, const ChangeFn& on_change) {
+  std::lock_guard<std::mutex> out_lock(follower->client_following.mu_);
+  if (!follower->client_following.eraseLocked(followee))
+    return NOT_FOLLOWING;
+
+  std::lock_guard<std::mutex> in_lock(followee->client_followers.mu_);
+  followee->client_followers.eraseLocked(follower);
+  edges_.fetch_sub(1, std::memory_order_relaxed);
+  changes_.fetch_add(1, std::memory_order_relaxed);
+  if (on_change)
+    on_change();
+  return OK;
+}
+
+bool SocialGraph::isFollowing(Client* follower, Client* followee) const {
+  return follower->client_following.contains(followee);
+}
+
+void SocialGraph::reserve(Client* c, size_t following, size_t followers) {
+  c->client_following.reserve(following);
+  c->client_followers.reserve(followers);
+}
+
+AdjacencySet::Snapshot SocialGraph::followers(Client* c) const {
+  return c->client_followers.snapshot();
+}
+
+AdjacencySet::Snapshot SocialGraph::following(Client* c) const {
+  return c->client_following.snapshot();
+}
@@ -0,0 +1,95 @@
+#ifndef SOCIAL_GRAPH_H
+#define SOCIAL_GRAPH_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct Client;
+
+/*
+ * One side of a user's adjacency (who they follow, or who follows them).
+ *
+ * Writers keep a vector plus a position index so insert, erase and
+ * membership are all O(1) (erase swaps the last element into the hole).
+ * Readers never touch the vector: they get an immutable copy-on-write
+ * snapshot that is rebuilt lazily, the first time someone asks for it after
+ * a change. A hot follower list that is read on every post and rarely
+ * changes is therefore read without taking the lock.
+ */
+class AdjacencySet {
+public:
+  using Snapshot = std::shared_ptr<const std::vector<Client*>>;
+
+  AdjacencySet();
+
+  AdjacencySet(const AdjacencySet&) = delete;
+  AdjacencySet& operator=(const AdjacencySet&) = delete;
+
+  Snapshot snapshot() const;
+  bool contains(Client* c) const;
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+private:
+  friend class SocialGraph;
+
+  void reserve(size_t n);
+  bool insertLocked(Client* c);
+  bool eraseLocked(Client* c);
+
+  mutable std::mutex mu_;
+  std::vector<Client*> items_;
+  std::unordered_map<Client*, size_t> index_;
+  std::atomic<size_t> size_{0};
+
+  // published copy of items_; stale while dirty_ is set
+  mutable Snapshot snapshot_;
+  mutable std::atomic<bool> dirty_{false};
+};
+
+/*
+ * Follow/unfollow edges between clients. Both directions of an edge are
+ * updated under the follower's "following" lock, so a concurrent follow
+ * and unfollow of the same edge can never leave the two sides disagreeing.
+ * Locks are always taken following-side first, followers-side second.
+ */
+class SocialGraph {
+public:
+  enum Result {
+    OK,
+    ALREADY_FOLLOWING,
+    NOT_FOLLOWING,
+    SELF
+  };
+
+  // on_change runs only if the edge actually changed, while the edge is
+  // still locked, so whatever it records is ordered like the changes are
+  using ChangeFn = std::function<void()>;
+
+  Result follow(Client* follower, Client* followee, const ChangeFn& on_change = nullptr);
+  Result unfollow(Client* follower, Client* followee, const ChangeFn& on_change = nullptr);
+  bool isFollowing(Client* follower, Client* followee) const;
+
+  // makes room for c's edges ahead of a bulk load, so adding them doesn't
+  // keep regrowing the sets
+  void reserve(Client* c, size_t following, size_t followers);
+
+  AdjacencySet::Snapshot followers(Client* c) const;
+  AdjacencySet::Snapshot following(Client* c) const;
+
+  size_t edgeCount() const { return edges_.load(std::memory_order_relaxed); }
+
+  // edges added or removed so far; tells whether anything changed since
+  // an earlier look
+  uint64_t changeCount() const { return changes_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<size_t> edges_{0};
+  std::atomic<uint64_t> changes_{0};
+};
+
+#endif
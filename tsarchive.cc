@@ -0,0 +1,260 @@
+/*
+ * Moves posts between tsd's post archive and the text format
+ *
+ *   T 2009-06-01 00:00:00
+ *   U http://twitter.com/testuser
+ *   W Post content
+ *
+ * with times in UTC and posts separated by blank lines.
+ *
+ *   ./tsarchive [-d data_dir] import [file ...]
+ *   ./tsarchive [-d data_dir] export [-u username] [-s since] [-e until]
+ *
+ * import reads the files (or stdin), sorts the posts by time and appends
+ * them; authors tsd hasn't seen yet are logged in first, as if they had
+ * logged in themselves. The archive only grows forward in time, so an
+ * import with posts older than the newest one already archived is refused
+ * as a whole. export writes posts in [since, until) to stdout,
+ * oldest first. tsd must not be running on the same data directory.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "post_archive.h"
+#include "snapshot.h"
+#include "user_registry.h"
+#include "wal.h"
+
+using csce662::LogRecord;
+using csce662::Message;
+
+static const char kUserPrefix[] = "http://twitter.com/";
+
+static UserRegistry user_registry;
+static SocialGraph social_graph;
+
+// only users matter here; follows and posts are left to tsd
+static void applyLogin(const LogRecord& record) {
+  if (record.type() == LogRecord::LOGIN)
+    user_registry.insert(record.username(), record.user_id());
+}
+
+// "2009-06-01 00:00:00" in UTC to nanoseconds since the epoch
+static bool parseTime(const std::string& text, int64_t* time) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char* end = strptime(text.c_str(), "%Y-%m-%d %H:%M:%S", &tm);
+  if (end == nullptr || *end != '\0')
+    return false;
+  *time = int64_t(timegm(&tm)) * 1000000000;
+  return true;
+}
+
+static std::string formatTime(int64_t seconds) {
+  time_t t = seconds;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char text[32];
+  strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+  return text;
+}
+
+// Reads T/U/W posts from in, appending them to posts; false on a malformed line
+static bool readPosts(std::istream& in, const std::string& name, std::vector<Message>* posts) {
+  std::string line;
+  int64_t time = 0;
+  std::string user;
+  bool have_time = false;
+  for (int line_no = 1; std::getline(in, line); line_no++) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty())
+      continue;
+
+    std::string value = line.size() > 2 ? line.substr(2) : "";
+    if (line.size() < 2 || line[1] != ' ' ||
+        (line[0] == 'T' && !parseTime(value, &time))) {
+      std::cerr << name << ":" << line_no << ": cannot parse \"" << line << "\"" << std::endl;
+      return false;
+    }
+    switch (line[0]) {
+      case 'T':
+        have_time = true;
+        break;
+      case 'U':
+        // the username is the last part of the profile URL
+        user = value.substr(value.rfind('/') + 1);
+        break;
+      case 'W':
+      {
+        if (!have_time || user.empty()) {
+          std::cerr << name << ":" << line_no << ": post without a T or U line" << std::endl;
+          return false;
+        }
+        Message m;
+        m.set_username(user);
+        m.set_msg(value);
+        m.mutable_timestamp()->set_seconds(time / 1000000000);
+        posts->push_back(std::move(m));
+        have_time = false;
+        user.clear();
+        break;
+      }
+      default:
+        std::cerr << name << ":" << line_no << ": unknown line type '" << line[0] << "'" << std::endl;
+        return false;
+    }
+  }
+  return true;
+}
+
+static int importPosts(PostArchive& archive, WriteAheadLog& wal, const std::vector<std::string>& files) {
+  std::vector<Message> posts;
+  if (files.empty() && !readPosts(std::cin, "stdin", &posts))
+    return 1;
+  for (const std::string& file : files) {
+    std::ifstream in(file);
+    if (!in) {
+      std::cerr << file << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+    if (!readPosts(in, file, &posts))
+      return 1;
+  }
+
+  // the archive is kept in time order
+  std::stable_sort(posts.begin(), posts.end(), [](const Message& a, const Message& b) {
+    return PostArchive::timeOf(a) < PostArchive::timeOf(b);
+  });
+
+  // posts older than the archive's newest can't be added in order: if
+  // appended, they would be filed at the newest time, out of reach of a
+  // time range that covers their own
+  int64_t last_time = archive.lastTime();
+  size_t older = 0;
+  while (older < posts.size() && PostArchive::timeOf(posts[older]) < last_time)
+    older++;
+  if (older > 0) {
+    std::cerr << older << " of " << posts.size() << " posts are older than the newest post in the archive ("
+              << formatTime(last_time / 1000000000) << "); nothing imported" << std::endl;
+    return 1;
+  }
+
+  size_t new_users = 0;
+  uint64_t last_seq = 0;
+  for (const Message& m : posts) {
+    bool created;
+    Client* c = user_registry.findOrCreate(m.username(), &created, [&](Client* c) {
+      LogRecord record;
+      record.set_type(LogRecord::LOGIN);
+      record.set_username(c->username);
+      record.set_user_id(c->id);
+      last_seq = wal.append(record);
+    });
+    new_users += created;
+    if (!archive.append(c->id, m)) {
+      std::cerr << "Cannot append to the archive: " << strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+  if (!archive.sync() || !wal.sync(last_seq)) {
+    std::cerr << "Cannot sync: " << strerror(errno) << std::endl;
+    return 1;
+  }
+  std::cerr << "Imported " << posts.size() << " posts, " << new_users << " new users" << std::endl;
+  return 0;
+}
+
+static void printPost(const PostArchive::Entry& entry) {
+  Message m;
+  if (!m.ParseFromArray(entry.data, entry.length))
+    return;
+  std::cout << "T " << formatTime(m.timestamp().seconds()) << "\n"
+            << "U " << kUserPrefix << m.username() << "\n"
+            << "W " << m.msg() << "\n\n";
+}
+
+static int exportPosts(const PostArchive& archive, const std::string& username, int64_t since, int64_t until) {
+  if (username.empty()) {
+    archive.scanRange(since, until, [](const PostArchive::Entry& entry) {
+      printPost(entry);
+      return true;
+    });
+    return 0;
+  }
+
+  Client* c = user_registry.find(username);
+  if (c == nullptr) {
+    std::cerr << "No such user: " << username << std::endl;
+    return 1;
+  }
+  // a user's posts come newest first
+  std::vector<PostArchive::Entry> entries;
+  archive.scanUser(c->id, since, [&](const PostArchive::Entry& entry) {
+    if (entry.time < until)
+      entries.push_back(entry);
+    return true;
+  });
+  for (auto it = entries.rbegin(); it != entries.rend(); ++it)
+    printPost(*it);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  std::string data_dir = "data-3010";
+  std::string username;
+  int64_t since = INT64_MIN;
+  int64_t until = INT64_MAX;
+
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "d:u:s:e:")) != -1){
+    switch(opt) {
+      case 'd':
+        data_dir = optarg;break;
+      case 'u':
+        username = optarg;break;
+      case 's':
+      case 'e':
+        if (!parseTime(optarg, opt == 's' ? &since : &until)) {
+          std::cerr << "Invalid time (YYYY-MM-DD HH:MM:SS): " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      default:
+        std::cerr << "Invalid Command Line Argument\n";
+    }
+  }
+  std::string command = optind < argc ? argv[optind++] : "";
+  if (command != "import" && command != "export") {
+    std::cerr << "usage: tsarchive [-d data_dir] import [file ...]\n"
+              << "       tsarchive [-d data_dir] export [-u username] [-s since] [-e until]\n"
+              << "import refuses posts older than the newest one in the archive\n";
+    return 1;
+  }
+
+  // the users tsd knows about, and their ids
+  mkdir(data_dir.c_str(), 0755);
+  std::string error;
+  SnapshotStore snapshot_store(data_dir, user_registry, social_graph);
+  WriteAheadLog wal;
+  PostArchive archive;
+  if (!snapshot_store.load(&error) ||
+      !wal.open(data_dir, applyLogin, &error, snapshot_store.seq()) ||
+      !archive.open(data_dir + "/archive", &error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+
+  if (command == "import")
+    return importPosts(archive, wal, std::vector<std::string>(argv + optind, argv + argc));
+  return exportPosts(archive, username, since, until);
+}
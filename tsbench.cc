@@ -0,0 +1,476 @@
+/*
+ * Load generator for tsd. Logs in a population of virtual users, has them
+ * follow each other, opens a Timeline stream for every one of them and
+ * then posts at a fixed overall rate, optionally with login churn. Reports
+ * throughput and the end-to-end delivery latency (post timestamp to the
+ * moment a follower receives it), so server changes can be checked for
+ * regressions and deployments sized.
+ *
+ *   ./tsbench [-h host] [-p port] [-u users] [-f follows_per_user]
+ *             [-g uniform|power] [-s zipf_exponent] [-r posts_per_sec]
+ *             [-c logins_per_sec] [-d seconds] [-t threads] [-n channels] [-b]
+ *
+ * With -g power, whom to follow is drawn from a Zipf distribution, so a
+ * handful of users end up with most of the followers (celebrities).
+ * With -b the streams take posts in batches, as tsc does.
+ * Latencies assume tsbench and tsd read the same clock, i.e. run on one
+ * machine or on machines with synchronized clocks.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::Status;
+using csce662::Message;
+using csce662::Reply;
+using csce662::Request;
+using csce662::SNSService;
+
+namespace {
+
+// posts carry this prefix, so the stream-opening message isn't measured
+const std::string kPostPrefix = "tsbench post ";
+
+// -b: streams ask the server to batch posts to them
+bool accept_batches = false;
+
+// posts a stream may have waiting to be written before it drops new ones
+const size_t kMaxQueuedPosts = 1024;
+
+int64_t nowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Delivery latencies observed by one virtual user, in nanoseconds
+struct LatencyLog {
+  std::mutex mu;
+  std::vector<int64_t> samples;
+};
+
+/*
+ * One virtual user's Timeline stream, on the callback API so thousands of
+ * them don't need thousands of threads. Posts are queued and written one
+ * at a time, as the API requires.
+ */
+class TimelineStream final : public grpc::ClientBidiReactor<Message, Message> {
+public:
+  TimelineStream(SNSService::Stub* stub, const std::string& username, LatencyLog* latencies)
+    : username_(username), latencies_(latencies), opened_ns_(nowNanos()) {
+    stub->async()->Timeline(&context_, this);
+    StartRead(&incoming_);
+    queue("Connected", true);
+    StartCall();
+  }
+
+  // false if the post had to be dropped
+  bool post(uint64_t n) { return queue(kPostPrefix + std::to_string(n)); }
+
+  void stop() { context_.TryCancel(); }
+
+  // waits for the stream to be torn down; it may be deleted afterwards
+  void wait() {
+    std::unique_lock<std::mutex> lock(mu_);
+    done_cv_.wait(lock, [this] { return done_; });
+  }
+
+  // posts (not the opening message) the transport took
+  uint64_t written() const { return written_.load(std::memory_order_relaxed); }
+
+  void OnWriteDone(bool ok) override {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (ok && outgoing_.front().msg().compare(0, kPostPrefix.size(), kPostPrefix) == 0)
+      written_.fetch_add(1, std::memory_order_relaxed);
+    outgoing_.pop_front();
+    if (ok && !outgoing_.empty())
+      StartWrite(&outgoing_.front());
+    else
+      writing_ = false;
+  }
+
+  void OnReadDone(bool ok) override {
+    if (!ok)
+      return;
+    if (incoming_.batch_size() > 0)
+      for (const Message& post : incoming_.batch())
+        record(post);
+    else
+      record(incoming_);
+    StartRead(&incoming_);
+  }
+
+  void OnDone(const Status& status) override {
+    std::lock_guard<std::mutex> lock(mu_);
+    done_ = true;
+    done_cv_.notify_all();
+  }
+
+private:
+  void record(const Message& post) {
+    const google::protobuf::Timestamp& ts = post.timestamp();
+    int64_t sent_ns = ts.seconds() * 1000000000LL + ts.nanos();
+    // history replayed on attach predates the stream and isn't a delivery
+    if (sent_ns >= opened_ns_ && post.msg().compare(0, kPostPrefix.size(), kPostPrefix) == 0)
+    {
+      int64_t latency = nowNanos() - sent_ns;
+      std::lock_guard<std::mutex> lock(latencies_->mu);
+      latencies_->samples.push_back(latency);
+    }
+  }
+
+  bool queue(const std::string& text, bool hello = false) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (done_ || outgoing_.size() >= kMaxQueuedPosts)
+      return false;
+
+    // deque keeps the message being written in place while others are added
+    outgoing_.emplace_back();
+    Message& m = outgoing_.back();
+    m.set_username(username_);
+    m.set_msg(text);
+    m.set_batching(hello && accept_batches);
+    int64_t ns = nowNanos();
+    m.mutable_timestamp()->set_seconds(ns / 1000000000LL);
+    m.mutable_timestamp()->set_nanos(ns % 1000000000LL);
+
+    if (!writing_)
+    {
+      writing_ = true;
+      StartWrite(&outgoing_.front());
+    }
+    return true;
+  }
+
+  const std::string username_;
+  LatencyLog* latencies_;
+  const int64_t opened_ns_;
+
+  ClientContext context_;
+  Message incoming_;
+
+  std::mutex mu_;
+  std::condition_variable done_cv_;
+  std::deque<Message> outgoing_;
+  bool writing_ = false;
+  bool done_ = false;
+  std::atomic<uint64_t> written_{0};
+};
+
+struct VirtualUser {
+  std::string username;
+  SNSService::Stub* stub = nullptr;
+  size_t followers = 0;   // accepted follows of this user
+
+  std::mutex mu;          // guards stream
+  std::unique_ptr<TimelineStream> stream;
+  uint64_t written = 0;   // posts written by streams already closed
+  LatencyLog latencies;
+};
+
+bool login(VirtualUser* user) {
+  Request request;
+  Reply reply;
+  ClientContext context;
+  request.set_username(user->username);
+  return user->stub->Login(&context, request, &reply).ok();
+}
+
+bool follow(VirtualUser* follower, VirtualUser* followee) {
+  Request request;
+  Reply reply;
+  ClientContext context;
+  request.set_username(follower->username);
+  request.add_arguments(followee->username);
+  Status status = follower->stub->Follow(&context, request, &reply);
+  return status.ok() && reply.msg() == "Follow Successful";
+}
+
+void openStream(VirtualUser* user) {
+  std::lock_guard<std::mutex> lock(user->mu);
+  user->stream.reset(new TimelineStream(user->stub, user->username, &user->latencies));
+}
+
+void closeStream(VirtualUser* user) {
+  std::unique_ptr<TimelineStream> stream;
+  {
+    std::lock_guard<std::mutex> lock(user->mu);
+    stream.swap(user->stream);
+  }
+  if (stream == nullptr)
+    return;
+  stream->stop();
+  stream->wait();
+  std::lock_guard<std::mutex> lock(user->mu);
+  user->written += stream->written();
+}
+
+// Runs f(i) for every i in [0, n) on the given number of threads
+template <typename F>
+void parallelFor(size_t n, int threads, F&& f) {
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads; t++)
+    pool.emplace_back([&] {
+      for (size_t i; (i = next.fetch_add(1)) < n; )
+        f(i);
+    });
+  for (std::thread& th : pool)
+    th.join();
+}
+
+// Calls tick() rate times per second, until stop is set
+template <typename F>
+void paced(double rate, const std::atomic<bool>& stop, F&& tick) {
+  if (rate <= 0)
+    return;
+  auto interval = std::chrono::nanoseconds((int64_t)(1e9 / rate));
+  auto next = std::chrono::steady_clock::now();
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    tick();
+    next += interval;
+    std::this_thread::sleep_until(next);
+  }
+}
+
+double percentile(const std::vector<int64_t>& sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+  return sorted[i] / 1e6;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string hostname = "localhost";
+  std::string port = "3010";
+  size_t users = 1000;
+  size_t follows = 20;
+  std::string graph = "uniform";
+  double zipf = 1.0;
+  double post_rate = 1000;
+  double churn_rate = 0;
+  int duration = 10;
+  int threads = 4;
+  int channels = 4;
+
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "h:p:u:f:g:s:r:c:d:t:n:b")) != -1){
+    switch(opt) {
+      case 'h':
+        hostname = optarg;break;
+      case 'p':
+        port = optarg;break;
+      case 'u':
+        users = std::strtoul(optarg, nullptr, 10);break;
+      case 'f':
+        follows = std::strtoul(optarg, nullptr, 10);break;
+      case 'g':
+        graph = optarg;break;
+      case 's':
+        zipf = std::atof(optarg);break;
+      case 'r':
+        post_rate = std::atof(optarg);break;
+      case 'c':
+        churn_rate = std::atof(optarg);break;
+      case 'd':
+        duration = std::atoi(optarg);break;
+      case 't':
+        threads = std::max(1, std::atoi(optarg));break;
+      case 'n':
+        channels = std::max(1, std::atoi(optarg));break;
+      case 'b':
+        accept_batches = true;break;
+      default:
+        std::cerr << "Invalid Command Line Argument\n";
+    }
+  }
+  if (graph != "uniform" && graph != "power")
+  {
+    std::cerr << "Unknown graph shape " << graph << ", expected uniform or power\n";
+    return 1;
+  }
+  if (users < 2)
+  {
+    std::cerr << "Need at least 2 users\n";
+    return 1;
+  }
+  follows = std::min(follows, users - 1);
+
+  // streams are spread over a few connections rather than all on one
+  std::vector<std::unique_ptr<SNSService::Stub>> stubs;
+  for (int i = 0; i < channels; i++)
+  {
+    grpc::ChannelArguments args;
+    args.SetInt("grpc.channel_id", i);   // keeps the channels from being shared
+    stubs.push_back(SNSService::NewStub(
+        grpc::CreateCustomChannel(hostname + ":" + port, grpc::InsecureChannelCredentials(), args)));
+  }
+
+  // names are unique per run, so repeated runs against one server don't collide
+  std::string prefix = "bench" + std::to_string(getpid()) + "_" + std::to_string(time(NULL) % 100000) + "_";
+  std::vector<VirtualUser> population(users);
+  for (size_t i = 0; i < users; i++)
+  {
+    population[i].username = prefix + std::to_string(i);
+    population[i].stub = stubs[i % channels].get();
+  }
+
+  std::cout << "Logging in " << users << " users" << std::endl;
+  std::atomic<size_t> failures{0};
+  parallelFor(users, threads * 4, [&](size_t i) {
+    if (!login(&population[i]))
+      failures++;
+  });
+  if (failures > 0)
+  {
+    std::cerr << failures << " logins failed; is tsd running on " << hostname << ":" << port << "?\n";
+    return 1;
+  }
+
+  std::cout << "Building a " << graph << " graph, " << follows << " follows per user" << std::endl;
+  std::vector<std::vector<size_t>> followees(users);
+  {
+    std::mt19937_64 rng(42);
+    std::vector<double> weights(users);
+    for (size_t k = 0; k < users; k++)
+      weights[k] = graph == "power" ? 1.0 / std::pow(k + 1, zipf) : 1.0;
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+
+    for (size_t i = 0; i < users; i++)
+    {
+      std::unordered_set<size_t> chosen;
+      // a steep Zipf keeps hitting the same few users, so don't insist forever
+      for (size_t tries = 0; chosen.size() < follows && tries < follows * 50; tries++)
+      {
+        size_t j = pick(rng);
+        if (j != i)
+          chosen.insert(j);
+      }
+      followees[i].assign(chosen.begin(), chosen.end());
+    }
+  }
+  std::vector<std::atomic<size_t>> follower_counts(users);
+  parallelFor(users, threads * 4, [&](size_t i) {
+    for (size_t j : followees[i])
+      if (follow(&population[i], &population[j]))
+        follower_counts[j]++;
+  });
+  size_t edges = 0, celebrity = 0;
+  for (size_t i = 0; i < users; i++)
+  {
+    population[i].followers = follower_counts[i];
+    edges += population[i].followers;
+    celebrity = std::max(celebrity, population[i].followers);
+  }
+  std::cout << edges << " follows, most followed user has " << celebrity << " followers" << std::endl;
+
+  std::cout << "Opening " << users << " Timeline streams" << std::endl;
+  for (VirtualUser& user : population)
+    openStream(&user);
+  // give the server time to attach every stream before anything is posted
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  for (VirtualUser& user : population)
+  {
+    std::lock_guard<std::mutex> lock(user.latencies.mu);
+    user.latencies.samples.clear();
+  }
+
+  std::cout << "Posting " << post_rate << "/s for " << duration << "s";
+  if (churn_rate > 0)
+    std::cout << " with " << churn_rate << " logins/s";
+  std::cout << std::endl;
+
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> posted{0}, queued{0}, dropped{0}, expected{0}, reconnects{0};
+  std::vector<std::thread> drivers;
+  for (int t = 0; t < threads; t++)
+    drivers.emplace_back([&, t] {
+      std::mt19937_64 rng(t + 1);
+      std::uniform_int_distribution<size_t> pick(0, users - 1);
+      paced(post_rate / threads, stop, [&] {
+        VirtualUser& user = population[pick(rng)];
+        std::lock_guard<std::mutex> lock(user.mu);
+        if (user.stream != nullptr && user.stream->post(posted++))
+        {
+          queued++;
+          expected += user.followers;
+        }
+        else
+        {
+          dropped++;
+        }
+      });
+    });
+  // churn: a user drops its stream, logs in again and reopens it
+  std::thread churner([&] {
+    std::mt19937_64 rng(0);
+    std::uniform_int_distribution<size_t> pick(0, users - 1);
+    paced(churn_rate, stop, [&] {
+      VirtualUser& user = population[pick(rng)];
+      closeStream(&user);
+      login(&user);
+      openStream(&user);
+      reconnects++;
+    });
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::seconds(duration));
+  stop = true;
+  for (std::thread& th : drivers)
+    th.join();
+  churner.join();
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // let whatever is still queued on the server arrive
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+  uint64_t written = 0;
+  for (VirtualUser& user : population)
+  {
+    closeStream(&user);
+    written += user.written;
+  }
+
+  std::vector<int64_t> latencies;
+  for (VirtualUser& user : population)
+    latencies.insert(latencies.end(), user.latencies.samples.begin(), user.latencies.samples.end());
+  std::sort(latencies.begin(), latencies.end());
+
+  std::cout << std::fixed << std::setprecision(1)
+            << "posts:      " << written << " written, " << dropped << " dropped by tsbench, "
+            << written / secs << "/s" << std::endl
+            << "deliveries: " << latencies.size() << " of " << expected << " expected, "
+            << latencies.size() / secs << "/s" << std::endl;
+  if (reconnects > 0)
+    std::cout << "reconnects: " << reconnects << std::endl;
+  std::cout << std::setprecision(3)
+            << "latency ms: p50 " << percentile(latencies, 0.50)
+            << "  p99 " << percentile(latencies, 0.99)
+            << "  p999 " << percentile(latencies, 0.999)
+            << "  max " << (latencies.empty() ? 0 : latencies.back() / 1e6) << std::endl;
+  if (queued > written)
+    std::cout << "(" << queued - written << " posts were queued but never written)" << std::endl;
+  return 0;
+}
@@ -1,11 +1,17 @@
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
 #include <thread>
 #include <vector>
 #include <string>
 #include <unistd.h>
 #include <csignal>
 #include <grpc++/grpc++.h>
+#include <google/protobuf/arena.h>
 #include "client.h"
 
 #include "sns.grpc.pb.h"
@@ -16,34 +22,50 @@ using grpc::ClientReaderWriter;
 using grpc::ClientWriter;
 using grpc::Status;
 using csce662::Message;
+using csce662::Position;
+using csce662::Resume;
 using csce662::ListReply;
+using csce662::ListRequest;
+using csce662::ListPage;
 using csce662::Request;
 using csce662::Reply;
+using csce662::SearchReply;
+using csce662::SearchRequest;
 using csce662::SNSService;
+using csce662::SuggestReply;
+using csce662::SuggestRequest;
 
 void sig_ignore(int sig) {
   std::cout << "Signal caught " + sig;
 }
 
-Message MakeMessage(const std::string& username, const std::string& msg) {
-    Message m;
-    m.set_username(username);
-    m.set_msg(msg);
-    google::protobuf::Timestamp* timestamp = new google::protobuf::Timestamp();
+// Builds the message on the given arena: the Message, its Timestamp and its
+// strings all come out of the arena's blocks instead of separate mallocs
+Message* MakeMessage(google::protobuf::Arena* arena, const std::string& username, const std::string& msg) {
+    Message* m = google::protobuf::Arena::CreateMessage<Message>(arena);
+    m->set_username(username);
+    m->set_msg(msg);
+    google::protobuf::Timestamp* timestamp = m->mutable_timestamp();
     timestamp->set_seconds(time(NULL));
     timestamp->set_nanos(0);
-    m.set_allocated_timestamp(timestamp);
     return m;
 }
 
+// Messages written on a stream's arena before it is reset
+const int kArenaResetInterval = 256;
+
 
 class Client : public IClient
 {
 public:
   Client(const std::string& hname,
 	 const std::string& uname,
-	 const std::string& p)
-    :hostname(hname), username(uname), port(p) {}
+	 const std::string& p,
+	 const std::vector<std::string>& others)
+    :hostname(hname), username(uname), port(p) {
+    servers_.push_back(hname + ":" + p);
+    servers_.insert(servers_.end(), others.begin(), others.end());
+  }
 
   
 protected:
@@ -59,30 +81,109 @@ private:
   // You can have an instance of the client stub
   // as a member variable.
   std::unique_ptr<SNSService::Stub> stub_;
+
+  // the server given with -h/-p, then the ones given with -r
+  std::vector<std::string> servers_;
+  size_t server_ = 0;
+  // where the last reply told us to go instead
+  std::string redirect_;
+  // what the last Login handed out, sent on every call instead of our
+  // username; 0 if it gave us nothing
+  uint32_t user_id_ = 0;
+  uint64_t session_ = 0;
+
+  bool login(std::string address, bool resuming);
+  bool failover(bool forever);
+  bool reconnect(const grpc::Status& status);
+  IReply runCommand(const std::string& input);
   
-  IReply Login();
+  IReply Login(std::string* redirect);
   IReply List();
+  IReply ListAll();
+  grpc::Status ListPages(ListRequest::Scope scope, const std::string& title);
   IReply Follow(const std::string &username);
   IReply UnFollow(const std::string &username);
+  IReply Search(const std::string &query);
+  IReply Suggest();
   void   Timeline(const std::string &username);
 };
 
 int Client::connectTo() {
-    std::string connection_info = hostname + ":" + port;
-    stub_ = SNSService::NewStub(
-        grpc::CreateChannel(connection_info, grpc::InsecureChannelCredentials()));
+    // the first server that is up
+    for (server_ = 0; server_ < servers_.size(); server_++) {
+      if (login(servers_[server_], false))
+        return 1;
+    }
+    server_ = 0;
+    // std::cout << "connection failed: " << ire.grpc_status.error_message() << std::endl;
+    return -1;
+}
 
-    IReply ire = Login();
+// Connects to address and logs in, going on to wherever the server sends
+// us (in a cluster, the server that owns us; from a replica, its primary).
+// Logging in again after losing a server isn't refused as a duplicate
+bool Client::login(std::string address, bool resuming) {
+  for (int hops = 0; hops < 3; hops++) {
+    size_t colon = address.rfind(':');
+    hostname = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    stub_ = SNSService::NewStub(
+        grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+
+    std::string redirect;
+    IReply ire = Login(&redirect);
+    if (redirect.empty())
+      return ire.grpc_status.ok() &&
+             (ire.comm_status == SUCCESS || (resuming && ire.comm_status == FAILURE_ALREADY_EXISTS));
+    address = redirect;
+  }
+  return false;
+}
 
-    if (ire.grpc_status.ok() && ire.comm_status == SUCCESS) {
-        return 1;
-    } else {
-        // std::cout << "connection failed: " << ire.grpc_status.error_message() << std::endl;
-        return -1;
+// After losing the server: the same one again (it may only have blipped),
+// then the others in turn. The pause between tries doubles up to 30s and is
+// randomized, so clients dropped together don't all come back together.
+// Gives up after a few rounds unless forever is set
+bool Client::failover(bool forever) {
+  std::mt19937 rng(std::random_device{}());
+  double delay = 0.25;
+  for (size_t attempt = 0; forever || attempt < 3 * servers_.size(); attempt++) {
+    size_t server = (server_ + attempt) % servers_.size();
+    if (login(servers_[server], true)) {
+      server_ = server;
+      std::cout << "Reconnected to " << hostname << ":" << port << std::endl;
+      return true;
     }
+    std::uniform_real_distribution<double> pause(delay / 2, delay);
+    std::this_thread::sleep_for(std::chrono::duration<double>(pause(rng)));
+    delay = std::min(delay * 2, 30.0);
+  }
+  return false;
+}
+
+// Whether a failed command is worth another try, on another server (or
+// on the same one, once logged in again)
+bool Client::reconnect(const grpc::Status& status) {
+  if (!redirect_.empty()) {
+    std::string address = redirect_;
+    redirect_.clear();
+    return login(address, true);
+  }
+  if (status.error_code() == grpc::StatusCode::UNAUTHENTICATED)
+    return login(hostname + ":" + port, true);
+  return status.error_code() == grpc::StatusCode::UNAVAILABLE && failover(false);
 }
 
 IReply Client::processCommand(std::string& input)
+{
+  IReply ire = runCommand(input);
+  // our server went away, or is a replica sending a write to its primary
+  if (ire.comm_status != SUCCESS && reconnect(ire.grpc_status))
+    ire = runCommand(input);
+  return ire;
+}
+
+IReply Client::runCommand(const std::string& input)
 {
     IReply ire;
 
@@ -116,6 +217,15 @@ IReply Client::processCommand(std::string& input)
     if (arg!= "")
       ire = UnFollow(arg);
   }
+  else if (command == "SEARCH")
+  {
+    if (arg != "")
+      ire = Search(arg);
+  }
+  else if (command == "SUGGEST")
+  {
+    ire = Suggest();
+  }
   else if (command == "TIMELINE")
   {
     processTimeline();
@@ -136,9 +246,56 @@ void Client::processTimeline()
 // List Command
 IReply Client::List() {
   IReply ire;
+
+  // stream both lists a page at a time, printing each page as it arrives,
+  // so a huge user base never turns into one giant reply
+  grpc::Status status = ListPages(ListRequest::ALL_USERS, "All users");
+  if (status.error_code() == grpc::StatusCode::UNIMPLEMENTED)
+    return ListAll();   // the server predates ListUsers
+  if (status.ok())
+    status = ListPages(ListRequest::FOLLOWERS, "Followers");
+
+  ire.grpc_status = status;
+  ire.comm_status = status.ok() ? SUCCESS : FAILURE_UNKNOWN;
+  ire.list_streamed = true;
+  return ire;
+}
+
+grpc::Status Client::ListPages(ListRequest::Scope scope, const std::string& title) {
+  ListRequest request;
+  request.set_username(this->username);
+  request.set_user_id(user_id_);
+  request.set_session(session_);
+  request.set_scope(scope);
+
+  ClientContext context;
+  std::unique_ptr<grpc::ClientReader<ListPage>> reader(stub_->ListUsers(&context, request));
+
+  ListPage page;
+  bool first_page = true;
+  while (reader->Read(&page))
+  {
+    std::vector<std::string> users(page.users().begin(), page.users().end());
+    displayListPage(title, users, first_page);
+    first_page = false;
+  }
+
+  grpc::Status status = reader->Finish();
+  if (first_page && status.ok())
+    displayListPage(title, std::vector<std::string>(), true);
+  if (!first_page || status.ok())
+    displayListEnd();
+  return status;
+}
+
+// List Command, in one reply, for servers without ListUsers
+IReply Client::ListAll() {
+  IReply ire;
   Request request;
 
   request.set_username(this->username);
+  request.set_user_id(user_id_);
+  request.set_session(session_);
 
   ListReply list_reply;
   ClientContext context;
@@ -176,6 +333,8 @@ IReply Client::Follow(const std::string& username2) {
 
   // use set_username and add_arguments, which are already by grpc compiler
   request.set_username(this->username);
+  request.set_user_id(user_id_);
+  request.set_session(session_);
   request.add_arguments(username2);
 
   // ask the server for a follow function
@@ -192,7 +351,10 @@ IReply Client::Follow(const std::string& username2) {
     else if (reply.msg() == "Invalid username")
       ire.comm_status = FAILURE_INVALID_USERNAME;
     else
+    {
+      redirect_ = reply.redirect();
       ire.comm_status = FAILURE_UNKNOWN;
+    }
   }
 
   return ire;
@@ -206,6 +368,8 @@ IReply Client::UnFollow(const std::string& username2) {
   Reply reply;
 
   request.set_username(this->username);
+  request.set_user_id(user_id_);
+  request.set_session(session_);
   request.add_arguments(username2);
 
   // ask the server stub for unfollow command
@@ -222,13 +386,76 @@ IReply Client::UnFollow(const std::string& username2) {
     else if (reply.msg() == "Invalid username")
       ire.comm_status = FAILURE_INVALID_USERNAME; 
     else
+    {
+      redirect_ = reply.redirect();
       ire.comm_status = FAILURE_UNKNOWN;
+    }
+  }
+
+  return ire;
+}
+
+// Search Command: the newest posts with all the words, by users we follow
+IReply Client::Search(const std::string& query) {
+  IReply ire;
+  SearchRequest request;
+  SearchReply reply;
+  ClientContext context;
+
+  request.set_username(this->username);
+  request.set_user_id(user_id_);
+  request.set_session(session_);
+  request.set_query(query);
+  request.set_following(true);
+
+  grpc::Status status = stub_->Search(&context, request, &reply);
+  ire.grpc_status = status;
+  if (status.ok())
+  {
+    // oldest first, like a timeline
+    for (auto post = reply.posts().rbegin(); post != reply.posts().rend(); ++post)
+    {
+      std::time_t time = static_cast<std::time_t>(post->timestamp().seconds());
+      displayPostMessage(post->username(), post->msg(), time);
+    }
+    if (reply.posts_size() == 0)
+      std::cout << "No posts found" << std::endl;
+    ire.comm_status = SUCCESS;
   }
+  else
+    ire.comm_status = FAILURE_UNKNOWN;
 
   return ire;
 }
 
-IReply Client::Login() {
+// Suggest Command: accounts followed by the accounts we follow
+IReply Client::Suggest() {
+  IReply ire;
+  SuggestRequest request;
+  SuggestReply reply;
+  ClientContext context;
+
+  request.set_username(this->username);
+  request.set_user_id(user_id_);
+  request.set_session(session_);
+
+  grpc::Status status = stub_->SuggestFollows(&context, request, &reply);
+  ire.grpc_status = status;
+  if (status.ok())
+  {
+    for (const auto& suggestion : reply.suggestions())
+      std::cout << suggestion.username() << " (followed by " << suggestion.mutual() << " you follow)" << std::endl;
+    if (reply.suggestions_size() == 0)
+      std::cout << "No suggestions" << std::endl;
+    ire.comm_status = SUCCESS;
+  }
+  else
+    ire.comm_status = FAILURE_UNKNOWN;
+
+  return ire;
+}
+
+IReply Client::Login(std::string* redirect) {
   IReply ire;
   Request request;
   Reply reply;
@@ -240,11 +467,18 @@ IReply Client::Login() {
   grpc::Status status = stub_->Login(&context, request, &reply);
 
   ire.grpc_status = status;
+  user_id_ = reply.user_id();
+  session_ = reply.session();
 
   if (status.ok())
   {
     if (reply.msg() == "you have already joined")
       ire.comm_status = FAILURE_ALREADY_EXISTS;
+    else if (reply.msg() == "REDIRECT")
+    {
+      *redirect = reply.redirect();
+      ire.comm_status = FAILURE_UNKNOWN;
+    }
     else
       ire.comm_status = SUCCESS;
   }
@@ -255,34 +489,117 @@ IReply Client::Login() {
 
 // Timeline Command
 void Client::Timeline(const std::string& username) {
-  ClientContext context;
-  std::shared_ptr<grpc::ClientReaderWriter<Message, Message>> stream(
-    stub_->Timeline(&context));
+  // the stream in use, replaced when its server goes away; Writes and
+  // replacing it are done under mu
+  std::mutex mu;
+  std::unique_ptr<ClientContext> context;
+  std::unique_ptr<grpc::ClientReaderWriter<Message, Message>> stream;
+  // posts typed while there is no stream, sent as soon as there is one
+  std::vector<std::string> outbox;
+  // the newest post (by seq) seen from each author: a new stream resumes
+  // after these, and anything sent twice is only shown once
+  std::map<std::string, uint64_t> seen;
+  google::protobuf::Timestamp since;
+  since.set_seconds(time(NULL));
+
+  auto open = [&](bool resume) {
+    google::protobuf::Arena arena;
+    Message* hello = MakeMessage(&arena, this->username, "Connected");
+    hello->set_user_id(user_id_);
+    hello->set_session(session_);
+    hello->set_batching(true);
+    if (resume) {
+      Resume* r = hello->mutable_resume();
+      *r->mutable_since() = since;
+      for (const auto& author : seen) {
+        Position* position = r->add_seen();
+        position->set_username(author.first);
+        position->set_seq(author.second);
+      }
+    }
+    std::lock_guard<std::mutex> lock(mu);
+    context.reset(new ClientContext);
+    stream = stub_->Timeline(context.get());
+    stream->Write(*hello);
+    // whatever piled up goes out in one envelope
+    Message* envelope = google::protobuf::Arena::CreateMessage<Message>(&arena);
+    for (const std::string& text : outbox)
+      *envelope->add_batch() = *MakeMessage(&arena, this->username, text);
+    if (!outbox.empty())
+      stream->Write(*envelope);
+    outbox.clear();
+  };
+  open(false);
 
   //thread to read messages from the server
-  std::thread reader([stream, this]() {
+  std::thread reader([&]() {
     Message server_msg;
-    // get the message back from the server
-    // infinite loop to read back from derver
-    while (stream->Read(&server_msg)) 
+    while (true)
     {
-      std::time_t time = static_cast<std::time_t>(server_msg.timestamp().seconds());
-      displayPostMessage(server_msg.username(), server_msg.msg(), time);
+      grpc::ClientReaderWriter<Message, Message>* current;
+      {
+        std::lock_guard<std::mutex> lock(mu);
+        current = stream.get();
+      }
+      // get the message back from the server
+      // infinite loop to read back from derver
+      while (current->Read(&server_msg)) 
+      {
+        // a busy server sends several posts in one envelope
+        auto show = [&](const Message& post) {
+          if (post.seq() != 0) {
+            uint64_t& last = seen[post.username()];
+            if (post.seq() <= last)
+              return;
+            last = post.seq();
+          }
+          std::time_t time = static_cast<std::time_t>(post.timestamp().seconds());
+          displayPostMessage(post.username(), post.msg(), time);
+        };
+        if (server_msg.batch_size() > 0)
+          for (const Message& post : server_msg.batch())
+            show(post);
+        else
+          show(server_msg);
+      }
+
+      // the server went away (or dropped us): pick up where we were, on it
+      // or another one. A server that ended the stream itself says why,
+      // e.g. a replica that can't take posts
+      grpc::Status status;
+      {
+        std::lock_guard<std::mutex> lock(mu);
+        status = stream->Finish();
+        stream.reset();
+      }
+      if (status.error_code() == grpc::StatusCode::FAILED_PRECONDITION ||
+          status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED)
+        std::cout << "Post not accepted: " << status.error_message() << std::endl;
+      std::cout << "Lost the connection to " << hostname << ":" << port << ", reconnecting" << std::endl;
+      failover(true);
+      open(true);
     }
   });
 
   // we need a way to read and write to the server at the same time, so we need to employ some threads
   // thread to send messages to the server
-  std::thread writer([stream, this]() {
+  std::thread writer([&]() {
     // infinite loop to send the msgs
-    Message msg = MakeMessage(this->username, "Connected");
-    stream->Write(msg);
+    // Write() is done with a message once it returns, so everything can be
+    // built on one arena that is reset every so often
+    google::protobuf::Arena arena;
+    int written = 0;
     while (true) {
+      if (++written % kArenaResetInterval == 0)
+        arena.Reset();
       std::string message = getPostMessage();
       // use the message struct to define the username (which should be in the server db), 
       //and the message we want to senf
-      Message msg = MakeMessage(this->username, message);
-      stream->Write(msg);
+      Message* msg = MakeMessage(&arena, this->username, message);
+      std::lock_guard<std::mutex> lock(mu);
+      // kept for the next stream if this one is gone
+      if (stream == nullptr || !stream->Write(*msg))
+        outbox.push_back(message);
     }
   });
 
@@ -298,9 +615,12 @@ int main(int argc, char** argv) {
   std::string hostname = "localhost";
   std::string username = "default";
   std::string port = "3010";
+  std::vector<std::string> others;
+  std::string server;
+  bool promote = false;
     
   int opt = 0;
-  while ((opt = getopt(argc, argv, "h:u:p:")) != -1){
+  while ((opt = getopt(argc, argv, "h:u:p:r:P")) != -1){
     switch(opt) {
     case 'h':
       hostname = optarg;break;
@@ -308,6 +628,13 @@ int main(int argc, char** argv) {
       username = optarg;break;
     case 'p':
       port = optarg;break;
+    case 'r':
+      // host:port,... of servers to fail over to
+      for (std::istringstream list(optarg); std::getline(list, server, ',');)
+        others.push_back(server);
+      break;
+    case 'P':
+      promote = true;break;
     default:
       std::cout << "Invalid Command Line Argument\n";
     }
@@ -315,7 +642,18 @@ int main(int argc, char** argv) {
       
   // std::cout << "Logging Initialized. Client starting...";
   
-  Client myc(hostname, username, port);
+  // -P: have the replica at -h/-p take over from its primary
+  if (promote) {
+    std::unique_ptr<csce662::ReplicationService::Stub> stub = csce662::ReplicationService::NewStub(
+        grpc::CreateChannel(hostname + ":" + port, grpc::InsecureChannelCredentials()));
+    ClientContext context;
+    Reply reply;
+    Status status = stub->Promote(&context, Request(), &reply);
+    std::cout << (status.ok() ? reply.msg() : status.error_message()) << std::endl;
+    return status.ok() ? 0 : 1;
+  }
+
+  Client myc(hostname, username, port, others);
   
   myc.run();
   
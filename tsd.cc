@@ -31,23 +31,57 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <random>
 
 #include <google/protobuf/timestamp.pb.h>
 #include <google/protobuf/duration.pb.h>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
 
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <stdlib.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <google/protobuf/util/time_util.h>
 #include <grpc++/grpc++.h>
 #include<glog/logging.h>
-#define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity); 
 
 #include "sns.grpc.pb.h"
+#include "admission.h"
+#include "async_log.h"
+#include "cluster.h"
+#include "fanout.h"
+#include "follow_suggestions.h"
+#include "metrics.h"
+#include "post_archive.h"
+#include "post_history.h"
+#include "search_index.h"
+#include "snapshot.h"
+#include "user_registry.h"
+#include "wal.h"
+
+// logging hands the line to a background writer and never waits for the disk
+#define log(severity, msg) async_log.write(google::severity, __FILE__, __LINE__, msg)
+// per-message tracing, rate-limited by -T; msg is only built when it is logged
+#define trace(msg) do { if (async_log.traceAllowed()) async_log.write(google::INFO, __FILE__, __LINE__, std::string("trace: ") + msg); } while (0)
 
 
 using google::protobuf::Timestamp;
@@ -59,214 +93,2096 @@ using grpc::ServerReader;
 using grpc::ServerReaderWriter;
 using grpc::ServerWriter;
 using grpc::Status;
+using csce662::DeliverRequest;
+using csce662::EdgeBatch;
+using csce662::EdgeResults;
 using csce662::Message;
 using csce662::ListReply;
+using csce662::ListRequest;
+using csce662::ListPage;
+using csce662::LogBatch;
+using csce662::LogRecord;
+using csce662::PeerService;
+using csce662::ReplicateRequest;
+using csce662::ReplicationService;
 using csce662::Request;
 using csce662::Reply;
+using csce662::SearchReply;
+using csce662::SearchRequest;
+using csce662::SnapshotChunk;
 using csce662::SNSService;
+using csce662::SuggestReply;
+using csce662::SuggestRequest;
+
+
+//Log records on their way to the glog files
+AsyncLog async_log;
+
+//Registry that stores every client that has been created
+UserRegistry user_registry;
+
+//Follow edges between the clients in the registry
+SocialGraph social_graph;
+
+//Writer pool that delivers timeline posts to followers
+std::unique_ptr<FanoutEngine> fanout_engine;
+
+//Recent posts per user, for the history shown when entering TIMELINE
+std::unique_ptr<TimelineHistory> timeline_history;
+
+//Every change to the registry, the graph and the timelines, in order
+WriteAheadLog write_ahead_log;
+
+//Every post ever made, by time and by author
+PostArchive post_archive;
+
+//Words of the archived posts, for Search
+SearchIndex search_index(post_archive);
+
+//Friends-of-friends ranking over a copy of the follow graph, for SuggestFollows
+std::unique_ptr<FollowSuggester> follow_suggester;
+
+//The other tsd nodes, when users are spread over several (-c)
+Cluster cluster;
+
+//A replica (-P) follows the primary's log and takes no writes until promoted
+std::string primary_address;
+std::atomic<bool> read_only{false};
+std::atomic<int> replicas_connected{0};
+
+//Periodic images of the registry and graph, so restarts replay only the log tail
+std::unique_ptr<SnapshotStore> snapshot_store;
+
+//Rate limits on calls and posts, per user and overall (-L)
+AdmissionControl admission;
+
+//Counters and histograms served on the metrics endpoint (-M)
+MetricsRegistry metrics_registry;
+
+// Calls of one RPC method and the time spent handling them
+struct RpcMetrics {
+  Counter* calls;
+  Counter* rejected;
+  Histogram* latency;
+
+  explicit RpcMetrics(const std::string& method)
+    : calls(metrics_registry.counter("tsd_rpc_calls_total", "RPCs handled", "method=\"" + method + "\"")),
+      rejected(metrics_registry.counter("tsd_rpc_rejected_total", "Calls (and Timeline posts) refused by a rate limit (-L)",
+                                        "method=\"" + method + "\"")),
+      latency(metrics_registry.histogram("tsd_rpc_latency_seconds",
+                                         "Time spent handling an RPC (the whole stream for ListUsers, "
+                                         "each batch for FollowMany/UnFollowMany)",
+                                         1e-9, "method=\"" + method + "\"")) {}
+};
+
+RpcMetrics login_metrics("Login");
+RpcMetrics list_metrics("List");
+RpcMetrics list_users_metrics("ListUsers");
+RpcMetrics follow_metrics("Follow");
+RpcMetrics unfollow_metrics("UnFollow");
+RpcMetrics follow_many_metrics("FollowMany");
+RpcMetrics unfollow_many_metrics("UnFollowMany");
+RpcMetrics search_metrics("Search");
+RpcMetrics suggest_metrics("SuggestFollows");
+
+Counter* timeline_opened = metrics_registry.counter("tsd_timeline_streams_opened_total", "Timeline streams attached to a user");
+Counter* timeline_closed = metrics_registry.counter("tsd_timeline_streams_closed_total", "Timeline streams detached from their user");
+Counter* posts_total = metrics_registry.counter("tsd_posts_total", "Posts received on Timeline streams");
+Counter* deliveries_total = metrics_registry.counter("tsd_deliveries_queued_total", "Posts queued for a follower's open stream");
+Counter* posts_rejected = metrics_registry.counter("tsd_rpc_rejected_total", "Calls (and Timeline posts) refused by a rate limit (-L)",
+                                                   "method=\"Post\"");
+Counter* posts_pushed = metrics_registry.counter("tsd_posts_delivered_total",
+                                                 "Posts delivered, by how they reached the followers", "mode=\"push\"");
+Counter* posts_pulled = metrics_registry.counter("tsd_posts_delivered_total",
+                                                 "Posts delivered, by how they reached the followers", "mode=\"pull\"");
+Counter* sessions_evicted = metrics_registry.counter("tsd_sessions_evicted_total", "Logins ended for being idle (-I)");
+Histogram* post_fanout = metrics_registry.histogram("tsd_post_followers", "Followers of the author, per message fanned out");
+Histogram* post_latency = metrics_registry.histogram("tsd_post_handling_seconds",
+                                                     "Time to log a message and queue it for every follower", 1e-9);
+
+// Counts one call and times it until the end of the scope
+class RpcTimer {
+public:
+  explicit RpcTimer(const RpcMetrics& metrics) : timer_(metrics.latency) { metrics.calls->add(); }
+
+private:
+  ScopedTimer timer_;
+};
+
+
+/*
+ * Sink that hands fanned-out posts to a synchronous Timeline stream. A sync
+ * Write blocks until the peer's flow control lets the message through, so
+ * the stream's writes run on a thread of its own: a follower that stops
+ * reading only holds up that thread, never the fan-out writers.
+ */
+class TimelineStreamSink final : public MessageSink {
+public:
+  TimelineStreamSink(ServerContext* context, ServerReaderWriter<Message, Message>* stream)
+    : context_(context), stream_(stream), writer_(&TimelineStreamSink::writeLoop, this) {}
+
+  ~TimelineStreamSink() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    writer_.join();
+  }
+
+  void startWrite(std::vector<Post> posts, WriteDone done) override {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      posts_ = std::move(posts);
+      done_ = std::move(done);
+    }
+    cv_.notify_all();
+  }
+
+  void close() override { context_->TryCancel(); }
+
+private:
+  void writeLoop() {
+    while (true)
+    {
+      std::vector<Post> posts;
+      WriteDone done;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait(lock, [this] { return stopping_ || done_ != nullptr; });
+        if (done_ == nullptr)
+          return;
+        posts.swap(posts_);
+        done.swap(done_);
+      }
+      done(write(posts));
+    }
+  }
+
+  // the sync API serializes every Write itself, so here the shared wire
+  // bytes can't be used; the callback server below does use them
+  bool write(const std::vector<Post>& posts) {
+    if (posts.size() == 1)
+      return stream_->Write(posts[0]->message());
+    google::protobuf::Arena arena;
+    Message* envelope = google::protobuf::Arena::CreateMessage<Message>(&arena);
+    for (const Post& post : posts)
+      *envelope->add_batch() = post->message();
+    return stream_->Write(*envelope);
+  }
+
+  ServerContext* context_;
+  ServerReaderWriter<Message, Message>* stream_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::vector<Post> posts_;   // the write started, until writeLoop takes it
+  WriteDone done_;
+  bool stopping_ = false;
+  std::thread writer_;
+};
+
+
+LogRecord makeLogRecord(LogRecord::Type type, Client* c, Client* target = nullptr) {
+  LogRecord record;
+  record.set_type(type);
+  record.set_username(c->username);
+  record.set_user_id(c->id);
+  if (target != nullptr)
+    record.set_target(target->username);
+  return record;
+}
+
+// Rebuilds the in-memory state from the log at startup
+void applyLogRecord(const LogRecord& record) {
+  switch (record.type())
+  {
+    case LogRecord::LOGIN:
+    {
+      Client* c = user_registry.insert(record.username(), record.user_id());
+      if (c != nullptr)
+        c->connected = false;
+      break;
+    }
+    case LogRecord::FOLLOW:
+    case LogRecord::UNFOLLOW:
+    {
+      Client* c1 = user_registry.find(record.username());
+      Client* c2 = user_registry.find(record.target());
+      if (c1 == nullptr or c2 == nullptr)
+        break;
+      if (record.type() == LogRecord::FOLLOW)
+        social_graph.follow(c1, c2);
+      else
+        social_graph.unfollow(c1, c2);
+      break;
+    }
+    case LogRecord::POST:
+    {
+      Client* c = user_registry.find(record.username());
+      if (c == nullptr)
+        break;
+      timeline_history->replay(c, makePost(record.post()));
+      if (record.post().seq() > c->post_seq.load(std::memory_order_relaxed))
+        c->post_seq.store(record.post().seq(), std::memory_order_relaxed);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// Whether c is one of this node's users, not a stand-in for a remote one
+bool isLocal(const Client* c) {
+  return c->node == cluster.self();
+}
+
+// A remote user, created as a stand-in the first time an edge needs it
+Client* standIn(const std::string& username, uint64_t* seq) {
+  return user_registry.findOrCreate(username, nullptr, [seq](Client* c) {
+    c->node = cluster.ownerOf(c->username);
+    c->connected = false;
+    *seq = write_ahead_log.append(makeLogRecord(LogRecord::LOGIN, c));
+  });
+}
+
+// Points the client at the node that owns username; false if that's us
+bool redirected(const std::string& username, Reply* reply) {
+  uint32_t owner = cluster.ownerOf(username);
+  if (owner == cluster.self())
+    return false;
+  reply->set_msg("REDIRECT");
+  reply->set_redirect(cluster.address(owner));
+  return true;
+}
+
+// Sends a write on to the primary while this server is a replica; false
+// if it takes writes itself
+bool toPrimary(Reply* reply) {
+  if (!read_only.load(std::memory_order_acquire))
+    return false;
+  reply->set_msg("REDIRECT");
+  reply->set_redirect(primary_address);
+  return true;
+}
+
+const Status kStaleSession(grpc::StatusCode::UNAUTHENTICATED, "session expired, log in again");
+
+// A fresh session token; never 0, which stands for none
+uint64_t newSession() {
+  thread_local std::mt19937_64 rng(std::random_device{}());
+  uint64_t session;
+  do
+    session = rng();
+  while (session == 0);
+  return session;
+}
+
+int64_t steadyNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Notes that c did something just now, which keeps its login from expiring
+void touch(Client* c) {
+  c->last_active.store(steadyNanos(), std::memory_order_relaxed);
+}
+
+// The user a Request, ListRequest or Timeline Message comes from: by
+// user_id when it has one, which is a plain index into the registry, and by
+// username otherwise. nullptr if unknown, or if the session isn't the one
+// the user's last Login handed out (see stale()). The user found counts as
+// active
+template <typename R>
+Client* caller(const R& request) {
+  Client* c;
+  if (request.user_id() == kInvalidUserId)
+    c = user_registry.find(request.username());
+  else
+  {
+    c = user_registry.get(request.user_id());
+    if (c == nullptr || request.session() == 0 || c->session.load(std::memory_order_acquire) != request.session())
+      return nullptr;
+  }
+  if (c != nullptr)
+    touch(c);
+  return c;
+}
+
+// Whether caller() found no one because of a bad id/session pair, rather
+// than an unknown username
+template <typename R>
+bool stale(const R& request, const Client* c) {
+  return c == nullptr && request.user_id() != kInvalidUserId;
+}
+
+const Status kOverLimit(grpc::StatusCode::RESOURCE_EXHAUSTED, "too many requests, slow down");
+
+// Whether the limits (-L) let c make another call of kind now, c being
+// nullptr when the call isn't tied to a known user; refusals are counted
+bool admitted(AdmissionKind kind, Client* c, Counter* rejected) {
+  if (!admission.limited(kind) || admission.admit(kind, c != nullptr ? &c->rate_buckets : nullptr, steadyNanos()))
+    return true;
+  rejected->add();
+  trace(std::string(admissionKindName(kind)) + (c != nullptr ? " from " + c->username : "") + " over its rate limit");
+  return false;
+}
+
+// Has the node that owns followee record its side of a follow/unfollow.
+// The handler waits for the round trip, like it waits for the disk
+Status forwardEdge(bool follow, const std::string& follower, const std::string& followee, Reply* reply) {
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
+  Request request;
+  request.set_username(follower);
+  request.add_arguments(followee);
+  PeerLink& peer = cluster.peer(cluster.ownerOf(followee));
+  cluster.authorize(&context);
+  Status status = follow ? peer.stub()->Follow(&context, request, reply)
+                         : peer.stub()->UnFollow(&context, request, reply);
+  if (!status.ok())
+  {
+    log(WARNING, "Cannot reach " + peer.address() + " for " + followee + ": " + status.error_message());
+    return Status(grpc::StatusCode::UNAVAILABLE, "the server of " + followee + " is unreachable");
+  }
+  return status;
+}
+
+// Queues posts (all by author) for each of author's followers with a
+// stream open on this node, and with history set also keeps them in the
+// followers' home timelines. With forward set, sends each post once to
+// every other node where author has followers. Returns how many streams
+// they were queued for; *follower_count is set to the followers seen
+uint64_t pushToFollowers(Client* author, const std::vector<Post>& posts, bool history, bool forward,
+                         size_t* follower_count) {
+  // the snapshot is read without locks, even while others follow/unfollow author
+  AdjacencySet::Snapshot followers = social_graph.followers(author);
+  std::vector<bool> peers(forward ? cluster.size() : 0);
+  uint64_t queued = 0;
+  for (Client* follower : *followers)
+  {
+    if (!isLocal(follower))
+    {
+      if (forward)
+        peers[follower->node] = true;
+      continue;
+    }
+
+    if (history)
+      for (const Post& post : posts)
+        timeline_history->deliver(follower, post);
+
+    std::shared_ptr<Subscriber> sub = std::atomic_load(&follower->subscriber);
+    if (sub == nullptr)
+      continue;
+    for (const Post& post : posts) // for each follower, broadcast the msg
+      if (fanout_engine->enqueue(sub, post))
+        queued++;
+  }
+  for (uint32_t node = 0; node < peers.size(); node++)
+    if (peers[node])
+      for (const Post& post : posts)
+        cluster.peer(node).send(post);
+
+  *follower_count = followers->size();
+  deliveries_total->add(queued);
+  return queued;
+}
+
+/*
+ * Delivery for authors with at least -S followers. Pushing each of their
+ * posts follower by follower from the poster's thread would let one viral
+ * account hold that thread (and the writers) for every post. Instead the
+ * post is only stored, once, in the author's ring, where followers reading
+ * their timeline merge it in (see TimelineHistory), and every -u ms a tick
+ * hands all of an author's new posts to the followers with a stream open
+ * in one pass over them.
+ */
+class PullQueue {
+public:
+  void add(Client* author, const Post& post, bool forward) {
+    std::lock_guard<std::mutex> lock(mu_);
+    Pending& pending = pending_[author];
+    pending.posts.push_back(post);
+    pending.forward |= forward;
+  }
+
+  // delivers everything added since the last tick
+  void tick() {
+    std::unordered_map<Client*, Pending> pending;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      pending.swap(pending_);
+    }
+    for (auto& entry : pending)
+    {
+      size_t followers = 0;
+      uint64_t queued = pushToFollowers(entry.first, entry.second.posts, false, entry.second.forward, &followers);
+      post_fanout->record(followers);
+      trace(std::to_string(entry.second.posts.size()) + " posts from " + entry.first->username +
+            " pulled by " + std::to_string(queued / entry.second.posts.size()) + " of " +
+            std::to_string(followers) + " followers");
+    }
+  }
+
+private:
+  struct Pending {
+    std::vector<Post> posts;
+    bool forward = false;
+  };
+
+  std::mutex mu_;
+  std::unordered_map<Client*, Pending> pending_;
+};
+
+PullQueue pull_queue;
+
+void pullLoop(std::chrono::milliseconds tick) {
+  while (true)
+  {
+    std::this_thread::sleep_for(tick);
+    pull_queue.tick();
+    timeline_history->trimPulled();
+  }
+}
+
+// Delivers post to author's followers (see pushToFollowers): right away,
+// or at the next pull tick if the author has too many followers for that
+void fanOut(Client* author, const Post& post, bool handshake, bool forward) {
+  if (timeline_history->pulled(author))
+  {
+    if (!handshake)
+      posts_pulled->add();
+    pull_queue.add(author, post, forward);
+    return;
+  }
+
+  if (!handshake)
+    posts_pushed->add();
+  size_t followers = 0;
+  uint64_t queued = pushToFollowers(author, {post}, !handshake, forward, &followers);
+  post_fanout->record(followers);
+  trace((handshake ? "handshake from " : "post from ") + author->username + " queued for " +
+        std::to_string(queued) + " of " + std::to_string(followers) + " followers");
+}
+
+// Handlers shared by the sync and callback services. A handler that changes
+// state logs it and sets *seq; the reply must not go out before that record
+// is durable.
+
+Status handleList(const Request* request, ListReply* list_reply) {
+  RpcTimer timer(list_metrics);
+  Client* c = caller(*request);
+  if (stale(*request, c))
+    return kStaleSession;
+  if (!admitted(AdmissionKind::LIST, c, list_metrics.rejected))
+    return kOverLimit;
+
+  // no client (or not one of ours)
+  if (c == nullptr || !isLocal(c))
+    return Status::OK;
+
+  // populate the all users, and follower db's to display
+  user_registry.forEach([list_reply](Client* client) {
+    if (isLocal(client))
+      list_reply->add_all_users(client->username);
+  });
+  // and everyone the other nodes own
+  for (uint32_t node = 0; cluster.enabled() && node < cluster.size(); node++)
+  {
+    if (node == cluster.self())
+      continue;
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
+    cluster.authorize(&context);
+    ListReply peer_reply;
+    Status status = cluster.peer(node).stub()->List(&context, *request, &peer_reply);
+    if (!status.ok())
+    {
+      log(WARNING, "Cannot list the users of " + cluster.address(node) + ": " + status.error_message());
+      continue;
+    }
+    for (const std::string& username : peer_reply.all_users())
+      list_reply->add_all_users(username);
+  }
+  AdjacencySet::Snapshot followers = social_graph.followers(c);
+  for (Client* follower : *followers)
+    list_reply->add_followers(follower->username);
+
+  return Status::OK;
+}
+
+/*
+ * Produces the pages of one ListUsers call. A cursor is the id of the last
+ * user already sent, so resuming from it stays correct while users are added
+ * or follow edges change in between.
+ */
+class ListPager {
+public:
+  static const uint32_t kDefaultPageSize = 1000;
+  static const uint32_t kMaxPageSize = 10000;
+
+  explicit ListPager(const ListRequest* request)
+    : request_(request),
+      page_size_(std::min(request->page_size() ? request->page_size() : kDefaultPageSize, kMaxPageSize)) {
+    // a request naming its caller by id has to be current, whatever it lists
+    Client* c = caller(*request);
+    if (stale(*request, c))
+    {
+      status_ = kStaleSession;
+      done_ = true;
+      return;
+    }
+    // a page of everyone is the priciest read there is
+    if (!admitted(AdmissionKind::LIST_USERS, c, list_users_metrics.rejected))
+    {
+      status_ = kOverLimit;
+      done_ = true;
+      return;
+    }
+    if (!request->cursor().empty() && !parseCursor(request->cursor(), &after_))
+    {
+      status_ = Status(grpc::StatusCode::INVALID_ARGUMENT, "bad cursor");
+      done_ = true;
+      return;
+    }
+
+    if (request->scope() == ListRequest::FOLLOWERS)
+    {
+      // unknown user: nothing to list, like List
+      if (c == nullptr)
+      {
+        done_ = true;
+        return;
+      }
+      // followers are kept in no particular order; sort what's past the cursor by id
+      AdjacencySet::Snapshot snapshot = social_graph.followers(c);
+      for (Client* follower : *snapshot)
+        if (follower->id > after_ && matches(follower))
+          followers_.push_back(follower);
+      std::sort(followers_.begin(), followers_.end(),
+                [](Client* a, Client* b) { return a->id < b->id; });
+    }
+  }
+
+  // fills the next page; false once everything has been sent
+  bool next(ListPage* page) {
+    if (done_)
+      return false;
+
+    bool more;
+    if (request_->scope() == ListRequest::FOLLOWERS)
+    {
+      while (pos_ < followers_.size() && (uint32_t)page->users_size() < page_size_)
+      {
+        page->add_users(followers_[pos_]->username);
+        after_ = followers_[pos_++]->id;
+      }
+      more = pos_ < followers_.size();
+    }
+    else
+    {
+      UserId end = user_registry.size();
+      // 64 bits, so a cursor at the largest id doesn't wrap around to 0
+      uint64_t id = (uint64_t)after_ + 1;
+      for (; id <= end && (uint32_t)page->users_size() < page_size_; id++)
+      {
+        Client* c = user_registry.get(id);
+        if (c != nullptr && isLocal(c) && matches(c))
+          page->add_users(c->username);
+      }
+      // everything up to here has been looked at, matching or not
+      after_ = id - 1;
+      more = id <= end;
+    }
+
+    // the last page carries no cursor; max_pages can stop the stream before it
+    if (more)
+      page->set_next_cursor(std::to_string(after_));
+    done_ = !more || ++pages_ == request_->max_pages();
+    return true;
+  }
+
+  const Status& status() const { return status_; }
+
+private:
+  // the cursor is the id of the last user looked at, in decimal: digits
+  // only, and no more than an id can hold
+  static bool parseCursor(const std::string& cursor, UserId* after) {
+    if (!std::isdigit((unsigned char)cursor[0]))
+      return false;
+    errno = 0;
+    char* end = nullptr;
+    unsigned long long value = std::strtoull(cursor.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || value > std::numeric_limits<UserId>::max())
+      return false;
+    *after = value;
+    return true;
+  }
+
+  bool matches(Client* c) const {
+    const std::string& prefix = request_->prefix();
+    return c->username.compare(0, prefix.size(), prefix) == 0;
+  }
+
+  RpcTimer timer_{list_users_metrics};
+  const ListRequest* request_;
+  const uint32_t page_size_;
+  UserId after_ = 0;
+  uint32_t pages_ = 0;
+  bool done_ = false;
+  Status status_;
+  std::vector<Client*> followers_;
+  size_t pos_ = 0;
+};
+
+Status handleFollow(const Request* request, Reply* reply, uint64_t* seq) {
+  RpcTimer timer(follow_metrics);
+  std::string username2;
+  if (request->arguments_size() > 0)
+    username2 = request->arguments(0);
+  else 
+  {
+    reply->set_msg("Provide username");
+    return Status::OK;
+  }
+
+  // We assume that these clients exist in our db
+  Client*c1 = caller(*request);
+  if (stale(*request, c1))
+    return kStaleSession;
+  if (!admitted(AdmissionKind::FOLLOW, c1, follow_metrics.rejected))
+    return kOverLimit;
+  const std::string& username = c1 != nullptr ? c1->username : request->username();
+  if (redirected(username, reply) || toPrimary(reply))
+    return Status::OK;
+
+  // someone on another node: their node has the final say, then we add our side
+  if (c1 != nullptr && !cluster.owns(username2))
+  {
+    Status status = forwardEdge(true, username, username2, reply);
+    if (status.ok() && (reply->msg() == "Follow Successful" || reply->msg() == "you have already joined"))
+    {
+      Client* c2 = standIn(username2, seq);
+      social_graph.follow(c1, c2, [&] {
+        *seq = write_ahead_log.append(makeLogRecord(LogRecord::FOLLOW, c1, c2));
+      });
+    }
+    return status;
+  }
+
+  Client*c2 = user_registry.find(username2);
+
+  // if the client does not exist, or if the client trying to follow himself, then return error msg
+  if (c1 == nullptr or c2 == nullptr)
+    reply->set_msg("Invalid username");
+  else 
+  {
+    // the graph checks for self-follows and existing edges under the follower's lock,
+    // and the edge is logged under that same lock
+    switch (social_graph.follow(c1, c2, [&] {
+      *seq = write_ahead_log.append(makeLogRecord(LogRecord::FOLLOW, c1, c2));
+    }))
+    {
+      case SocialGraph::OK:
+        reply->set_msg("Follow Successful");
+        break;
+      case SocialGraph::ALREADY_FOLLOWING:
+        reply->set_msg("you have already joined");
+        break;
+      default:
+        reply->set_msg("Invalid username");
+    }
+  }
+
+  return Status::OK;
+}
+
+Status handleUnFollow(const Request* request, Reply* reply, uint64_t* seq) {
+  RpcTimer timer(unfollow_metrics);
+  std::string username2;
+  if (request->arguments_size() > 0)
+    username2 = request->arguments(0);
+  else 
+  {
+    reply->set_msg("Provide username");
+    return Status::OK;
+  }
+
+  Client* c1 = caller(*request);
+  if (stale(*request, c1))
+    return kStaleSession;
+  if (!admitted(AdmissionKind::UNFOLLOW, c1, unfollow_metrics.rejected))
+    return kOverLimit;
+  const std::string& username = c1 != nullptr ? c1->username : request->username();
+  if (redirected(username, reply) || toPrimary(reply))
+    return Status::OK;
+
+  if (c1 != nullptr && !cluster.owns(username2))
+  {
+    Status status = forwardEdge(false, username, username2, reply);
+    Client* c2 = user_registry.find(username2);
+    if (status.ok() && c2 != nullptr)
+      social_graph.unfollow(c1, c2, [&] {
+        *seq = write_ahead_log.append(makeLogRecord(LogRecord::UNFOLLOW, c1, c2));
+      });
+    return status;
+  }
+
+  Client* c2 = user_registry.find(username2);
+ 
+  if (c1 == nullptr or c2 == nullptr)
+  {
+    reply->set_msg("Invalid username");
+    return Status::OK;
+  }
+
+  // erase it from both the following and follower db's, if they follow
+  if (social_graph.unfollow(c1, c2, [&] {
+        *seq = write_ahead_log.append(makeLogRecord(LogRecord::UNFOLLOW, c1, c2));
+      }) == SocialGraph::OK)
+    reply->set_msg("UnFollow Successful");
+  else
+    reply->set_msg("you are not a follower");   // they do not follow so just return this back to client
+
+
+  return Status::OK;
+}
+
+Status handleLogin(const Request* request, Reply* reply, uint64_t* seq) {
+  RpcTimer timer(login_metrics);
+  std::string username = request->username();
+  if (redirected(username, reply))
+    return Status::OK;
+  // checked before a new user is created; the lookup only happens with a limit set
+  if (admission.limited(AdmissionKind::LOGIN) &&
+      !admitted(AdmissionKind::LOGIN, user_registry.find(username), login_metrics.rejected))
+    return kOverLimit;
+  // a replica only lets in the users it already has
+  if (user_registry.find(username) == nullptr && toPrimary(reply))
+    return Status::OK;
+  
+  // test 0: Check if the client already exists, add them to the registry if not
+  bool created = false;
+  Client* c = user_registry.findOrCreate(username, &created, [seq](Client* new_client) {
+    new_client->node = cluster.self();
+    *seq = write_ahead_log.append(makeLogRecord(LogRecord::LOGIN, new_client));
+  });
+
+  // if they have already joined, then return, if not, then set them to connected
+  touch(c);
+  if (c->connected.exchange(true, std::memory_order_acq_rel) && !created)
+    reply->set_msg("you have already joined");
+  else 
+  {
+    reply->set_msg("CONNECTION SUCCESSFUL");
+    // later calls can name the user by id; this replaces any earlier session
+    uint64_t session = newSession();
+    c->session.store(session, std::memory_order_release);
+    reply->set_user_id(c->id);
+    reply->set_session(session);
+  }
+
+  return Status::OK;
+}
+
+// One batch of FollowMany/UnFollowMany. Every name is resolved first, in
+// one pass; edge lists usually keep a user's edges together, so a name
+// that repeats the previous edge's isn't looked up again. Edges are then
+// applied one by one and each change logged, like Follow/UnFollow, but the
+// caller waits for the disk once per batch, not once per edge
+Status handleEdges(bool follow, const EdgeBatch& batch, EdgeResults* results, uint64_t* seq) {
+  RpcTimer timer(follow ? follow_many_metrics : unfollow_many_metrics);
+  // the batches of an import aren't anyone's, so only the overall limit applies
+  if (!admitted(follow ? AdmissionKind::FOLLOW_MANY : AdmissionKind::UNFOLLOW_MANY, nullptr,
+                follow ? follow_many_metrics.rejected : unfollow_many_metrics.rejected))
+    return kOverLimit;
+  if (read_only.load(std::memory_order_acquire))
+    return Status(grpc::StatusCode::FAILED_PRECONDITION, "read-only replica, send edges to " + primary_address);
+
+  bool create = follow && batch.create_users();
+  auto resolve = [&](const std::string& name, const std::string* previous, Client* previous_client) {
+    if (previous != nullptr && name == *previous)
+      return previous_client;
+    if (!create || !cluster.owns(name))
+      return user_registry.find(name);
+    return user_registry.findOrCreate(name, nullptr, [seq](Client* new_client) {
+      new_client->node = cluster.self();
+      new_client->connected = false;
+      *seq = write_ahead_log.append(makeLogRecord(LogRecord::LOGIN, new_client));
+    });
+  };
+
+  std::vector<std::pair<Client*, Client*>> edges(batch.edges_size());
+  for (int i = 0; i < batch.edges_size(); i++)
+  {
+    const csce662::Edge& edge = batch.edges(i);
+    const csce662::Edge* last = i > 0 ? &batch.edges(i - 1) : nullptr;
+    edges[i].first = resolve(edge.follower(), last ? &last->follower() : nullptr, last ? edges[i - 1].first : nullptr);
+    edges[i].second = resolve(edge.followee(), last ? &last->followee() : nullptr, last ? edges[i - 1].second : nullptr);
+  }
+
+  results->mutable_codes()->Reserve(edges.size());
+  for (const auto& edge : edges)
+  {
+    Client* c1 = edge.first;
+    Client* c2 = edge.second;
+    EdgeResults::Code code;
+    if (c1 == nullptr || c2 == nullptr)
+      code = EdgeResults::UNKNOWN_USER;
+    else if (!isLocal(c1) || !isLocal(c2))
+      code = EdgeResults::NOT_LOCAL;
+    else
+    {
+      auto changed = [&] {
+        *seq = write_ahead_log.append(makeLogRecord(follow ? LogRecord::FOLLOW : LogRecord::UNFOLLOW, c1, c2));
+      };
+      switch (follow ? social_graph.follow(c1, c2, changed) : social_graph.unfollow(c1, c2, changed))
+      {
+        case SocialGraph::OK:
+          code = EdgeResults::OK;
+          break;
+        case SocialGraph::SELF:
+          code = EdgeResults::SELF;
+          break;
+        default:
+          code = EdgeResults::UNCHANGED;
+      }
+    }
+    results->add_codes(code);
+  }
+  return Status::OK;
+}
+
+
+/*
+ * One client's Timeline stream, independent of how it is served. The first
+ * message naming a known user (by user_id and session, or by username)
+ * attaches the stream to that user; every
+ * message after that is posted to the user's followers. A message the
+ * stream can't go on from ends it with onMessage's status.
+ */
+class TimelineSession {
+public:
+  explicit TimelineSession(MessageSink* sink) : sink_(sink) {}
+  ~TimelineSession() { detach(); }
+
+  Status onMessage(const Post& received) {
+    // an envelope is taken apart and its messages handled in order
+    if (received->message().batch_size() > 0)
+    {
+      for (const Message& message : received->message().batch())
+      {
+        Status status = onMessage(makePost(message));
+        if (!status.ok())
+          return status;
+      }
+      return Status::OK;
+    }
+
+    Post post = received;
+    bool handshake = false;
+    if (c1_ == nullptr)
+    {
+      c1_ = caller(received->message());
+      // a session from before a restart or a newer login: the client has to
+      // log in again, or its next post would be taken for the handshake
+      if (stale(received->message(), c1_))
+        return kStaleSession;
+
+      // if no sender found in the db, keep searching for a valid sender iwthin the network
+      if (c1_ == nullptr || !isLocal(c1_))
+      {
+        c1_ = nullptr;
+        return Status::OK;
+      }
+
+      // subscribe the stream, followers' posts now get queued for it, right
+      // behind the last posts of everyone c1 follows (or, for a stream that
+      // picks up after a broken one, the posts it missed)
+      bool resumed = received->message().has_resume();
+      subscriber_ = fanout_engine->subscribe(sink_, c1_->username, received->message().batching());
+      for (const Post& earlier : resumed ? timeline_history->missed(c1_, social_graph, received->message().resume())
+                                         : timeline_history->recent(c1_, social_graph))
+        fanout_engine->enqueue(subscriber_, earlier);
+      std::atomic_store(&c1_->subscriber, subscriber_);
+      timeline_opened->add();
+      trace(c1_->username + (resumed ? " resumed" : " opened") + " a Timeline stream");
+
+      // followers already saw the stream open the first time
+      if (resumed)
+        return Status::OK;
+
+      // the message that opens the stream is relayed but isn't a real post.
+      // Followers get a copy without what only concerns this stream: above
+      // all the session, which would let them act as c1
+      Message hello = received->message();
+      hello.clear_user_id();
+      hello.clear_session();
+      hello.clear_batching();
+      hello.clear_resume();
+      post = makePost(hello);
+      handshake = true;
+    }
+
+    // the same post is queued for every follower; the writer pool does the
+    // actual Writes, so a slow follower can't hold this loop up
+    // the handshake is fanned out like a post, so it is measured like one
+    ScopedTimer timer(post_latency);
+    // a replica can't take the post, and dropping it quietly would lose it:
+    // the stream ends, telling the client where posts go
+    if (!handshake && read_only.load(std::memory_order_acquire))
+      return Status(grpc::StatusCode::FAILED_PRECONDITION, "read-only replica, send posts to " + primary_address);
+    // a post over the limit isn't taken, and the stream ends so the client
+    // learns of it rather than losing the post quietly
+    if (!handshake && !admitted(AdmissionKind::POST, c1_, posts_rejected))
+      return kOverLimit;
+    if (!handshake)
+    {
+      touch(c1_);
+      posts_total->add();
+      post = withSeq(post, c1_->post_seq.fetch_add(1, std::memory_order_relaxed) + 1);
+      // posts have no reply to hold back, so they are logged without waiting.
+      // into the history first: a snapshot taken after the append must see it
+      timeline_history->record(c1_, post);
+      LogRecord record = makeLogRecord(LogRecord::POST, c1_);
+      *record.mutable_post() = post->message();
+      write_ahead_log.append(record);
+      if (!post_archive.append(c1_->id, post->message()))
+        log(ERROR, "Cannot archive a post from " + c1_->username);
+    }
+
+    // other nodes get real posts only
+    fanOut(c1_, post, handshake, !handshake);
+    return Status::OK;
+  }
+
+  // after this returns the sink is no longer used
+  void detach() {
+    if (subscriber_ == nullptr)
+      return;
+
+    // cleanup, unless a newer stream of the same user already replaced ours;
+    // a client whose only stream ended is gone (or will log in again)
+    std::shared_ptr<Subscriber> expected = subscriber_;
+    if (std::atomic_compare_exchange_strong(&c1_->subscriber, &expected, std::shared_ptr<Subscriber>()))
+    {
+      touch(c1_);
+      c1_->connected.store(false, std::memory_order_release);
+    }
+    fanout_engine->unsubscribe(subscriber_);
+    subscriber_ = nullptr;
+    timeline_closed->add();
+    trace(c1_->username + " closed a Timeline stream");
+  }
+
+private:
+  MessageSink* sink_;
+  Client* c1_ = nullptr;
+  std::shared_ptr<Subscriber> subscriber_;
+};
+
+
+// Posts per Search reply, when the request doesn't say, and at most
+const uint32_t kDefaultSearchPosts = 20;
+const uint32_t kMaxSearchPosts = 100;
+
+// Search covers the posts in this node's archive, i.e. those of its own
+// users; with following set, only posts by users the caller follows
+Status handleSearch(const SearchRequest* request, SearchReply* reply) {
+  RpcTimer timer(search_metrics);
+  Client* c = caller(*request);
+  if (stale(*request, c))
+    return kStaleSession;
+  if (!admitted(AdmissionKind::SEARCH, c, search_metrics.rejected))
+    return kOverLimit;
+
+  std::vector<std::string> terms = SearchIndex::terms(request->query());
+  if (terms.empty())
+    return Status(grpc::StatusCode::INVALID_ARGUMENT, "nothing to search for");
+
+  std::unordered_set<uint32_t> followees;
+  if (request->following())
+  {
+    if (c == nullptr)
+      return Status::OK;
+    AdjacencySet::Snapshot following = social_graph.following(c);
+    for (Client* followee : *following)
+      if (isLocal(followee))
+        followees.insert(followee->id);
+    if (followees.empty())
+      return Status::OK;
+  }
+
+  uint64_t from = 0;
+  if (request->has_since())
+    from = post_archive.firstAt(google::protobuf::util::TimeUtil::TimestampToNanoseconds(request->since()));
+  uint32_t limit = request->limit() == 0 ? kDefaultSearchPosts : std::min(request->limit(), kMaxSearchPosts);
+
+  for (uint64_t n : search_index.search(terms, request->following() ? &followees : nullptr, from, limit))
+  {
+    PostArchive::Entry entry = post_archive.at(n);
+    if (!reply->add_posts()->ParseFromArray(entry.data, entry.length))
+      reply->mutable_posts()->RemoveLast();
+  }
+  return Status::OK;
+}
+
+// Accounts per SuggestFollows reply, when the request doesn't say, and at most
+const uint32_t kDefaultSuggestions = 10;
+const uint32_t kMaxSuggestions = 50;
+
+Status handleSuggestFollows(const SuggestRequest* request, SuggestReply* reply) {
+  RpcTimer timer(suggest_metrics);
+  Client* c = caller(*request);
+  if (stale(*request, c))
+    return kStaleSession;
+  if (!admitted(AdmissionKind::SUGGEST_FOLLOWS, c, suggest_metrics.rejected))
+    return kOverLimit;
+  if (c == nullptr || !isLocal(c))
+    return Status::OK;
+
+  uint32_t limit = request->limit() == 0 ? kDefaultSuggestions : std::min(request->limit(), kMaxSuggestions);
+  for (const FollowSuggester::Suggestion& suggestion : follow_suggester->suggest(c, limit))
+  {
+    csce662::Suggestion* out = reply->add_suggestions();
+    out->set_username(suggestion.user->username);
+    out->set_mutual(suggestion.mutual);
+  }
+  return Status::OK;
+}
+
+// Reads into a stream's arena between two resets
+const uint64_t kArenaResetInterval = 1024;
+
+// Holds a sync reply back until its log record is on disk
+Status waitDurable(const Status& status, uint64_t seq) {
+  if (seq != 0 && !write_ahead_log.sync(seq))
+    return Status(grpc::StatusCode::UNAVAILABLE, "storage failure");
+  return status;
+}
+
+// Finishes a callback reply once its log record is on disk, without
+// blocking the callback thread in the meantime
+void finishWhenDurable(grpc::ServerUnaryReactor* reactor, const Status& status, uint64_t seq) {
+  if (seq == 0)
+  {
+    reactor->Finish(status);
+    return;
+  }
+  write_ahead_log.onDurable(seq, [reactor, status](bool ok) {
+    reactor->Finish(ok ? status : Status(grpc::StatusCode::UNAVAILABLE, "storage failure"));
+  });
+}
+
+
+// Synchronous service: every call, including an open Timeline stream, holds a server thread
+class SNSServiceImpl final : public SNSService::Service {
+
+  Status List(ServerContext* context, const Request* request, ListReply* list_reply) override {
+    return handleList(request, list_reply);
+  }
+
+  Status ListUsers(ServerContext* context, const ListRequest* request, ServerWriter<ListPage>* writer) override {
+    ListPager pager(request);
+    ListPage page;
+    while (pager.next(&page))
+    {
+      if (!writer->Write(page))
+        break;
+      page.Clear();
+    }
+    return pager.status();
+  }
+
+  Status Follow(ServerContext* context, const Request* request, Reply* reply) override {
+    uint64_t seq = 0;
+    Status status = handleFollow(request, reply, &seq);
+    return waitDurable(status, seq);
+  }
+
+  Status UnFollow(ServerContext* context, const Request* request, Reply* reply) override {
+    uint64_t seq = 0;
+    Status status = handleUnFollow(request, reply, &seq);
+    return waitDurable(status, seq);
+  }
+
+  Status Login(ServerContext* context, const Request* request, Reply* reply) override {
+    uint64_t seq = 0;
+    Status status = handleLogin(request, reply, &seq);
+    return waitDurable(status, seq);
+  }
+
+  Status Timeline(ServerContext* context, ServerReaderWriter<Message, Message>* stream) override {
+    TimelineStreamSink sink(context, stream);
+    TimelineSession session(&sink);
+
+    // incoming messages are parsed into a per-stream arena, reused for every
+    // read and reset now and then so it can't grow without bound
+    google::protobuf::Arena arena;
+    Message* message = google::protobuf::Arena::CreateMessage<Message>(&arena);
+    uint64_t reads = 0;
+
+    Status status;
+    while (status.ok() && stream->Read(message))
+    {
+      status = session.onMessage(makePost(*message));
+      if (++reads % kArenaResetInterval == 0)
+      {
+        arena.Reset();
+        message = google::protobuf::Arena::CreateMessage<Message>(&arena);
+      }
+    }
 
+    session.detach();
+    return status;
+  }
 
-struct Client {
-  std::string username;
-  bool connected = true;
-  int following_file_size = 0;
-  std::vector<Client*> client_followers;
-  std::vector<Client*> client_following;
-  ServerReaderWriter<Message, Message>* stream = 0;
-  bool operator==(const Client& c1) const{
-    return (username == c1.username);
+  Status FollowMany(ServerContext* context, ServerReaderWriter<EdgeResults, EdgeBatch>* stream) override {
+    return serveEdges(true, stream);
   }
-};
 
-//Vector that stores every client that has been created
-std::vector<Client*> client_db;
+  Status Search(ServerContext* context, const SearchRequest* request, SearchReply* reply) override {
+    return handleSearch(request, reply);
+  }
 
+  Status SuggestFollows(ServerContext* context, const SuggestRequest* request, SuggestReply* reply) override {
+    return handleSuggestFollows(request, reply);
+  }
 
-class SNSServiceImpl final : public SNSService::Service {
+  Status UnFollowMany(ServerContext* context, ServerReaderWriter<EdgeResults, EdgeBatch>* stream) override {
+    return serveEdges(false, stream);
+  }
+
+private:
+  Status serveEdges(bool follow, ServerReaderWriter<EdgeResults, EdgeBatch>* stream) {
+    EdgeBatch batch;
+    EdgeResults results;
+    while (stream->Read(&batch))
+    {
+      uint64_t seq = 0;
+      Status status = waitDurable(handleEdges(follow, batch, &results, &seq), seq);
+      if (!status.ok())
+        return status;
+      if (!stream->Write(results))
+        break;
+      results.Clear();
+    }
+    return Status::OK;
+  }
+
+};
 
-  Client* getClient(const std::string& username) {
-    //iterate over all the clients, if there is a match return the pointer
-    for (Client* client : client_db)
-      if (client->username == username)
-        return client;
 
-    return nullptr;
+/*
+ * Callback-API Timeline stream. Reads are always outstanding, but an idle
+ * stream holds no thread. It is also the sink for its own fan-out: a writer
+ * thread starts the write and OnWriteDone reports it done. The engine never
+ * starts another before that, which keeps at most one write in flight as
+ * the callback API requires.
+ *
+ * The method is registered raw, so the stream carries serialized bytes. A
+ * post is encoded at most once, however many followers it goes to: each
+ * write just references the post's wire buffer. Posts read from the client
+ * keep the bytes they arrived in (plus their seq), so relaying them encodes
+ * nothing at all.
+ */
+class TimelineReactor final : public grpc::ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>, public MessageSink {
+public:
+  explicit TimelineReactor(grpc::CallbackServerContext* context)
+    : context_(context), session_(this) {
+    StartRead(&read_buffer_);
   }
 
-  // helper functiion to determine if two client objects are the same
-  bool isFollowing(Client* c1, Client* c2) {
-    return std::find(c1->client_following.begin(), c1->client_following.end(), c2) != c1->client_following.end();
+  // Once write_pending_ is set finishStream leaves Finish to OnWriteDone, so
+  // the StartWrite below can't come after Finish. mu_ isn't held across
+  // StartWrite itself: gRPC may run OnWriteDone inline, on this thread
+  void startWrite(std::vector<Post> posts, WriteDone done) override {
+    grpc::ByteBuffer buffer;
+    if (!encode(posts, &buffer))
+    {
+      done(false);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      // the stream is finishing, so the write fails as if the peer were gone
+      if (!finish_requested_)
+      {
+        write_pending_ = true;
+        write_done_.swap(done);
+        write_buffer_ = buffer;
+      }
+    }
+    if (done != nullptr)
+    {
+      done(false);
+      return;
+    }
+    StartWrite(&write_buffer_);
   }
 
-  Status List(ServerContext* context, const Request* request, ListReply* list_reply) override {
-    std::string username = request->username();
-    Client* c = nullptr;
+  void close() override { context_->TryCancel(); }
 
-    for (Client* client : client_db) {
-      if (client->username == username) {
-        c = client;
-        break;
+  void OnReadDone(bool ok) override {
+    // the client is gone or done posting
+    if (!ok)
+    {
+      finishStream(Status::OK);
+      return;
+    }
+    Post post = parsePost(read_buffer_);
+    if (post != nullptr)
+    {
+      Status status = session_.onMessage(post);
+      if (!status.ok())
+      {
+        finishStream(status);
+        return;
       }
     }
+    else
+    {
+      log(WARNING, "Dropping a Timeline message that doesn't parse");
+    }
+    read_buffer_.Clear();
+    StartRead(&read_buffer_);
+  }
 
-    // no client
-    if (c == nullptr)
-      return Status::OK;
+  void OnWriteDone(bool ok) override {
+    WriteDone done;
+    bool finish = false;
+    Status status;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      write_buffer_.Clear();
+      write_pending_ = false;
+      done.swap(write_done_);
+      if (finish_requested_ && !finished_)
+      {
+        finished_ = finish = true;
+        status = finish_status_;
+      }
+    }
+    done(ok);
+    if (finish)
+      Finish(status);
+  }
 
-    // populate the all users, and follower db's to display
-    for (Client* client : client_db)
-      list_reply->add_all_users(client->username);
-    for (Client* follower : c->client_followers)
-      list_reply->add_followers(follower->username);
+  void OnDone() override {
+    // every write has completed by now, so detaching can't wait on this stream
+    session_.detach();
+    delete this;
+  }
 
-    return Status::OK;
+private:
+  // No write may start after Finish, and one in flight has to complete
+  // first, so with a write pending OnWriteDone finishes instead
+  void finishStream(const Status& status) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      finish_requested_ = true;
+      finish_status_ = status;
+      if (write_pending_)
+        return;
+      finished_ = true;
+    }
+    Finish(status);
   }
 
-  Status Follow(ServerContext* context, const Request* request, Reply* reply) override {
-    std::string username = request->username();
-    std::string username2;
-    if (request->arguments_size() > 0)
-      username2 = request->arguments(0);
-    else 
+  // a single post is sent as its own wire buffer; a ByteBuffer copy only
+  // takes a reference on its slices.
+  //
+  // the envelope's batch field is a run of (tag, length, Message bytes), so
+  // it is built from each post's own wire slices plus a few bytes of header
+  // per post, again without encoding anything
+  static bool encode(const std::vector<Post>& posts, grpc::ByteBuffer* buffer) {
+    if (posts.size() == 1)
     {
-      reply->set_msg("Provide username");
-      return Status::OK;
+      *buffer = posts[0]->wire();
+      return true;
+    }
+    std::vector<grpc::Slice> slices;
+    std::vector<grpc::Slice> post_slices;
+    for (const Post& post : posts)
+    {
+      const grpc::ByteBuffer& wire = post->wire();
+      uint8_t header[1 + 5];   // the tag, then at most 5 bytes of varint
+      header[0] = (Message::kBatchFieldNumber << 3) | 2;   // length-delimited
+      uint8_t* end = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(wire.Length(), header + 1);
+      slices.emplace_back(header, end - header);
+      // Dump() replaces what's in the vector
+      if (!wire.Dump(&post_slices).ok())
+        return false;
+      slices.insert(slices.end(), post_slices.begin(), post_slices.end());
     }
+    *buffer = grpc::ByteBuffer(slices.data(), slices.size());
+    return true;
+  }
 
-    // We assume that these clients exist in our db
-    Client*c1 = getClient(username);
-    Client*c2 = getClient(username2);
+  grpc::CallbackServerContext* context_;
+  TimelineSession session_;
+  grpc::ByteBuffer read_buffer_;
+  grpc::ByteBuffer write_buffer_;
 
-    // if the client does not exist, or if the client trying to follow himself, then return error msg
-    if (c1 == nullptr or c2 == nullptr)
-      reply->set_msg("Invalid username");
-    else if (username == username2)
-      reply->set_msg("Invalid username");
-    else 
+  std::mutex mu_;
+  bool write_pending_ = false;
+  WriteDone write_done_;   // the pending write's
+  bool finish_requested_ = false;   // reads are over; finish once no write is pending
+  Status finish_status_;            // what the stream finishes with
+  bool finished_ = false;
+};
+
+
+// Callback-API ListUsers stream: the next page is built when the last one is sent
+class ListUsersReactor final : public grpc::ServerWriteReactor<ListPage> {
+public:
+  explicit ListUsersReactor(const ListRequest* request) : pager_(request) {
+    nextPage();
+  }
+
+  void OnWriteDone(bool ok) override {
+    if (ok)
+      nextPage();
+    else
+      Finish(Status::CANCELLED);
+  }
+
+  void OnDone() override { delete this; }
+
+private:
+  void nextPage() {
+    page_.Clear();
+    if (pager_.next(&page_))
+      StartWrite(&page_);
+    else
+      Finish(pager_.status());
+  }
+
+  ListPager pager_;
+  ListPage page_;
+};
+
+
+// Callback-API FollowMany/UnFollowMany: reads a batch, applies it, and
+// writes its results once they are on disk before reading the next one
+class EdgeBatchReactor final : public grpc::ServerBidiReactor<EdgeBatch, EdgeResults> {
+public:
+  explicit EdgeBatchReactor(bool follow) : follow_(follow) {
+    StartRead(&batch_);
+  }
+
+  void OnReadDone(bool ok) override {
+    if (!ok)
     {
-      // internal func to check if you already followed
-      if (isFollowing(c1, c2))
-        reply->set_msg("you have already joined");
-      else
-      {
-        // update the follwoing and follwers db respectively
-        c1->client_following.push_back(c2);
-        c2->client_followers.push_back(c1);
-        reply->set_msg("Follow Successful");
-      }
+      Finish(Status::OK);
+      return;
+    }
+    results_.Clear();
+    uint64_t seq = 0;
+    Status status = handleEdges(follow_, batch_, &results_, &seq);
+    if (!status.ok())
+    {
+      Finish(status);
+      return;
     }
+    write_ahead_log.onDurable(seq, [this](bool durable) {
+      if (durable)
+        StartWrite(&results_);
+      else
+        Finish(Status(grpc::StatusCode::UNAVAILABLE, "storage failure"));
+    });
+  }
 
-    return Status::OK;
+  void OnWriteDone(bool ok) override {
+    if (ok)
+      StartRead(&batch_);
+    else
+      Finish(Status::CANCELLED);
   }
 
-  Status UnFollow(ServerContext* context, const Request* request, Reply* reply) override {
-    std::string username = request->username();
-    std::string username2;
-    if (request->arguments_size() > 0)
-      username2 = request->arguments(0);
-    else 
+  void OnDone() override { delete this; }
+
+private:
+  const bool follow_;
+  EdgeBatch batch_;
+  EdgeResults results_;
+};
+
+
+// SNSService::CallbackService with Timeline registered raw (ByteBuffers in
+// and out); a raw method can't be stacked on top of its typed version
+typedef SNSService::WithRawCallbackMethod_Timeline<
+          SNSService::WithCallbackMethod_SuggestFollows<
+          SNSService::WithCallbackMethod_Search<
+          SNSService::WithCallbackMethod_UnFollowMany<
+          SNSService::WithCallbackMethod_FollowMany<
+          SNSService::WithCallbackMethod_ListUsers<
+          SNSService::WithCallbackMethod_UnFollow<
+          SNSService::WithCallbackMethod_Follow<
+          SNSService::WithCallbackMethod_List<
+          SNSService::WithCallbackMethod_Login<SNSService::Service>>>>>>>>>> SNSCallbackServiceBase;
+
+// Callback service: unary calls finish inline, streams are driven by reactors
+class SNSCallbackServiceImpl final : public SNSCallbackServiceBase {
+
+  grpc::ServerUnaryReactor* List(grpc::CallbackServerContext* context, const Request* request, ListReply* list_reply) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    reactor->Finish(handleList(request, list_reply));
+    return reactor;
+  }
+
+  grpc::ServerWriteReactor<ListPage>* ListUsers(grpc::CallbackServerContext* context, const ListRequest* request) override {
+    return new ListUsersReactor(request);
+  }
+
+  grpc::ServerUnaryReactor* Follow(grpc::CallbackServerContext* context, const Request* request, Reply* reply) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    uint64_t seq = 0;
+    Status status = handleFollow(request, reply, &seq);
+    finishWhenDurable(reactor, status, seq);
+    return reactor;
+  }
+
+  grpc::ServerUnaryReactor* UnFollow(grpc::CallbackServerContext* context, const Request* request, Reply* reply) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    uint64_t seq = 0;
+    Status status = handleUnFollow(request, reply, &seq);
+    finishWhenDurable(reactor, status, seq);
+    return reactor;
+  }
+
+  grpc::ServerUnaryReactor* Login(grpc::CallbackServerContext* context, const Request* request, Reply* reply) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    uint64_t seq = 0;
+    Status status = handleLogin(request, reply, &seq);
+    finishWhenDurable(reactor, status, seq);
+    return reactor;
+  }
+
+  grpc::ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>* Timeline(grpc::CallbackServerContext* context) override {
+    return new TimelineReactor(context);
+  }
+
+  grpc::ServerBidiReactor<EdgeBatch, EdgeResults>* FollowMany(grpc::CallbackServerContext* context) override {
+    return new EdgeBatchReactor(true);
+  }
+
+  grpc::ServerUnaryReactor* Search(grpc::CallbackServerContext* context, const SearchRequest* request,
+                                   SearchReply* reply) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    reactor->Finish(handleSearch(request, reply));
+    return reactor;
+  }
+
+  grpc::ServerUnaryReactor* SuggestFollows(grpc::CallbackServerContext* context, const SuggestRequest* request,
+                                           SuggestReply* reply) override {
+    grpc::ServerUnaryReactor* reactor = context->DefaultReactor();
+    reactor->Finish(handleSuggestFollows(request, reply));
+    return reactor;
+  }
+
+  grpc::ServerBidiReactor<EdgeBatch, EdgeResults>* UnFollowMany(grpc::CallbackServerContext* context) override {
+    return new EdgeBatchReactor(false);
+  }
+
+};
+
+const Status kNotMember(grpc::StatusCode::PERMISSION_DENIED, "only for the nodes of the cluster");
+
+// Calls from the other nodes of the cluster, served like the sync service.
+// Each must carry the cluster's key (see Cluster)
+class PeerServiceImpl final : public PeerService::Service {
+
+  // the follower is a user of the caller, the followee one of ours
+  Status Follow(ServerContext* context, const Request* request, Reply* reply) override {
+    if (!cluster.fromMember(*context))
+      return kNotMember;
+    if (read_only.load(std::memory_order_acquire))
+      return Status(grpc::StatusCode::FAILED_PRECONDITION, "read-only replica");
+    uint64_t seq = 0;
+    Client* c2 = request->arguments_size() > 0 ? user_registry.find(request->arguments(0)) : nullptr;
+    if (c2 == nullptr || !isLocal(c2) || cluster.owns(request->username()))
     {
-      reply->set_msg("Provide username");
+      reply->set_msg("Invalid username");
       return Status::OK;
     }
+    Client* c1 = standIn(request->username(), &seq);
+    switch (social_graph.follow(c1, c2, [&] {
+              seq = write_ahead_log.append(makeLogRecord(LogRecord::FOLLOW, c1, c2));
+            }))
+    {
+      case SocialGraph::OK:
+        reply->set_msg("Follow Successful");
+        break;
+      case SocialGraph::ALREADY_FOLLOWING:
+        reply->set_msg("you have already joined");
+        break;
+      default:
+        reply->set_msg("Invalid username");
+    }
+    return waitDurable(Status::OK, seq);
+  }
 
-    Client* c1 = getClient(username);
-    Client* c2 = getClient(username2);
-   
-    if (c1 == nullptr or c2 == nullptr)
+  Status UnFollow(ServerContext* context, const Request* request, Reply* reply) override {
+    if (!cluster.fromMember(*context))
+      return kNotMember;
+    if (read_only.load(std::memory_order_acquire))
+      return Status(grpc::StatusCode::FAILED_PRECONDITION, "read-only replica");
+    uint64_t seq = 0;
+    Client* c1 = user_registry.find(request->username());
+    Client* c2 = request->arguments_size() > 0 ? user_registry.find(request->arguments(0)) : nullptr;
+    if (c1 == nullptr || c2 == nullptr || !isLocal(c2))
     {
       reply->set_msg("Invalid username");
       return Status::OK;
     }
+    if (social_graph.unfollow(c1, c2, [&] {
+          seq = write_ahead_log.append(makeLogRecord(LogRecord::UNFOLLOW, c1, c2));
+        }) == SocialGraph::OK)
+      reply->set_msg("UnFollow Successful");
+    else
+      reply->set_msg("you are not a follower");
+    return waitDurable(Status::OK, seq);
+  }
+
+  Status List(ServerContext* context, const Request* request, ListReply* list_reply) override {
+    if (!cluster.fromMember(*context))
+      return kNotMember;
+    user_registry.forEach([list_reply](Client* client) {
+      if (isLocal(client))
+        list_reply->add_all_users(client->username);
+    });
+    return Status::OK;
+  }
 
-    // check if they follow
-    if (isFollowing(c1, c2))
+  // the authors are users of the caller, with followers here
+  Status Deliver(ServerContext* context, const DeliverRequest* request, Reply* reply) override {
+    if (!cluster.fromMember(*context))
+      return kNotMember;
+    if (read_only.load(std::memory_order_acquire))
+      return Status(grpc::StatusCode::FAILED_PRECONDITION, "read-only replica");
+    for (const Message& message : request->posts())
     {
-      // erase it from both the following and follower db's
-      c1->client_following.erase(std::find(c1->client_following.begin(), c1->client_following.end(), c2));
+      Client* author = user_registry.find(message.username());
+      if (author == nullptr || isLocal(author))
+        continue;
+      // logged like a post made here, so the copy survives a restart
+      Post post = makePost(message);
+      timeline_history->record(author, post);
+      LogRecord record = makeLogRecord(LogRecord::POST, author);
+      *record.mutable_post() = message;
+      write_ahead_log.append(record);
+      fanOut(author, post, false, false);
+    }
+    return Status::OK;
+  }
 
-      auto it_followers = std::find(c2->client_followers.begin(), c2->client_followers.end(), c1);
-      if (it_followers != c2->client_followers.end())
-        c2->client_followers.erase(it_followers);
+};
 
-      reply->set_msg("UnFollow Successful");
-    } 
-    else
-      reply->set_msg("you are not a follower");   // they do not follow so just return this back to client
+// Applies a record shipped from the primary the way the primary applied it
+void applyReplicated(const LogRecord& record) {
+  if (record.type() != LogRecord::POST)
+  {
+    applyLogRecord(record);
+    Client* c = record.type() == LogRecord::LOGIN ? user_registry.find(record.username()) : nullptr;
+    if (c != nullptr)
+      c->node = cluster.ownerOf(c->username);
+    return;
+  }
 
+  Client* author = user_registry.find(record.username());
+  if (author == nullptr)
+    return;
+  Post post = makePost(record.post());
+  timeline_history->record(author, post);
+  author->post_seq.store(record.post().seq(), std::memory_order_relaxed);
+  if (isLocal(author) && !post_archive.append(author->id, record.post()))
+    log(ERROR, "Cannot archive a post from " + author->username);
+  fanOut(author, post, false, false);
+}
 
-    return Status::OK;
+/*
+ * The replica side of log shipping (-P). A thread streams the primary's log
+ * from where ours ends, applies each record as it arrives and appends it to
+ * our own log, so both logs hold the same records under the same sequence
+ * numbers and a promoted replica carries the numbering on from there.
+ * Replicated posts reach the Timeline streams open here like local ones.
+ */
+class ReplicaLink {
+public:
+  void start(int promote_after_seconds) {
+    promote_after_ = std::chrono::seconds(promote_after_seconds);
+    read_only.store(true, std::memory_order_release);
+    running_ = true;
+    std::thread(&ReplicaLink::run, this).detach();
   }
 
-  Status Login(ServerContext* context, const Request* request, Reply* reply) override {
-    std::string username = request->username();
-    
-    // test 0: Check if the client already exists
-    Client* c = getClient(username);
+  // stops replicating, once the batch being applied is done, and takes
+  // writes from then on; false if this server already does
+  bool promote(const std::string& reason) {
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      if (!read_only.load(std::memory_order_acquire) || stopping_)
+        return false;
+      stopping_ = true;
+      if (context_ != nullptr)
+        context_->TryCancel();
+      stopped_cv_.wait(lock, [this] { return !running_; });
+    }
+    read_only.store(false, std::memory_order_release);
+    log(WARNING, "Promoted to primary at log record " + std::to_string(write_ahead_log.lastSeq()) + ": " + reason);
+    return true;
+  }
+
+  // log records the primary has that we don't yet
+  uint64_t lag() const {
+    uint64_t primary = primary_seq_.load(std::memory_order_relaxed);
+    uint64_t ours = write_ahead_log.lastSeq();
+    return primary > ours ? primary - ours : 0;
+  }
+
+private:
+  void run();
+  bool apply(const LogBatch& batch, std::string* error);
+
+  std::mutex mu_;
+  std::condition_variable stopped_cv_;
+  grpc::ClientContext* context_ = nullptr;   // of the stream being read
+  bool stopping_ = false;
+  bool running_ = false;
+  std::chrono::seconds promote_after_{0};
+  std::atomic<uint64_t> primary_seq_{0};
+};
+
+ReplicaLink replica_link;
+
+void ReplicaLink::run() {
+  std::unique_ptr<ReplicationService::Stub> stub = ReplicationService::NewStub(
+      grpc::CreateChannel(primary_address, grpc::InsecureChannelCredentials()));
+  // the primary sends at least a keepalive every second while it is up
+  auto heard = std::chrono::steady_clock::now();
+  bool self_promoted = false;
+  bool warned = false;   // about the current outage
+  while (true)
+  {
+    grpc::ClientContext context;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (stopping_)
+        break;
+      context_ = &context;
+    }
+
+    ReplicateRequest request;
+    request.set_after_seq(write_ahead_log.lastSeq());
+    std::unique_ptr<grpc::ClientReader<LogBatch>> reader(stub->Replicate(&context, request));
+    LogBatch batch;
+    std::string error;
+    while (reader->Read(&batch))
+    {
+      heard = std::chrono::steady_clock::now();
+      if (warned)
+        log(INFO, "Replicating from " + primary_address + " again");
+      warned = false;
+      if (!apply(batch, &error))
+      {
+        context.TryCancel();
+        break;
+      }
+    }
+    Status status = reader->Finish();
 
-    // if they have already joined, then return, if not, then add them  to the username db and set them to connected
-    if (c != nullptr && c->connected)
-      reply->set_msg("you have already joined");
-    else 
     {
-      if (c == nullptr) 
+      std::lock_guard<std::mutex> lock(mu_);
+      context_ = nullptr;
+      if (stopping_)
+        break;
+      if (promote_after_.count() > 0 && std::chrono::steady_clock::now() - heard >= promote_after_)
       {
-        c = new Client();
-        c->username = username;
-        c->connected = true;
-        client_db.push_back(c);
+        stopping_ = self_promoted = true;
+        break;
       }
-      else 
+    }
+    if (!warned)
+      log(WARNING, "Replication from " + primary_address + " stopped: " +
+                   (error.empty() ? status.error_message() : error));
+    warned = true;
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    running_ = false;
+  }
+  stopped_cv_.notify_all();
+  if (self_promoted)
+  {
+    read_only.store(false, std::memory_order_release);
+    log(WARNING, "Promoted to primary at log record " + std::to_string(write_ahead_log.lastSeq()) + ": " +
+                 primary_address + " unreachable for " + std::to_string(promote_after_.count()) + " s");
+  }
+}
+
+bool ReplicaLink::apply(const LogBatch& batch, std::string* error) {
+  primary_seq_.store(batch.durable_seq(), std::memory_order_relaxed);
+  uint64_t seq = batch.first_seq();
+  for (const std::string& bytes : batch.records())
+  {
+    LogRecord record;
+    if (seq != write_ahead_log.lastSeq() + 1 || !record.ParseFromString(bytes))
+    {
+      *error = "bad log record " + std::to_string(seq) + " from the primary";
+      return false;
+    }
+    // into our state first: a snapshot taken after the append must see it
+    applyReplicated(record);
+    write_ahead_log.append(record);
+    seq++;
+  }
+  return true;
+}
+
+// Bytes of log records shipped in one LogBatch
+const size_t kReplicationBatchBytes = 1 << 20;
+
+// Log shipping. Every server serves it, so a promoted replica can have
+// replicas of its own. Promote is only taken on the admin address (-D), not
+// from anyone who can reach the client port
+class ReplicationServiceImpl final : public ReplicationService::Service {
+public:
+  explicit ReplicationServiceImpl(bool admin) : admin_(admin) {}
+
+private:
+
+  Status Replicate(ServerContext* context, const ReplicateRequest* request, ServerWriter<LogBatch>* writer) override {
+    if (read_only.load(std::memory_order_acquire))
+      return Status(grpc::StatusCode::FAILED_PRECONDITION, "not the primary");
+    if (request->after_seq() > write_ahead_log.lastSeq())
+      return Status(grpc::StatusCode::FAILED_PRECONDITION, "the replica is ahead of the primary's log");
+
+    log(INFO, "Replica " + context->peer() + " following from log record " + std::to_string(request->after_seq() + 1));
+    replicas_connected++;
+    WriteAheadLog::Reader reader(write_ahead_log, request->after_seq());
+    std::vector<std::string> records;
+    std::string error;
+    LogBatch batch;
+    Status status;
+    while (!context->IsCancelled())
+    {
+      records.clear();
+      uint64_t first = reader.seq() + 1;
+      if (!reader.read(kReplicationBatchBytes, &records, &error))
       {
-        c->connected = true;
+        status = Status(grpc::StatusCode::FAILED_PRECONDITION, error);
+        break;
       }
+      // nothing new: wait for more, but send a keepalive at least every second
+      if (records.empty() && write_ahead_log.waitPast(reader.seq(), std::chrono::seconds(1)) > reader.seq())
+        continue;
 
-      reply->set_msg("CONNECTION SUCCESSFUL");
+      batch.Clear();
+      batch.set_first_seq(first);
+      for (std::string& record : records)
+        batch.add_records(std::move(record));
+      batch.set_durable_seq(write_ahead_log.durableSeq());
+      if (!writer->Write(batch))
+        break;
+    }
+    replicas_connected--;
+    log(INFO, "Replica " + context->peer() + " gone at log record " + std::to_string(reader.seq()) +
+              (error.empty() ? "" : ": " + error));
+    return status;
+  }
+
+  Status FetchSnapshot(ServerContext* context, const Request* request, ServerWriter<SnapshotChunk>* writer) override {
+    uint64_t seq = snapshot_store->seq();
+    if (seq == 0)
+      return Status::OK;
+    // once open, the file survives being replaced by a newer snapshot
+    std::ifstream in(snapshot_store->snapshotPath(seq), std::ios::binary);
+    if (!in)
+      return Status(grpc::StatusCode::UNAVAILABLE, "the snapshot was just replaced, try again");
+
+    SnapshotChunk chunk;
+    chunk.set_seq(seq);
+    std::string data(1 << 20, '\0');
+    while (in.read(&data[0], data.size()) || in.gcount() > 0)
+    {
+      chunk.set_data(data.data(), in.gcount());
+      if (!writer->Write(chunk))
+        break;
     }
+    return Status::OK;
+  }
 
+  Status Promote(ServerContext* context, const Request* request, Reply* reply) override {
+    if (!admin_)
+      return Status(grpc::StatusCode::PERMISSION_DENIED, "Promote is only served on the admin address (-D)");
+    if (replica_link.promote("asked by " + context->peer()))
+      reply->set_msg("Promote Successful");
+    else
+      reply->set_msg("already the primary");
     return Status::OK;
   }
 
+  const bool admin_;
+};
 
-  Status Timeline(ServerContext* context, ServerReaderWriter<Message, Message>* stream) override {
-    Message message;
-    Client* c1 = nullptr;
+// Whether dir holds no log or snapshot yet
+bool freshDataDir(const std::string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr)
+    return true;
+  bool fresh = true;
+  while (dirent* entry = readdir(d))
+    if (strncmp(entry->d_name, "wal", 3) == 0 || strncmp(entry->d_name, "snapshot-", 9) == 0)
+      fresh = false;
+  closedir(d);
+  return fresh;
+}
 
-    while (stream->Read(&message))
+// Starts a new replica from the primary's newest snapshot, if it has one
+bool fetchSnapshot(std::string* error) {
+  std::unique_ptr<ReplicationService::Stub> stub = ReplicationService::NewStub(
+      grpc::CreateChannel(primary_address, grpc::InsecureChannelCredentials()));
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReader<SnapshotChunk>> reader(stub->FetchSnapshot(&context, Request()));
+  SnapshotChunk chunk;
+  uint64_t seq = 0;
+  std::ofstream out;
+  while (reader->Read(&chunk))
+  {
+    if (seq == 0)
     {
-      if (c1 == nullptr)
-      {
-        c1 = getClient(message.username());
+      seq = chunk.seq();
+      out.open(snapshot_store->snapshotPath(seq) + ".tmp", std::ios::binary | std::ios::trunc);
+    }
+    out.write(chunk.data().data(), chunk.data().size());
+  }
+  Status status = reader->Finish();
+  if (!status.ok())
+  {
+    *error = primary_address + ": " + status.error_message();
+    return false;
+  }
+  if (seq == 0)
+    return true;
+
+  // load() checks the file's crc, so a torn copy is never used
+  std::string path = snapshot_store->snapshotPath(seq);
+  out.close();
+  if (!out || rename((path + ".tmp").c_str(), path.c_str()) != 0)
+  {
+    *error = path + ": " + strerror(errno);
+    return false;
+  }
+  log(INFO, "Fetched the primary's snapshot up to log record " + std::to_string(seq));
+  return true;
+}
 
-        // if no sender found in the db, keep searching for a valid sender iwthin the network
-        if (c1 == nullptr)
-          continue;
+// Exports state that is already counted elsewhere, read at scrape time
+void registerServerMetrics() {
+  metrics_registry.gauge("tsd_users", "Registered users",
+                         [] { return (double)user_registry.size(); });
+  metrics_registry.gauge("tsd_users_online", "Users of this node logged in now", [] {
+    size_t online = 0;
+    user_registry.forEach([&online](Client* c) {
+      if (isLocal(c) && c->connected.load(std::memory_order_relaxed))
+        online++;
+    });
+    return (double)online;
+  });
+  metrics_registry.gauge("tsd_pulled_authors", "Authors with too many followers to push their posts to (-S)",
+                         [] { return (double)timeline_history->pulledAuthorCount(); });
+  metrics_registry.gauge("tsd_search_indexed_posts", "Archived posts in the search index",
+                         [] { return (double)search_index.indexedCount(); });
+  metrics_registry.gauge("tsd_search_segments", "Segments of the search index",
+                         [] { return (double)search_index.segmentCount(); });
+  metrics_registry.gauge("tsd_suggest_graph_edges", "Follow edges in the copy of the graph SuggestFollows ranks from",
+                         [] { return (double)follow_suggester->graphEdges(); });
+  metrics_registry.gauge("tsd_suggest_graph_build_seconds", "Time the last copy of the graph took to make",
+                         [] { return follow_suggester->graphBuildNanos() / 1e9; });
+  metrics_registry.counterFunc("tsd_suggest_cache_hits_total", "SuggestFollows answered from a user's cached ranking",
+                               [] { return (double)follow_suggester->cacheHits(); });
+  metrics_registry.counterFunc("tsd_suggest_cache_misses_total", "SuggestFollows that had to rank again",
+                               [] { return (double)follow_suggester->cacheMisses(); });
+  metrics_registry.gauge("tsd_follow_edges", "Follow edges in the social graph",
+                         [] { return (double)social_graph.edgeCount(); });
+  metrics_registry.counterFunc("tsd_log_dropped_total", "Log records dropped because the log ring was full",
+                               [] { return (double)async_log.droppedCount(); });
+  metrics_registry.gauge("tsd_wal_durable_seq", "Last write-ahead log record known to be on disk",
+                         [] { return (double)write_ahead_log.durableSeq(); });
+  metrics_registry.gauge("tsd_snapshot_seq", "Last write-ahead log record covered by the newest snapshot",
+                         [] { return (double)snapshot_store->seq(); });
+  metrics_registry.gauge("tsd_replicas", "Replicas following this server's log",
+                         [] { return (double)replicas_connected.load(); });
+  metrics_registry.gauge("tsd_read_only", "1 while this server is a replica",
+                         [] { return read_only.load() ? 1.0 : 0.0; });
+  metrics_registry.gauge("tsd_replication_lag_records", "Log records the primary has that this replica doesn't yet",
+                         [] { return (double)replica_link.lag(); });
 
-        // set the stream
-        c1->stream = stream;
-      }
+  const FanoutEngine* engine = fanout_engine.get();
+  metrics_registry.gauge("tsd_fanout_queued_posts", "Posts waiting in memory for a writer",
+                         [engine] { return (double)engine->queuedCount(); });
+  metrics_registry.counterFunc("tsd_fanout_dropped_total", "Posts dropped from a full queue (-o drop)",
+                               [engine] { return (double)engine->droppedCount(); });
+  metrics_registry.counterFunc("tsd_fanout_disconnected_total", "Streams closed for falling behind",
+                               [engine] { return (double)engine->disconnectedCount(); });
+  metrics_registry.counterFunc("tsd_fanout_spilled_total", "Posts spilled to disk (-o spill)",
+                               [engine] { return (double)engine->spilledCount(); });
+  metrics_registry.addHistogram("tsd_fanout_write_seconds", "Time of one write to a stream (a post, or a batch)",
+                                &engine->writeLatency(), 1e-9);
+  metrics_registry.addHistogram("tsd_fanout_queue_depth", "Posts already queued for a follower, per post queued",
+                                &engine->queueDepth());
+  metrics_registry.addHistogram("tsd_fanout_batch_posts", "Posts per write to streams that take batches",
+                                &engine->batchSize());
+
+  for (uint32_t node = 0; cluster.enabled() && node < cluster.size(); node++)
+  {
+    if (node == cluster.self())
+      continue;
+    PeerLink* peer = &cluster.peer(node);
+    std::string labels = "peer=\"" + peer->address() + "\"";
+    metrics_registry.counterFunc("tsd_peer_posts_sent_total", "Posts delivered to another node",
+                                 [peer] { return (double)peer->sentCount(); }, labels);
+    metrics_registry.counterFunc("tsd_peer_posts_dropped_total", "Posts for another node dropped from a full queue",
+                                 [peer] { return (double)peer->droppedCount(); }, labels);
+  }
+}
+
+// Takes a snapshot whenever every_records more records have been logged
+void checkpointLoop(uint64_t every_records) {
+  while (true)
+  {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    if (write_ahead_log.lastSeq() - snapshot_store->seq() < every_records)
+      continue;
 
-      for (Client* follower : c1->client_followers) 
-        if (follower->stream != nullptr) // for each follower, broadcast the msg
-          follower->stream->Write(message);
+    auto start = std::chrono::steady_clock::now();
+    std::string error;
+    if (!snapshot_store->write(write_ahead_log, &error))
+    {
+      log(ERROR, "Snapshot failed: " + error);
+      continue;
     }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    log(INFO, "Snapshot up to log record " + std::to_string(snapshot_store->seq()) + " written in " +
+              std::to_string(ms.count()) + " ms");
+  }
+}
 
-    // cleanup
-    if (c1 != nullptr)
-      c1->stream = nullptr;
+// Loads the limits file (-L) again whenever it changes, so limits can be
+// tuned on a running server. A bad edit is logged and the limits in force
+// stay
+void limitsLoop(std::string path) {
+  struct stat loaded;
+  bool exists = stat(path.c_str(), &loaded) == 0;
+  while (true)
+  {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    struct stat now;
+    if (stat(path.c_str(), &now) != 0)
+    {
+      exists = false;
+      continue;
+    }
+    if (exists && now.st_mtime == loaded.st_mtime && now.st_size == loaded.st_size && now.st_ino == loaded.st_ino)
+      continue;
+    loaded = now;
+    exists = true;
+    std::string error;
+    if (admission.load(path, &error))
+      log(INFO, "Reloaded rate limits from " + path);
+    else
+      log(WARNING, "Kept the rate limits in force: " + error);
+  }
+}
 
-    return Status::OK;
+// Logs out users who have been idle longer than idle: no call, no post and
+// no Timeline stream open. Their session ends too, so a client coming back
+// logs in again
+void presenceLoop(std::chrono::seconds idle) {
+  std::chrono::seconds period = std::max(std::chrono::seconds(1), idle / 4);
+  while (true)
+  {
+    std::this_thread::sleep_for(period);
+    int64_t cutoff = steadyNanos() - std::chrono::duration_cast<std::chrono::nanoseconds>(idle).count();
+    user_registry.forEach([cutoff](Client* c) {
+      if (!isLocal(c) || !c->connected.load(std::memory_order_acquire) ||
+          c->last_active.load(std::memory_order_relaxed) > cutoff ||
+          std::atomic_load(&c->subscriber) != nullptr)
+        return;
+      c->connected.store(false, std::memory_order_release);
+      c->session.store(0, std::memory_order_release);
+      sessions_evicted->add();
+      trace(c->username + " logged out for being idle");
+    });
   }
+}
 
+// Transport settings for client connections
+struct ConnectionOptions {
+  // ping every connection this often (0 leaves gRPC's default of 2 hours)
+  // and drop it if a ping isn't answered within keepalive_timeout
+  int keepalive_seconds = 0;
+  int keepalive_timeout_seconds = 20;
+  // close connections this old, after a grace period for open calls
+  int max_connection_age_seconds = 0;
 };
 
-void RunServer(std::string port_no) {
+const int kMaxConnectionAgeGraceSeconds = 30;
+
+void RunServer(std::string port_no, bool async_mode, const ConnectionOptions& connection_options,
+               const std::string& admin_address) {
   std::string server_address = "0.0.0.0:"+port_no;
   SNSServiceImpl service;
+  SNSCallbackServiceImpl callback_service;
+  PeerServiceImpl peer_service;
+  ReplicationServiceImpl replication_service(false);
+  ReplicationServiceImpl admin_service(true);
+
+  // operator calls get a listener of their own, which clients are never
+  // given and which a firewall can keep to the operators' machines
+  std::unique_ptr<Server> admin_server;
+  if (!admin_address.empty())
+  {
+    ServerBuilder admin_builder;
+    admin_builder.AddListeningPort(admin_address, grpc::InsecureServerCredentials());
+    admin_builder.RegisterService(&admin_service);
+    admin_server = admin_builder.BuildAndStart();
+    if (admin_server == nullptr)
+    {
+      std::cerr << "Cannot serve admin calls on " << admin_address << std::endl;
+      log(ERROR, "Cannot serve admin calls on " + admin_address);
+      return;
+    }
+    log(INFO, "Serving admin calls on " + admin_address);
+  }
 
   ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  builder.RegisterService(&service);
+  if (connection_options.keepalive_seconds > 0)
+  {
+    // pinged even while nothing is sent, so a Timeline stream whose client
+    // vanished without closing its connection is noticed and torn down
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS, connection_options.keepalive_seconds * 1000);
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, connection_options.keepalive_timeout_seconds * 1000);
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+  }
+  if (connection_options.max_connection_age_seconds > 0)
+  {
+    builder.AddChannelArgument(GRPC_ARG_MAX_CONNECTION_AGE_MS, connection_options.max_connection_age_seconds * 1000);
+    builder.AddChannelArgument(GRPC_ARG_MAX_CONNECTION_AGE_GRACE_MS, kMaxConnectionAgeGraceSeconds * 1000);
+  }
+  if (async_mode)
+    builder.RegisterService(&callback_service);
+  else
+    builder.RegisterService(&service);
+  if (cluster.enabled())
+    builder.RegisterService(&peer_service);
+  builder.RegisterService(&replication_service);
   std::unique_ptr<Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << server_address << std::endl;
   log(INFO, "Server listening on "+server_address);
@@ -274,15 +2190,124 @@ void RunServer(std::string port_no) {
   server->Wait();
 }
 
+// A numeric option: all digits and in range for *value, which is left as
+// it is otherwise
+template <typename T>
+bool parseOption(const char* text, T* value) {
+  errno = 0;
+  char* end = nullptr;
+  unsigned long long n = std::isdigit((unsigned char)text[0]) ? std::strtoull(text, &end, 10) : 0;
+  if (end == nullptr || *end != '\0' || errno == ERANGE || n > (unsigned long long)std::numeric_limits<T>::max())
+  {
+    std::cerr << "Invalid Command Line Argument\n";
+    return false;
+  }
+  *value = n;
+  return true;
+}
+
 int main(int argc, char** argv) {
 
   std::string port = "3010";
+  bool async_mode = false;
+  std::string data_dir;
+  size_t home_threshold = 200;
+  size_t pull_threshold = 10000;
+  int pull_tick_ms = 100;
+  int metrics_port = 0;
+  uint32_t trace_rate = 0;
+  uint64_t checkpoint_records = 1000000;
+  FanoutOptions fanout_options;
+  std::string cluster_nodes;
+  std::string cluster_key_path;
+  std::string self_address;
+  std::string admin_address;
+  int promote_after = 0;
+  int idle_seconds = 300;
+  std::string limits_path;
+  int suggest_refresh_seconds = 10;
+  size_t suggest_threads = std::max(1u, std::thread::hardware_concurrency());
+  ConnectionOptions connection_options;
   
   int opt = 0;
-  while ((opt = getopt(argc, argv, "p:")) != -1){
+  while ((opt = getopt(argc, argv, "p:m:d:w:q:o:b:l:H:S:u:M:T:R:C:c:a:P:F:I:K:A:L:G:g:D:k:")) != -1){
     switch(opt) {
       case 'p':
           port = optarg;break;
+      case 'm':
+          if (std::string(optarg) == "async")
+            async_mode = true;
+          else if (std::string(optarg) != "sync")
+            std::cerr << "Invalid server mode (sync|async)\n";
+          break;
+      case 'd':
+          data_dir = optarg;break;
+      case 'w':
+          parseOption(optarg, &fanout_options.writer_threads);break;
+      case 'q':
+          parseOption(optarg, &fanout_options.queue_capacity);break;
+      case 'b':
+          parseOption(optarg, &fanout_options.max_batch);break;
+      case 'l':
+      {
+          uint32_t linger = 0;
+          if (parseOption(optarg, &linger))
+            fanout_options.linger = std::chrono::microseconds(linger);
+          break;
+      }
+      case 'H':
+          parseOption(optarg, &home_threshold);break;
+      case 'S':
+          parseOption(optarg, &pull_threshold);break;
+      case 'u':
+          if (parseOption(optarg, &pull_tick_ms))
+            pull_tick_ms = std::max(1, pull_tick_ms);
+          break;
+      case 'M':
+          parseOption(optarg, &metrics_port);break;
+      case 'T':
+          parseOption(optarg, &trace_rate);break;
+      case 'R':
+          parseOption(optarg, &FLAGS_max_log_size);break;
+      case 'C':
+          parseOption(optarg, &checkpoint_records);break;
+      case 'c':
+          cluster_nodes = optarg;break;
+      case 'k':
+          cluster_key_path = optarg;break;
+      case 'a':
+          self_address = optarg;break;
+      case 'P':
+          primary_address = optarg;break;
+      case 'D':
+          admin_address = optarg;break;
+      case 'F':
+          parseOption(optarg, &promote_after);break;
+      case 'I':
+          parseOption(optarg, &idle_seconds);break;
+      case 'K':
+      {
+          // interval[,timeout]
+          char* end = nullptr;
+          connection_options.keepalive_seconds = std::strtol(optarg, &end, 10);
+          if (*end == ',')
+            connection_options.keepalive_timeout_seconds = std::strtol(end + 1, nullptr, 10);
+          break;
+      }
+      case 'A':
+          parseOption(optarg, &connection_options.max_connection_age_seconds);break;
+      case 'L':
+          limits_path = optarg;break;
+      case 'G':
+          if (parseOption(optarg, &suggest_refresh_seconds))
+            suggest_refresh_seconds = std::max(1, suggest_refresh_seconds);
+          break;
+      case 'g':
+          parseOption(optarg, &suggest_threads);break;
+      case 'o':
+          if (!parseBackpressurePolicy(optarg, &fanout_options.policy))
+            std::cerr << "Invalid backpressure policy (drop|disconnect|spill)\n";
+          break;
       default:
 	  std::cerr << "Invalid Command Line Argument\n";
     }
@@ -290,8 +2315,116 @@ int main(int argc, char** argv) {
   
   std::string log_file_name = std::string("server-") + port;
   google::InitGoogleLogging(log_file_name.c_str());
+  async_log.setTraceRate(trace_rate);
+  async_log.start();
   log(INFO, "Logging Initialized. Server starting...");
-  RunServer(port);
+
+  // everything the server keeps on disk lives in one directory per server
+  if (data_dir.empty())
+    data_dir = "data-" + port;
+  mkdir(data_dir.c_str(), 0755);
+
+  timeline_history.reset(new TimelineHistory(home_threshold, pull_threshold));
+
+  std::string error;
+  if (!limits_path.empty() && !admission.load(limits_path, &error))
+  {
+    std::cerr << "Invalid rate limits: " << error << std::endl;
+    log(ERROR, "Invalid rate limits: " + error);
+    return 1;
+  }
+
+  if (self_address.empty())
+    self_address = "localhost:" + port;
+  if (!cluster.init(cluster_nodes, self_address, cluster_key_path, &error))
+  {
+    std::cerr << "Invalid cluster: " << error << std::endl;
+    log(ERROR, "Invalid cluster: " + error);
+    return 1;
+  }
+
+  // the newest snapshot, then only the log written after it
+  auto start = std::chrono::steady_clock::now();
+  snapshot_store.reset(new SnapshotStore(data_dir, user_registry, social_graph));
+  // a new replica starts where the primary's last snapshot left off
+  if (!primary_address.empty() && freshDataDir(data_dir) && !fetchSnapshot(&error))
+  {
+    std::cerr << "Cannot fetch the primary's snapshot: " << error << std::endl;
+    log(ERROR, "Cannot fetch the primary's snapshot: " + error);
+    return 1;
+  }
+  if (!snapshot_store->load(&error))
+  {
+    std::cerr << "Cannot load the snapshot: " << error << std::endl;
+    log(ERROR, "Cannot load the snapshot: " + error);
+    return 1;
+  }
+  if (!write_ahead_log.open(data_dir, applyLogRecord, &error, snapshot_store->seq()))
+  {
+    std::cerr << "Cannot open the write-ahead log: " << error << std::endl;
+    log(ERROR, "Cannot open the write-ahead log: " + error);
+    return 1;
+  }
+  // which node owns a user isn't stored: it follows from the node list
+  user_registry.forEach([](Client* c) {
+    c->node = cluster.ownerOf(c->username);
+  });
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  if (!post_archive.open(data_dir + "/archive", &error))
+  {
+    std::cerr << "Cannot open the post archive: " << error << std::endl;
+    log(ERROR, "Cannot open the post archive: " + error);
+    return 1;
+  }
+  log(INFO, "Recovered " + std::to_string(user_registry.size()) + " users and " +
+            std::to_string(social_graph.edgeCount()) + " follow edges in " + std::to_string(ms.count()) +
+            " ms (snapshot up to log record " + std::to_string(snapshot_store->seq()) + ", log up to " +
+            std::to_string(write_ahead_log.lastSeq()) + ")");
+  // the index is rebuilt from the archive in the background; searches see
+  // the posts indexed so far
+  search_index.start();
+  follow_suggester.reset(new FollowSuggester(user_registry, social_graph, suggest_threads));
+  follow_suggester->start(std::chrono::seconds(suggest_refresh_seconds));
+  if (checkpoint_records != 0)
+    std::thread(checkpointLoop, checkpoint_records).detach();
+  if (cluster.enabled())
+    log(INFO, "Node " + std::to_string(cluster.self()) + " of a cluster of " + std::to_string(cluster.size()) +
+              " (" + cluster_nodes + ")");
+
+  fanout_options.spill_dir = data_dir;
+  fanout_engine.reset(new FanoutEngine(fanout_options));
+
+  registerServerMetrics();
+  MetricsServer metrics_server(metrics_registry);
+  if (metrics_port != 0)
+  {
+    // metrics are for the operator, so only this machine can read them
+    if (!metrics_server.start("127.0.0.1", metrics_port, &error))
+    {
+      std::cerr << "Cannot serve metrics on port " << metrics_port << ": " << error << std::endl;
+      log(ERROR, "Cannot serve metrics: " + error);
+      return 1;
+    }
+    log(INFO, "Serving metrics on 127.0.0.1:" + std::to_string(metrics_port));
+  }
+
+  // replicated posts are fanned out, so only once the engine runs
+  if (!primary_address.empty())
+  {
+    log(INFO, "Replicating from " + primary_address + " after log record " + std::to_string(write_ahead_log.lastSeq()));
+    replica_link.start(promote_after);
+  }
+
+  if (pull_threshold > 0)
+    std::thread(pullLoop, std::chrono::milliseconds(pull_tick_ms)).detach();
+
+  if (!limits_path.empty())
+    std::thread(limitsLoop, limits_path).detach();
+
+  if (idle_seconds > 0)
+    std::thread(presenceLoop, std::chrono::seconds(idle_seconds)).detach();
+
+  RunServer(port, async_mode, connection_options, admin_address);
 
   return 0;
 }
@@ -0,0 +1,151 @@
+/*
+ * Loads a social graph into a running tsd from an edge list, one edge per
+ * line:
+ *
+ *   follower followee
+ *
+ * (whitespace-separated; blank lines and lines starting with # are
+ * skipped). Edges are streamed to FollowMany in batches, so a batch costs
+ * one round trip and one wait for the server's disk, whatever its size.
+ *
+ *   ./tsimport [-h host] [-p port] [-b edges_per_batch] [-c] [-u] [file ...]
+ *
+ * -c logs in users tsd doesn't know yet, -u unfollows instead. Reads stdin
+ * without files. In a cluster, only edges between two users of the server
+ * given are applied; the others are counted as not local.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+
+using csce662::EdgeBatch;
+using csce662::EdgeResults;
+using csce662::SNSService;
+
+struct Totals {
+  uint64_t sent = 0;
+  uint64_t codes[EdgeResults::Code_ARRAYSIZE] = {};
+};
+
+// streams the edges of in, one batch at a time; false on a malformed line
+static bool sendEdges(std::istream& in, const std::string& name, int batch_size, bool create,
+                      grpc::ClientReaderWriter<EdgeBatch, EdgeResults>* stream, Totals* totals) {
+  EdgeBatch batch;
+  batch.set_create_users(create);
+  std::string line;
+  for (uint64_t line_no = 1; std::getline(in, line); line_no++) {
+    std::istringstream fields(line);
+    std::string follower, followee, extra;
+    if (!(fields >> follower) || follower[0] == '#')
+      continue;
+    if (!(fields >> followee) || (fields >> extra)) {
+      std::cerr << name << ":" << line_no << ": expected \"follower followee\"" << std::endl;
+      return false;
+    }
+    csce662::Edge* edge = batch.add_edges();
+    edge->set_follower(follower);
+    edge->set_followee(followee);
+    if (batch.edges_size() == batch_size) {
+      if (!stream->Write(batch))
+        return false;
+      totals->sent += batch.edges_size();
+      batch.clear_edges();
+    }
+  }
+  if (batch.edges_size() > 0) {
+    if (!stream->Write(batch))
+      return false;
+    totals->sent += batch.edges_size();
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  std::string hostname = "localhost";
+  std::string port = "3010";
+  int batch_size = 10000;
+  bool create = false;
+  bool unfollow = false;
+
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "h:p:b:cu")) != -1){
+    switch(opt) {
+      case 'h':
+        hostname = optarg;break;
+      case 'p':
+        port = optarg;break;
+      case 'b':
+        batch_size = std::max(1, atoi(optarg));break;
+      case 'c':
+        create = true;break;
+      case 'u':
+        unfollow = true;break;
+      default:
+        std::cerr << "Invalid Command Line Argument\n";
+    }
+  }
+
+  std::unique_ptr<SNSService::Stub> stub = SNSService::NewStub(
+      grpc::CreateChannel(hostname + ":" + port, grpc::InsecureChannelCredentials()));
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReaderWriter<EdgeBatch, EdgeResults>> stream(
+      unfollow ? stub->UnFollowMany(&context) : stub->FollowMany(&context));
+
+  auto start = std::chrono::steady_clock::now();
+  Totals totals;
+
+  // results come back while later batches are still being sent
+  std::thread reader([&] {
+    EdgeResults results;
+    while (stream->Read(&results))
+      for (int code : results.codes())
+        if (code >= 0 && code < EdgeResults::Code_ARRAYSIZE)
+          totals.codes[code]++;
+  });
+
+  bool ok = true;
+  if (optind == argc)
+    ok = sendEdges(std::cin, "stdin", batch_size, create, stream.get(), &totals);
+  for (int i = optind; ok && i < argc; i++) {
+    std::ifstream file(argv[i]);
+    if (!file) {
+      std::cerr << "Cannot open " << argv[i] << std::endl;
+      ok = false;
+      break;
+    }
+    ok = sendEdges(file, argv[i], batch_size, create, stream.get(), &totals);
+  }
+  if (!ok)
+    context.TryCancel();
+  stream->WritesDone();
+  reader.join();
+  grpc::Status status = stream->Finish();
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  uint64_t done = 0;
+  for (uint64_t count : totals.codes)
+    done += count;
+  std::cout << std::fixed << std::setprecision(1)
+            << done << " of " << totals.sent << " edges in " << seconds << "s ("
+            << (seconds > 0 ? done / seconds : 0) << "/s): "
+            << totals.codes[EdgeResults::OK] << " " << (unfollow ? "removed" : "added") << ", "
+            << totals.codes[EdgeResults::UNCHANGED] << " unchanged, "
+            << totals.codes[EdgeResults::UNKNOWN_USER] << " unknown users, "
+            << totals.codes[EdgeResults::SELF] << " self, "
+            << totals.codes[EdgeResults::NOT_LOCAL] << " not local" << std::endl;
+  if (ok && !status.ok()) {
+    std::cerr << "Import failed: " << status.error_message() << std::endl;
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
@@ -1 +1,21 @@
-GLOG_logtostderr=1 ./tsd
+# ./tsn-service_start.sh              one server on port 3010
+# ./tsn-service_start.sh 3 3010       a cluster of 3 on ports 3010-3012
+nodes=${1:-1}
+base=${2:-3010}
+if [ "$nodes" -le 1 ]; then
+  GLOG_logtostderr=1 ./tsd -p "$base"
+  exit
+fi
+# the nodes' calls to each other carry a key only they know
+key=cluster.key
+if [ ! -s "$key" ]; then
+  (umask 077; od -An -tx1 -N32 /dev/urandom | tr -d ' \n' > "$key")
+fi
+list=""
+for i in $(seq 0 $((nodes - 1))); do
+  list="$list${list:+,}localhost:$((base + i))"
+done
+for i in $(seq 1 $((nodes - 1))); do
+  GLOG_logtostderr=1 ./tsd -p $((base + i)) -c "$list" -k "$key" &
+done
+GLOG_logtostderr=1 ./tsd -p "$base" -c "$list" -k "$key"
@@ -0,0 +1,178 @@
+#include "user_registry.h"
+
+#include <functional>
+#include <mutex>
+
+namespace {
+
+const size_t kInitialSlots = 16;
+
+size_t roundUpPow2(size_t n) {
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+}  // namespace
+
+UserRegistry::UserRegistry(size_t shard_count) {
+  shard_count = roundUpPow2(shard_count == 0 ? 1 : shard_count);
+  shards_.reset(new Shard[shard_count]);
+  shard_mask_ = shard_count - 1;
+  for (size_t i = 0; i < shard_count; i++)
+    shards_[i].slots.resize(kInitialSlots);
+
+  chunks_.reset(new std::atomic<std::atomic<Client*>*>[kMaxChunks]);
+  for (size_t i = 0; i < kMaxChunks; i++)
+    chunks_[i].store(nullptr, std::memory_order_relaxed);
+}
+
+UserRegistry::~UserRegistry() {
+  for (size_t i = 0; i < kMaxChunks; i++) {
+    std::atomic<Client*>* chunk = chunks_[i].load(std::memory_order_relaxed);
+    if (chunk == nullptr)
+      continue;
+    for (size_t j = 0; j < kChunkSize; j++)
+      delete chunk[j].load(std::memory_order_relaxed);
+    delete[] chunk;
+  }
+}
+
+uint64_t UserRegistry::hashName(const std::string& username) {
+  // std::hash is fine for distribution, but mix it so that both the shard
+  // bits (top) and the slot bits (bottom) depend on the whole name
+  uint64_t h = std::hash<std::string>()(username);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+UserRegistry::Shard& UserRegistry::shardFor(uint64_t hash) const {
+  return shards_[(hash >> 48) & shard_mask_];
+}
+
+Client* UserRegistry::probe(const Shard& shard, uint64_t hash, const std::string& username) {
+  size_t mask = shard.slots.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    const Slot& slot = shard.slots[i];
+    if (slot.client == nullptr)
+      return nullptr;
+    // only fall back to a string compare when the full hash matches
+    if (slot.hash == hash && slot.client->username == username)
+      return slot.client;
+  }
+}
+
+void UserRegistry::insertSlot(Shard& shard, uint64_t hash, Client* client) {
+  size_t mask = shard.slots.size() - 1;
+  size_t i = hash & mask;
+  while (shard.slots[i].client != nullptr)
+    i = (i + 1) & mask;
+  shard.slots[i].hash = hash;
+  shard.slots[i].client = client;
+  shard.used++;
+}
+
+void UserRegistry::grow(Shard& shard) {
+  std::vector<Slot> old;
+  old.swap(shard.slots);
+  shard.slots.resize(old.size() * 2);
+  shard.used = 0;
+  for (const Slot& slot : old)
+    if (slot.client != nullptr)
+      insertSlot(shard, slot.hash, slot.client);
+}
+
+void UserRegistry::publish(Client* client) {
+  size_t chunk_no = client->id >> kChunkBits;
+  std::atomic<Client*>* chunk = chunks_[chunk_no].load(std::memory_order_acquire);
+  if (chunk == nullptr) {
+    // two shards may race to allocate the same chunk; the loser frees its copy
+    std::atomic<Client*>* fresh = new std::atomic<Client*>[kChunkSize];
+    for (size_t i = 0; i < kChunkSize; i++)
+      fresh[i].store(nullptr, std::memory_order_relaxed);
+    if (chunks_[chunk_no].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel))
+      chunk = fresh;
+    else
+      delete[] fresh;
+  }
+  chunk[client->id & (kChunkSize - 1)].store(client, std::memory_order_release);
+}
+
+Client* UserRegistry::find(const std::string& username) const {
+  uint64_t hash = hashName(username);
+  const Shard& shard = shardFor(hash);
+  std::shared_lock<std::shared_mutex> lock(shard.mu);
+  return probe(shard, hash, username);
+}
+
+Client* UserRegistry::get(UserId id) const {
+  if (id == kInvalidUserId)
+    return nullptr;
+  std::atomic<Client*>* chunk = chunks_[id >> kChunkBits].load(std::memory_order_acquire);
+  if (chunk == nullptr)
+    return nullptr;
+  return chunk[id & (kChunkSize - 1)].load(std::memory_order_acquire);
+}
+
+Client* UserRegistry::createLocked(Shard& shard, uint64_t hash, const std::string& username, UserId id) {
+  // keep the load factor under 3/4 so probe sequences stay short
+  if ((shard.used + 1) * 4 > shard.slots.size() * 3)
+    grow(shard);
+
+  Client* c = new Client();
+  c->username = username;
+  c->id = id;
+  publish(c);
+  insertSlot(shard, hash, c);
+  return c;
+}
+
+Client* UserRegistry::findOrCreate(const std::string& username, bool* created,
+                                   const std::function<void(Client*)>& on_create) {
+  uint64_t hash = hashName(username);
+  Shard& shard = shardFor(hash);
+
+  if (created != nullptr)
+    *created = false;
+
+  {
+    std::shared_lock<std::shared_mutex> lock(shard.mu);
+    Client* c = probe(shard, hash, username);
+    if (c != nullptr)
+      return c;
+  }
+
+  std::unique_lock<std::shared_mutex> lock(shard.mu);
+  // someone may have created it between the two locks
+  Client* c = probe(shard, hash, username);
+  if (c != nullptr)
+    return c;
+
+  c = createLocked(shard, hash, username, next_id_.fetch_add(1, std::memory_order_acq_rel));
+  if (on_create)
+    on_create(c);
+
+  if (created != nullptr)
+    *created = true;
+  return c;
+}
+
+Client* UserRegistry::insert(const std::string& username, UserId id) {
+  uint64_t hash = hashName(username);
+  Shard& shard = shardFor(hash);
+
+  std::unique_lock<std::shared_mutex> lock(shard.mu);
+  Client* c = probe(shard, hash, username);
+  if (c != nullptr || id == kInvalidUserId || get(id) != nullptr)
+    return c;
+
+  // make sure fresh ids are handed out after this one
+  UserId next = next_id_.load(std::memory_order_acquire);
+  while (next <= id && !next_id_.compare_exchange_weak(next, id + 1, std::memory_order_acq_rel))
+    ;
+
+  return createLocked(shard, hash, username, id);
+}
@@ -0,0 +1,144 @@
+#ifndef USER_REGISTRY_H
+#define USER_REGISTRY_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "admission.h"
+#include "fanout.h"
+#include "post_history.h"
+#include "social_graph.h"
+
+using UserId = uint32_t;
+
+// ID 0 is never handed out, so it can be used as "no user" everywhere
+const UserId kInvalidUserId = 0;
+
+struct Client {
+  std::string username;
+  UserId id = kInvalidUserId;
+  // cluster node that owns the client (see Cluster); on any other node this
+  // is only a stand-in that holds follow edges
+  uint32_t node = 0;
+  // logged in: set by Login, cleared when the client's Timeline stream ends
+  // or it has been idle too long (tsd -I)
+  std::atomic<bool> connected{true};
+  // steady-clock time (ns) of the client's last call or Timeline message
+  std::atomic<int64_t> last_active{0};
+  // token handed out by the client's last Login (0 before any); a request
+  // that names the client by id must carry it
+  std::atomic<uint64_t> session{0};
+  // the client's share of the rate limits (tsd -L)
+  UserBuckets rate_buckets;
+  int following_file_size = 0;
+  AdjacencySet client_followers;
+  AdjacencySet client_following;
+  // the client's own newest posts, and (only while they follow many
+  // accounts) the newest posts of everyone they follow
+  PostRing recent_posts{kReplayPosts};
+  PostRing home_timeline;
+  // seq of the client's newest post
+  std::atomic<uint64_t> post_seq{0};
+  std::atomic<bool> home_materialized{false};
+  // among TimelineHistory's pulled authors, whose posts are merged into
+  // home timelines on read
+  std::atomic<bool> pull_merged{false};
+  // set while the client has a Timeline stream open; other threads fan out
+  // to it, so always go through std::atomic_load/atomic_store
+  std::shared_ptr<Subscriber> subscriber;
+  bool operator==(const Client& c1) const{
+    return (username == c1.username);
+  }
+};
+
+/*
+ * Registry of every client that has ever logged in.
+ *
+ * Usernames are hashed into one of several shards; each shard is an
+ * open-addressing (linear probing) table guarded by its own reader/writer
+ * lock, so lookups on different shards never contend and lookups on the
+ * same shard only share a lock. The username string is stored once, inside
+ * its Client, and slots only keep the hash and a pointer to it.
+ *
+ * Every client also gets a stable integer ID on creation. IDs are dense and
+ * start at 1, and get() resolves them through a direct-indexed table without
+ * taking any lock. Clients are never removed, so returned pointers stay valid
+ * for the lifetime of the registry.
+ */
+class UserRegistry {
+public:
+  explicit UserRegistry(size_t shard_count = 64);
+  ~UserRegistry();
+
+  UserRegistry(const UserRegistry&) = delete;
+  UserRegistry& operator=(const UserRegistry&) = delete;
+
+  // returns nullptr if the username is unknown
+  Client* find(const std::string& username) const;
+
+  // returns nullptr if the id was never assigned
+  Client* get(UserId id) const;
+
+  // returns the existing client, or creates it with the next free id;
+  // *created (if given) tells the two cases apart. on_create runs before
+  // anyone else can find the new client, e.g. to log its creation first
+  Client* findOrCreate(const std::string& username, bool* created = nullptr,
+                       const std::function<void(Client*)>& on_create = nullptr);
+
+  // creates the client with a specific id, as recorded earlier; used when
+  // rebuilding the registry from disk. returns the existing client if the
+  // username is already known
+  Client* insert(const std::string& username, UserId id);
+
+  // number of ids handed out so far; valid ids are [1, size()]
+  UserId size() const { return next_id_.load(std::memory_order_acquire) - 1; }
+
+  // calls f(Client*) for every client in id order
+  template <typename F>
+  void forEach(F&& f) const {
+    UserId last = size();
+    for (UserId id = 1; id <= last; id++) {
+      Client* c = get(id);
+      if (c != nullptr)
+        f(c);
+    }
+  }
+
+private:
+  struct Slot {
+    uint64_t hash = 0;
+    Client* client = nullptr;
+  };
+
+  struct Shard {
+    mutable std::shared_mutex mu;
+    std::vector<Slot> slots;  // capacity is always a power of two
+    size_t used = 0;
+  };
+
+  // the id table is split into fixed-size chunks that are never moved, so
+  // readers can index it while writers append
+  static const unsigned kChunkBits = 16;
+  static const size_t kChunkSize = size_t(1) << kChunkBits;
+  static const size_t kMaxChunks = size_t(1) << (32 - kChunkBits);
+
+  static uint64_t hashName(const std::string& username);
+  Shard& shardFor(uint64_t hash) const;
+  static Client* probe(const Shard& shard, uint64_t hash, const std::string& username);
+  static void insertSlot(Shard& shard, uint64_t hash, Client* client);
+  static void grow(Shard& shard);
+  void publish(Client* client);
+  Client* createLocked(Shard& shard, uint64_t hash, const std::string& username, UserId id);
+
+  std::unique_ptr<Shard[]> shards_;
+  size_t shard_mask_;
+  std::unique_ptr<std::atomic<std::atomic<Client*>*>[]> chunks_;
+  std::atomic<UserId> next_id_{1};
+};
+
+#endif
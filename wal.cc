@@ -0,0 +1,406 @@
+#include "wal.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using csce662::LogRecord;
+
+namespace {
+
+const size_t kHeaderSize = 8;  // u32 length + u32 crc32
+
+void putU32(std::string* out, uint32_t v) {
+  char b[4];
+  memcpy(b, &v, 4);
+  out->append(b, 4);
+}
+
+uint32_t getU32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+bool writeAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// makes a new or removed file in dir survive a crash
+bool syncDir(const std::string& dir) {
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return false;
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+bool readFile(int fd, std::string* data) {
+  char buf[1 << 16];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    data->append(buf, n);
+  return n == 0;
+}
+
+}  // namespace
+
+uint32_t crc32(const char* data, size_t len, uint32_t crc) {
+  static uint32_t table[256];
+  static bool init = [] {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+    return true;
+  }();
+  (void)init;
+
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++)
+    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+WriteAheadLog::WriteAheadLog(size_t segment_bytes) : segment_bytes_(segment_bytes) {}
+
+WriteAheadLog::~WriteAheadLog() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  if (committer_.joinable())
+    committer_.join();
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+std::string WriteAheadLog::segmentPath(uint64_t first_seq) const {
+  char name[32];
+  snprintf(name, sizeof(name), "wal-%020" PRIu64 ".log", first_seq);
+  return dir_ + "/" + name;
+}
+
+bool WriteAheadLog::open(const std::string& dir, const ApplyFn& apply, std::string* error, uint64_t after_seq) {
+  dir_ = dir;
+
+  // the single-file log of earlier versions holds records from 1 on
+  std::string legacy = dir + "/wal.log";
+  if (access(legacy.c_str(), F_OK) == 0 && rename(legacy.c_str(), segmentPath(1).c_str()) != 0) {
+    *error = legacy + ": " + strerror(errno);
+    return false;
+  }
+
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    *error = dir + ": " + strerror(errno);
+    return false;
+  }
+  while (dirent* entry = readdir(d)) {
+    uint64_t first;
+    if (sscanf(entry->d_name, "wal-%" SCNu64 ".log", &first) == 1 &&
+        segmentPath(first) == dir + "/" + entry->d_name)
+      segments_[first] = dir + "/" + entry->d_name;
+  }
+  closedir(d);
+
+  uint64_t seq = after_seq;   // everything up to here is applied or covered
+  uint64_t tail_end = 0;      // seq the last segment's records end at
+  for (auto it = segments_.begin(); it != segments_.end(); ++it) {
+    auto next = std::next(it);
+    bool last = next == segments_.end();
+    // entirely covered by the snapshot
+    if (!last && next->first <= after_seq + 1)
+      continue;
+    if (it->first > seq + 1) {
+      *error = "log records " + std::to_string(seq + 1) + " to " + std::to_string(it->first - 1) + " are missing";
+      return false;
+    }
+
+    int fd = ::open(it->second.c_str(), O_RDWR);
+    std::string data;
+    if (fd < 0 || !readFile(fd, &data)) {
+      *error = it->second + ": " + strerror(errno);
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+
+    size_t off = 0;
+    uint64_t record_seq = it->first;
+    LogRecord record;
+    while (off + kHeaderSize <= data.size()) {
+      uint32_t len = getU32(data.data() + off);
+      uint32_t crc = getU32(data.data() + off + 4);
+      if (off + kHeaderSize + len > data.size())
+        break;
+      const char* payload = data.data() + off + kHeaderSize;
+      if (crc32(payload, len) != crc || !record.ParseFromArray(payload, len))
+        break;
+      // replaying over a snapshot: what it covers is already in memory
+      if (record_seq > after_seq)
+        apply(record);
+      off += kHeaderSize + len;
+      record_seq++;
+    }
+    if (record_seq - 1 > seq)
+      seq = record_seq - 1;
+
+    if (off != data.size()) {
+      // only the segment being written when we stopped can have a torn tail
+      if (!last) {
+        close(fd);
+        *error = it->second + ": corrupt record at offset " + std::to_string(off);
+        return false;
+      }
+      if (ftruncate(fd, off) != 0) {
+        *error = it->second + ": " + strerror(errno);
+        close(fd);
+        return false;
+      }
+    }
+
+    if (last) {
+      // keep appending to the last segment
+      fd_ = fd;
+      segment_size_ = off;
+      tail_end = record_seq - 1;
+      if (lseek(fd_, off, SEEK_SET) < 0) {
+        *error = it->second + ": " + strerror(errno);
+        return false;
+      }
+    } else {
+      close(fd);
+    }
+  }
+
+  last_seq_ = seq;
+  durable_seq_ = last_seq_;
+
+  // a segment's name says where its records start, so if the snapshot is
+  // ahead of the last segment, new records need a segment of their own
+  if ((fd_ < 0 || tail_end != last_seq_) && !startSegment(last_seq_ + 1)) {
+    *error = segmentPath(last_seq_ + 1) + ": " + strerror(errno);
+    return false;
+  }
+
+  committer_ = std::thread(&WriteAheadLog::committerLoop, this);
+  return true;
+}
+
+bool WriteAheadLog::startSegment(uint64_t first_seq) {
+  std::string path = segmentPath(first_seq);
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || !syncDir(dir_)) {
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  if (fd_ >= 0)
+    close(fd_);
+  fd_ = fd;
+  segment_size_ = 0;
+
+  std::lock_guard<std::mutex> lock(mu_);
+  segments_[first_seq] = path;
+  return true;
+}
+
+uint64_t WriteAheadLog::append(const LogRecord& record) {
+  std::string payload;
+  record.SerializeToString(&payload);
+
+  std::lock_guard<std::mutex> lock(mu_);
+  putU32(&pending_, payload.size());
+  putU32(&pending_, crc32(payload.data(), payload.size()));
+  pending_ += payload;
+  uint64_t seq = ++last_seq_;
+  work_cv_.notify_one();
+  return seq;
+}
+
+bool WriteAheadLog::sync(uint64_t seq) {
+  std::unique_lock<std::mutex> lock(mu_);
+  durable_cv_.wait(lock, [this, seq] { return failed_ || durable_seq_ >= seq; });
+  return durable_seq_ >= seq;
+}
+
+void WriteAheadLog::onDurable(uint64_t seq, DurableFn done) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (durable_seq_ < seq && !failed_) {
+      waiters_.emplace(seq, std::move(done));
+      return;
+    }
+  }
+  done(durableSeq() >= seq);
+}
+
+uint64_t WriteAheadLog::durableSeq() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return durable_seq_;
+}
+
+uint64_t WriteAheadLog::lastSeq() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return last_seq_;
+}
+
+void WriteAheadLog::compact(uint64_t seq) {
+  std::vector<std::string> doomed;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    // a segment ends where the next one starts; the last one is still open
+    while (segments_.size() > 1 && std::next(segments_.begin())->first <= seq + 1) {
+      doomed.push_back(segments_.begin()->second);
+      segments_.erase(segments_.begin());
+    }
+  }
+  for (const std::string& path : doomed)
+    unlink(path.c_str());
+  if (!doomed.empty())
+    syncDir(dir_);
+}
+
+uint64_t WriteAheadLog::waitPast(uint64_t seq, std::chrono::milliseconds timeout) const {
+  std::unique_lock<std::mutex> lock(mu_);
+  durable_cv_.wait_for(lock, timeout, [this, seq] { return failed_ || durable_seq_ > seq; });
+  return durable_seq_;
+}
+
+WriteAheadLog::Reader::~Reader() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool WriteAheadLog::Reader::openSegment(std::string* error) {
+  std::string path;
+  uint64_t first;
+  {
+    // the segment holding the next record starts at or before it
+    std::lock_guard<std::mutex> lock(log_.mu_);
+    auto it = log_.segments_.upper_bound(seq_ + 1);
+    if (it == log_.segments_.begin()) {
+      *error = "log records after " + std::to_string(seq_) + " were compacted away";
+      return false;
+    }
+    --it;
+    first = it->first;
+    path = it->second;
+  }
+  if (fd_ >= 0 && first == segment_first_) {
+    *error = "log record " + std::to_string(seq_ + 1) + " is missing";
+    return false;
+  }
+
+  // an open segment stays readable even if compaction deletes it
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    *error = errno == ENOENT ? "log records after " + std::to_string(seq_) + " were compacted away"
+                             : path + ": " + strerror(errno);
+    return false;
+  }
+  if (fd_ >= 0)
+    close(fd_);
+  fd_ = fd;
+  segment_first_ = first;
+  offset_ = 0;
+  offset_seq_ = first;
+  return true;
+}
+
+bool WriteAheadLog::Reader::read(size_t max_bytes, std::vector<std::string>* records, std::string* error) {
+  // records past durableSeq() may still be half-written
+  uint64_t durable = log_.durableSeq();
+  size_t bytes = 0;
+  while (seq_ < durable && bytes < max_bytes) {
+    if (fd_ < 0 && !openSegment(error))
+      return false;
+
+    char header[kHeaderSize];
+    ssize_t n = pread(fd_, header, kHeaderSize, offset_);
+    if (n == 0) {
+      // the end of a finished segment: the next one starts with our record
+      if (!openSegment(error))
+        return false;
+      continue;
+    }
+    uint32_t len = n == (ssize_t)kHeaderSize ? getU32(header) : 0;
+    std::string payload(len, '\0');
+    if (n != (ssize_t)kHeaderSize || pread(fd_, &payload[0], len, offset_ + kHeaderSize) != (ssize_t)len ||
+        crc32(payload.data(), len) != getU32(header + 4)) {
+      *error = "cannot read log record " + std::to_string(offset_seq_);
+      return false;
+    }
+    offset_ += kHeaderSize + len;
+    // the records a segment holds before ours are skipped
+    if (offset_seq_++ <= seq_)
+      continue;
+    records->push_back(std::move(payload));
+    bytes += len;
+    seq_++;
+  }
+  return true;
+}
+
+void WriteAheadLog::completeLocked(std::vector<DurableFn>* ready, bool ok) {
+  auto end = ok ? waiters_.upper_bound(durable_seq_) : waiters_.end();
+  for (auto it = waiters_.begin(); it != end; ++it)
+    ready->push_back(std::move(it->second));
+  waiters_.erase(waiters_.begin(), end);
+}
+
+void WriteAheadLog::committerLoop() {
+  std::string batch;
+  while (true) {
+    uint64_t batch_seq;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      work_cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+      if (pending_.empty())
+        return;
+      // take everything queued so far; new appends start the next batch
+      batch.clear();
+      batch.swap(pending_);
+      batch_seq = last_seq_;
+    }
+
+    bool ok = !failed_ && writeAll(fd_, batch.data(), batch.size()) && fdatasync(fd_) == 0;
+    // a batch never straddles two segments
+    segment_size_ += batch.size();
+    if (ok && segment_size_ >= segment_bytes_)
+      ok = startSegment(batch_seq + 1);
+
+    std::vector<DurableFn> ready;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (ok)
+        durable_seq_ = batch_seq;
+      else
+        failed_ = true;
+      completeLocked(&ready, ok);
+    }
+    durable_cv_.notify_all();
+    for (DurableFn& done : ready)
+      done(ok);
+  }
+}
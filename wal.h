@@ -0,0 +1,131 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sns.pb.h"
+
+// CRC-32 (IEEE), continuing from crc so data can be fed in pieces
+uint32_t crc32(const char* data, size_t len, uint32_t crc = 0);
+
+/*
+ * Append-only log of every state change the server makes.
+ *
+ * The log is a directory of segment files, wal-<seq>.log, each named after
+ * the sequence number of its first record; a new segment is started once
+ * the current one passes segment_bytes. Segments that a snapshot already
+ * covers can then be deleted whole (compact()).
+ *
+ * Each record is stored as [length][crc32][LogRecord bytes]. append() only
+ * encodes the record into an in-memory buffer and hands back its sequence
+ * number, so it is cheap enough to call while holding the lock that ordered
+ * the change. A single committer thread writes whatever has accumulated and
+ * issues one fdatasync for the whole batch (group commit): while one fsync
+ * is in flight, the next batch builds up behind it, so the number of fsyncs
+ * grows with time rather than with the number of records.
+ */
+class WriteAheadLog {
+public:
+  using ApplyFn = std::function<void(const csce662::LogRecord&)>;
+  using DurableFn = std::function<void(bool)>;
+
+  explicit WriteAheadLog(size_t segment_bytes = 64 << 20);
+  ~WriteAheadLog();
+
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+  // replays every intact record after after_seq (what a snapshot already
+  // covers) through apply, cuts off a torn tail left by a crash, and starts
+  // the committer. A wal.log from before segments is taken as the first one
+  bool open(const std::string& dir, const ApplyFn& apply, std::string* error, uint64_t after_seq = 0);
+
+  // queues the record and returns its sequence number
+  uint64_t append(const csce662::LogRecord& record);
+
+  // blocks until every record up to seq is on disk; false if the log failed
+  bool sync(uint64_t seq);
+
+  // runs done(ok) once every record up to seq is on disk, on the committer
+  // thread (or right away if it already is)
+  void onDurable(uint64_t seq, DurableFn done);
+
+  uint64_t durableSeq() const;
+
+  // sequence number of the last record appended
+  uint64_t lastSeq() const;
+
+  // deletes the segments holding only records up to seq; the one being
+  // written to is always kept
+  void compact(uint64_t seq);
+
+  // waits up to timeout for records after seq to be on disk; returns
+  // durableSeq()
+  uint64_t waitPast(uint64_t seq, std::chrono::milliseconds timeout) const;
+
+  /*
+   * Reads the records that are on disk, in order, e.g. to ship them to a
+   * replica. It reads the segment files themselves, so it follows the log
+   * across new segments, but fails once the records it needs next were
+   * compacted away.
+   */
+  class Reader {
+  public:
+    Reader(const WriteAheadLog& log, uint64_t after_seq) : log_(log), seq_(after_seq) {}
+    ~Reader();
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    // appends the next records on disk (serialized LogRecords), about
+    // max_bytes of them at most; none if there are no new ones yet
+    bool read(size_t max_bytes, std::vector<std::string>* records, std::string* error);
+
+    // the last record read
+    uint64_t seq() const { return seq_; }
+
+  private:
+    bool openSegment(std::string* error);
+
+    const WriteAheadLog& log_;
+    uint64_t seq_;
+    int fd_ = -1;
+    uint64_t segment_first_ = 0;
+    uint64_t offset_ = 0;          // of the next record in the segment
+    uint64_t offset_seq_ = 0;      // and its sequence number
+  };
+
+private:
+  void committerLoop();
+  void completeLocked(std::vector<DurableFn>* ready, bool ok);
+  bool startSegment(uint64_t first_seq);
+  std::string segmentPath(uint64_t first_seq) const;
+
+  const size_t segment_bytes_;
+  std::string dir_;
+  int fd_ = -1;
+  size_t segment_size_ = 0;          // bytes in the current segment
+  std::map<uint64_t, std::string> segments_;   // first seq -> path, guarded by mu_
+
+  mutable std::mutex mu_;
+  std::condition_variable work_cv_;
+  mutable std::condition_variable durable_cv_;
+  std::string pending_;           // encoded records not yet written
+  uint64_t last_seq_ = 0;         // last sequence number handed out
+  uint64_t durable_seq_ = 0;      // everything up to here is on disk
+  bool failed_ = false;
+  bool stopping_ = false;
+  std::multimap<uint64_t, DurableFn> waiters_;
+
+  std::thread committer_;
+};
+
+#endif